@@ -0,0 +1,137 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "batch.h"
+
+// Jobs head..tail-1 of one thread's share, still to be run
+typedef struct dequeStruct {
+    pthread_mutex_t lock;
+    int head;
+    int tail;
+} dequeType;
+
+typedef struct poolStruct {
+    dequeType *deques;
+    int numThreads;
+    batchJobFn run;
+    void *ctx;
+} poolType;
+
+typedef struct workerStruct {
+    poolType *pool;
+    int id;
+} workerType;
+
+int batch_default_threads() {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+}
+
+// The next job of the thread's own deque, or -1 if it is empty
+static int popFront(dequeType *d) {
+    int job = -1;
+    pthread_mutex_lock(&d->lock);
+    if (d->head < d->tail) {
+        job = d->head++;
+    }
+    pthread_mutex_unlock(&d->lock);
+    return job;
+}
+
+// The last job of another thread's deque, or -1 if it is empty
+static int popBack(dequeType *d) {
+    int job = -1;
+    pthread_mutex_lock(&d->lock);
+    if (d->head < d->tail) {
+        job = --d->tail;
+    }
+    pthread_mutex_unlock(&d->lock);
+    return job;
+}
+
+static void *worker(void *arg) {
+    workerType *self = arg;
+    poolType *pool = self->pool;
+    for (;;) {
+        int job = popFront(&pool->deques[self->id]);
+        // no jobs are ever added, so once every deque is empty we are done
+        for (int i = 1; job < 0 && i < pool->numThreads; ++i) {
+            job = popBack(&pool->deques[(self->id + i) % pool->numThreads]);
+        }
+        if (job < 0) {
+            return NULL;
+        }
+        pool->run(pool->ctx, job);
+    }
+}
+
+void batch_run(int numJobs, int numThreads, batchJobFn run, void *ctx) {
+    if (numThreads < 1) {
+        numThreads = 1;
+    }
+    if (numThreads > numJobs) {
+        numThreads = numJobs > 0 ? numJobs : 1;
+    }
+    poolType pool = {NULL, numThreads, run, ctx};
+    pool.deques = calloc(numThreads, sizeof(dequeType));
+    workerType *workers = calloc(numThreads, sizeof(workerType));
+    pthread_t *threads = calloc(numThreads, sizeof(pthread_t));
+    if (pool.deques == NULL || workers == NULL || threads == NULL) {
+        printf("error: out of memory\n");
+        exit(1);
+    }
+    for (int i = 0; i < numThreads; ++i) {
+        pthread_mutex_init(&pool.deques[i].lock, NULL);
+        pool.deques[i].head = (long long)numJobs * i / numThreads;
+        pool.deques[i].tail = (long long)numJobs * (i + 1) / numThreads;
+        workers[i].pool = &pool;
+        workers[i].id = i;
+    }
+
+    // the calling thread is worker 0
+    for (int i = 1; i < numThreads; ++i) {
+        if (pthread_create(&threads[i], NULL, worker, &workers[i]) != 0) {
+            printf("error: can't start worker thread\n");
+            exit(1);
+        }
+    }
+    worker(&workers[0]);
+    for (int i = 1; i < numThreads; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+
+    for (int i = 0; i < numThreads; ++i) {
+        pthread_mutex_destroy(&pool.deques[i].lock);
+    }
+    free(pool.deques);
+    free(workers);
+    free(threads);
+}
+
+#define BARRIER_SPINS 100 // polls before a waiting thread starts yielding
+
+void batch_barrier_init(barrierType *b, int numThreads) {
+    atomic_init(&b->remaining, numThreads);
+    atomic_init(&b->sense, 0);
+    b->numThreads = numThreads;
+}
+
+void batch_barrier_wait(barrierType *b, int *sense, batchSerialFn serial, void *ctx) {
+    *sense = !*sense;
+    if (atomic_fetch_sub(&b->remaining, 1) == 1) {
+        if (serial != NULL) {
+            serial(ctx);
+        }
+        atomic_store(&b->remaining, b->numThreads);
+        atomic_store(&b->sense, *sense);
+        return;
+    }
+    for (int spins = 0; atomic_load(&b->sense) != *sense; ++spins) {
+        if (spins >= BARRIER_SPINS) {
+            sched_yield();
+        }
+    }
+}
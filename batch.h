@@ -0,0 +1,36 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stdatomic.h>
+
+/*
+ * A pool of threads for running many independent jobs, numbered 0 to
+ * numJobs-1. Each thread starts with a contiguous share of the jobs in a
+ * deque of its own, works through it from the front and, once it runs
+ * dry, steals from the back of another thread's deque. run() is called
+ * exactly once per job and must only touch state belonging to that job.
+ */
+typedef void (*batchJobFn)(void *ctx, int job);
+
+int batch_default_threads();
+void batch_run(int numJobs, int numThreads, batchJobFn run, void *ctx);
+
+/*
+ * A barrier for jobs that run in lockstep, one thread each (so numJobs
+ * equal to numThreads above). It never locks: a thread arriving counts
+ * itself off and spins, yielding its core after a while, until the last
+ * one to arrive has run serial(ctx), alone, and flipped the barrier's
+ * sense. Each thread keeps its own sense, starting at 0.
+ */
+typedef void (*batchSerialFn)(void *ctx);
+
+typedef struct barrierStruct {
+    atomic_int remaining; // threads yet to arrive
+    atomic_int sense; // flipped each time the barrier opens
+    int numThreads;
+} barrierType;
+
+void batch_barrier_init(barrierType *b, int numThreads);
+void batch_barrier_wait(barrierType *b, int *sense, batchSerialFn serial, void *ctx);
+
+#endif
@@ -0,0 +1,436 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "cache.h"
+#include "image.h"
+#include "lc2k.h"
+#include "trace.h"
+#include "workload.h"
+
+/*
+ * Host throughput benchmarks for the pipeline simulator and the cache model.
+ *
+ * build: gcc -O2 -o bench bench.c workload.c image.c cache.c trace.c checkpoint.c
+ * usage: bench [--simulator <path>] [--repeat <n>] [--only <prefix>]
+ *              [--baseline <file>] [--tolerance <percent>] [--save <file>]
+ *
+ * The simulator cases generate a workload (see workload.h), run it through
+ * the simulator binary (./simulator unless --simulator says otherwise) with
+ * tracing off, and report host nanoseconds per simulated cycle and, when
+ * the case has caches, icache plus dcache accesses per second. Times are
+ * the child's user plus system CPU time, the best of --repeat runs (3 by
+ * default).
+ *
+ * The cache cases drive cache.c directly, a few million cacheAccess()
+ * calls over a strided or random address stream, and report accesses per
+ * second. The -batch ones make the same accesses to the same memory through
+ * cacheAccessBatch() instead, so they differ from their per-access twins
+ * only in the batching.
+ *
+ * --save writes the results as name,metric,value CSV. --baseline compares
+ * against such a file (bench.baseline.csv is the stored one) and exits
+ * with status 1 if any result is more than --tolerance percent (10 by
+ * default) worse. --only runs just the cases whose names start with prefix.
+ */
+
+typedef struct simCaseStruct {
+    const char *name;
+    const char *workload;
+    const char *options[12]; // extra simulator options, NULL terminated
+} simCaseType;
+
+static const simCaseType simCases[] = {
+    {"loaduse", "loaduse,iterations=200000,length=32", {NULL}},
+    {"branch-nottaken", "branch,iterations=200000,length=32", {NULL}},
+    {"branch-gshare", "branch,iterations=200000,length=32", {"--predictor", "gshare", NULL}},
+    {"forward-exmem", "forward,iterations=200000,length=32,distance=1", {NULL}},
+    {"forward-memwb", "forward,iterations=200000,length=32,distance=2", {NULL}},
+    {"forward-wbend", "forward,iterations=200000,length=32,distance=3", {NULL}},
+    {"stride-caches", "stride,iterations=200,stride=4,footprint=16384",
+            {"--icache", "4,16,4", "--dcache", "4,64,4", NULL}},
+    {"random-caches", "random,iterations=100,footprint=8192",
+            {"--icache", "4,16,4", "--dcache", "4,64,4", NULL}},
+    {"stride-prefetch", "stride,iterations=200,stride=4,footprint=16384",
+            {"--icache", "4,16,4", "--dcache", "4,64,4", "--icache-prefetch", "nextline",
+             "--dcache-prefetch", "stride,2,1", NULL}},
+};
+
+typedef struct cacheCaseStruct {
+    const char *name;
+    int geometry[3]; // blockSize, numSets, blocksPerSet
+    int policy;
+    int stride; // words between accesses, or 0 for random addresses
+    int batch; // accesses per cacheAccessBatch() call, or 0 for cacheAccess()
+} cacheCaseType;
+
+static const cacheCaseType cacheCases[] = {
+    {"cache-stride-lru", {4, 64, 4}, REPLACE_LRU, 1, 0},
+    {"cache-stride16-lru", {4, 64, 4}, REPLACE_LRU, 16, 0},
+    {"cache-random-lru", {8, 32, 8}, REPLACE_LRU, 0, 0},
+    {"cache-random-plru", {8, 32, 8}, REPLACE_PLRU, 0, 0},
+    {"cache-random-srrip", {8, 32, 8}, REPLACE_SRRIP, 0, 0},
+    {"cache-random-fifo", {8, 32, 8}, REPLACE_FIFO, 0, 0},
+    {"cache-stride-batch", {4, 64, 4}, REPLACE_LRU, 1, 256},
+    {"cache-random-batch", {8, 32, 8}, REPLACE_LRU, 0, 256},
+};
+
+#define CACHE_BENCH_ACCESSES (4 << 20)
+#define CACHE_BENCH_WRITE_ODDS 4 // one access in this many is a store
+
+#define MAX_RESULTS 64
+#define MAX_NAME 64
+
+typedef struct resultStruct {
+    char name[MAX_NAME];
+    char metric[MAX_NAME]; // nsPerCycle (lower is better) or accessesPerSec
+    double value;
+} resultType;
+
+static resultType results[MAX_RESULTS];
+static int numResults;
+
+// cache.c's course interface wants these; the benchmarks never use it
+int mem_access(int addr, int write_flag, int write_data) {
+    printf("error: mem_access(%d, %d, %d) reached the unused global cache\n", addr, write_flag, write_data);
+    exit(1);
+}
+
+int get_num_mem_accesses() {
+    return 0;
+}
+
+static void addResult(const char *name, const char *metric, double value) {
+    if (numResults == MAX_RESULTS) {
+        printf("error: more than %d results\n", MAX_RESULTS);
+        exit(1);
+    }
+    resultType *r = &results[numResults++];
+    snprintf(r->name, sizeof(r->name), "%s", name);
+    snprintf(r->metric, sizeof(r->metric), "%s", metric);
+    r->value = value;
+}
+
+static double seconds(struct timeval tv) {
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+// Run the simulator, stdout discarded, and return its CPU time in seconds
+static double runSimulator(char **args) {
+    pid_t pid = fork();
+    if (pid < 0) {
+        printf("error: can't fork\n");
+        exit(1);
+    }
+    if (pid == 0) {
+        int devNull = open("/dev/null", O_WRONLY);
+        if (devNull >= 0) {
+            dup2(devNull, STDOUT_FILENO);
+        }
+        execv(args[0], args);
+        fprintf(stderr, "error: can't run %s\n", args[0]);
+        _exit(127);
+    }
+    int status;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        printf("error: %s failed\n", args[0]);
+        exit(1);
+    }
+    return seconds(usage.ru_utime) + seconds(usage.ru_stime);
+}
+
+// The named column of the (single record) CSV stats file
+static long long statsColumn(const char *filename, const char *column) {
+    FILE *in = fopen(filename, "r");
+    char header[1024], row[1024];
+    if (in == NULL || fgets(header, sizeof(header), in) == NULL || fgets(row, sizeof(row), in) == NULL) {
+        printf("error: can't read stats file %s\n", filename);
+        exit(1);
+    }
+    fclose(in);
+    char *headerSave, *rowSave;
+    char *name = strtok_r(header, ",\n", &headerSave);
+    char *value = strtok_r(row, ",\n", &rowSave);
+    while (name != NULL && value != NULL) {
+        if (!strcmp(name, column)) {
+            return atoll(value);
+        }
+        name = strtok_r(NULL, ",\n", &headerSave);
+        value = strtok_r(NULL, ",\n", &rowSave);
+    }
+    printf("error: no %s in stats file %s\n", column, filename);
+    exit(1);
+}
+
+static void benchSimulator(const simCaseType *sc, const char *simulator, const char *dir, int repeat, int *words) {
+    workloadType w;
+    if (workload_parse(sc->workload, &w) < 0) {
+        exit(1);
+    }
+    char image[256], stats[256];
+    snprintf(image, sizeof(image), "%s/%s.img", dir, sc->name);
+    snprintf(stats, sizeof(stats), "%s/%s.csv", dir, sc->name);
+    image_write(image, words, workload_generate(&w, words, NUMMEMORY));
+
+    char *args[32];
+    int n = 0;
+    args[n++] = (char *)simulator;
+    args[n++] = "--trace";
+    args[n++] = "off";
+    args[n++] = "--stats";
+    args[n++] = stats;
+    for (int i = 0; sc->options[i] != NULL; ++i) {
+        args[n++] = (char *)sc->options[i];
+    }
+    args[n++] = image;
+    args[n] = NULL;
+
+    double best = 0.0;
+    for (int i = 0; i < repeat; ++i) {
+        double t = runSimulator(args);
+        if (i == 0 || t < best) {
+            best = t;
+        }
+    }
+    long long cycles = statsColumn(stats, "cycles");
+    long long accesses = statsColumn(stats, "icacheHits") + statsColumn(stats, "icacheMisses")
+            + statsColumn(stats, "dcacheHits") + statsColumn(stats, "dcacheMisses");
+    addResult(sc->name, "nsPerCycle", cycles ? best * 1e9 / cycles : 0.0);
+    if (accesses) {
+        addResult(sc->name, "accessesPerSec", best > 0.0 ? accesses / best : 0.0);
+    }
+    unlink(image);
+    unlink(stats);
+}
+
+// Flat memory below the benchmarked cache
+static int benchMemAccess(void *ctx, int addr, int write_flag, int write_data) {
+    int *mem = ctx;
+    addr &= NUMMEMORY - 1;
+    if (write_flag) {
+        mem[addr] = write_data;
+        return 0;
+    }
+    return mem[addr];
+}
+
+static double cpuSeconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// The same accesses as benchCache's loop, batch at a time
+static int benchBatches(cacheStruct *c, const cacheRequestType *requests, int batch) {
+    int out[batch];
+    int sum = 0;
+    for (int i = 0; i < CACHE_BENCH_ACCESSES; i += batch) {
+        int n = CACHE_BENCH_ACCESSES - i < batch ? CACHE_BENCH_ACCESSES - i : batch;
+        cacheAccessBatch(c, requests + i, n, out);
+        for (int j = 0; j < n; ++j) {
+            sum += out[j];
+        }
+    }
+    return sum;
+}
+
+static void benchCache(const cacheCaseType *cc, int repeat, int *mem) {
+    int *addrs = malloc(CACHE_BENCH_ACCESSES * sizeof(int));
+    cacheRequestType *requests = malloc(CACHE_BENCH_ACCESSES * sizeof(cacheRequestType));
+    cacheStruct *c = malloc(sizeof(cacheStruct));
+    if (addrs == NULL || requests == NULL || c == NULL) {
+        printf("error: out of memory\n");
+        exit(1);
+    }
+    unsigned int rng = 1;
+    for (int i = 0; i < CACHE_BENCH_ACCESSES; ++i) {
+        rng = rng * 1103515245 + 12345;
+        addrs[i] = (cc->stride ? i * cc->stride : (int)(rng >> 8)) & (NUMMEMORY - 1);
+        int store = i % CACHE_BENCH_WRITE_ODDS == 0;
+        requests[i] = (cacheRequestType){addrs[i], store, store ? i : 0};
+    }
+
+    double best = 0.0;
+    for (int r = 0; r < repeat; ++r) {
+        cacheSetup(c, cc->geometry[0], cc->geometry[1], cc->geometry[2], cc->policy, benchMemAccess, mem);
+        int sum = 0;
+        double start = cpuSeconds();
+        if (cc->batch) {
+            sum = benchBatches(c, requests, cc->batch);
+        }
+        else {
+            for (int i = 0; i < CACHE_BENCH_ACCESSES; ++i) {
+                if (i % CACHE_BENCH_WRITE_ODDS == 0) {
+                    cacheAccess(c, addrs[i], 1, i);
+                }
+                else {
+                    sum += cacheAccess(c, addrs[i], 0, 0);
+                }
+            }
+        }
+        double t = cpuSeconds() - start;
+        cacheFree(c);
+        if (sum == 42) {
+            printf(" "); // keep the loads live
+        }
+        if (r == 0 || t < best) {
+            best = t;
+        }
+    }
+    addResult(cc->name, "accessesPerSec", best > 0.0 ? CACHE_BENCH_ACCESSES / best : 0.0);
+    free(addrs);
+    free(requests);
+    free(c);
+}
+
+static void saveResults(const char *filename) {
+    FILE *out = fopen(filename, "w");
+    if (out == NULL) {
+        printf("error: can't open file %s\n", filename);
+        exit(1);
+    }
+    fprintf(out, "name,metric,value\n");
+    for (int i = 0; i < numResults; ++i) {
+        fprintf(out, "%s,%s,%.4f\n", results[i].name, results[i].metric, results[i].value);
+    }
+    if (fclose(out) != 0) {
+        printf("error: can't write file %s\n", filename);
+        exit(1);
+    }
+}
+
+/*
+ * Print the results next to the baseline's, as how much worse (positive)
+ * or better each is, and return how many are worse by more than tolerance
+ * percent. Lines of the baseline starting with # are comments.
+ */
+static int compareBaseline(const char *filename, double tolerance) {
+    FILE *in = filename != NULL ? fopen(filename, "r") : NULL;
+    if (filename != NULL && in == NULL) {
+        printf("error: can't open file %s\n", filename);
+        exit(1);
+    }
+    resultType base[MAX_RESULTS];
+    int numBase = 0;
+    char line[256];
+    while (in != NULL && fgets(line, sizeof(line), in) != NULL) {
+        resultType *b = &base[numBase];
+        if (line[0] == '#' || numBase == MAX_RESULTS
+                || sscanf(line, "%63[^,],%63[^,],%lf", b->name, b->metric, &b->value) != 3) {
+            continue; // comments, and the column names
+        }
+        numBase++;
+    }
+    if (in != NULL) {
+        fclose(in);
+    }
+
+    int regressions = 0;
+    printf("%-20s %-15s %15s %15s %9s\n", "case", "metric", "value", "baseline", "change");
+    for (int i = 0; i < numResults; ++i) {
+        const resultType *r = &results[i];
+        const resultType *b = NULL;
+        for (int j = 0; j < numBase; ++j) {
+            if (!strcmp(base[j].name, r->name) && !strcmp(base[j].metric, r->metric)) {
+                b = &base[j];
+            }
+        }
+        printf("%-20s %-15s %15.3f", r->name, r->metric, r->value);
+        if (b == NULL || b->value <= 0.0 || r->value <= 0.0) {
+            printf("\n");
+            continue;
+        }
+        // Worse is slower: more ns per cycle, or fewer accesses per second
+        double ratio = !strcmp(r->metric, "nsPerCycle") ? r->value / b->value : b->value / r->value;
+        double worse = (ratio - 1.0) * 100.0;
+        int regressed = worse > tolerance;
+        regressions += regressed;
+        printf(" %15.3f %+8.1f%%%s\n", b->value, worse, regressed ? "  REGRESSION" : "");
+    }
+    return regressions;
+}
+
+static void usage(const char *name) {
+    printf("error: usage: %s [--simulator <path>] [--repeat <n>] [--only <prefix>] [--baseline <file>] [--tolerance <percent>] [--save <file>]\n", name);
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    const char *simulator = "./simulator";
+    const char *only = "";
+    const char *baseline = NULL;
+    const char *save = NULL;
+    int repeat = 3;
+    double tolerance = 10.0;
+    for (int i = 1; i < argc; ++i) {
+        if (i + 1 == argc) {
+            usage(argv[0]);
+        }
+        if (!strcmp(argv[i], "--simulator")) {
+            simulator = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--repeat")) {
+            repeat = atoi(argv[++i]);
+            if (repeat < 1) {
+                printf("error: --repeat must be at least 1\n");
+                exit(1);
+            }
+        }
+        else if (!strcmp(argv[i], "--only")) {
+            only = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--baseline")) {
+            baseline = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--tolerance")) {
+            tolerance = atof(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "--save")) {
+            save = argv[++i];
+        }
+        else {
+            usage(argv[0]);
+        }
+    }
+
+    int *words = calloc(NUMMEMORY, sizeof(int));
+    if (words == NULL) {
+        printf("error: out of memory\n");
+        exit(1);
+    }
+    traceLevel = TRACE_OFF; // cache.c prints every transfer by default
+    char dir[] = "/tmp/benchXXXXXX";
+    if (mkdtemp(dir) == NULL) {
+        printf("error: can't make a temporary directory\n");
+        exit(1);
+    }
+    for (int i = 0; i < (int)(sizeof(simCases) / sizeof(simCases[0])); ++i) {
+        if (!strncmp(simCases[i].name, only, strlen(only))) {
+            benchSimulator(&simCases[i], simulator, dir, repeat, words);
+        }
+    }
+    rmdir(dir);
+    for (int i = 0; i < (int)(sizeof(cacheCases) / sizeof(cacheCases[0])); ++i) {
+        if (!strncmp(cacheCases[i].name, only, strlen(only))) {
+            benchCache(&cacheCases[i], repeat, words);
+        }
+    }
+    free(words);
+
+    int regressions = compareBaseline(baseline, tolerance);
+    if (save != NULL) {
+        saveResults(save);
+    }
+    if (regressions) {
+        printf("%d result%s more than %.1f%% worse than %s\n", regressions,
+                regressions == 1 ? "" : "s", tolerance, baseline);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,156 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bpred.h"
+#include "checkpoint.h"
+
+static const char *predictorNames[] = {"nottaken", "btfn", "bimodal", "gshare", "btb"};
+
+int bpred_parse_kind(const char *name) {
+    for (int kind = PREDICT_NOT_TAKEN; kind <= PREDICT_BTB; ++kind) {
+        if (!strcmp(name, predictorNames[kind])) {
+            return kind;
+        }
+    }
+    return -1;
+}
+
+const char *bpred_name(int kind) {
+    return predictorNames[kind];
+}
+
+void bpred_init(predictorType *bp, int kind, int entries, int historyBits) {
+    memset(bp, 0, sizeof(*bp));
+    bp->kind = kind;
+    if (entries <= 0 || (entries & (entries - 1)) != 0) {
+        printf("error: predictor entries must be a power of two\n");
+        exit(1);
+    }
+    if (historyBits < 1 || historyBits > 30) {
+        printf("error: predictor history must be 1 to 30 bits\n");
+        exit(1);
+    }
+    bp->entries = entries;
+    bp->historyBits = historyBits;
+    if (kind == PREDICT_BIMODAL || kind == PREDICT_GSHARE) {
+        bp->counters = malloc(entries);
+        if (bp->counters == NULL) {
+            printf("error: out of memory\n");
+            exit(1);
+        }
+        memset(bp->counters, 1, entries); // weakly not taken
+    }
+    else if (kind == PREDICT_BTB) {
+        bp->btb = calloc(entries, sizeof(btbEntryType));
+        if (bp->btb == NULL) {
+            printf("error: out of memory\n");
+            exit(1);
+        }
+    }
+}
+
+void bpred_free(predictorType *bp) {
+    free(bp->counters);
+    free(bp->btb);
+    bp->counters = NULL;
+    bp->btb = NULL;
+}
+
+static int counterIndex(predictorType *bp, int pc) {
+    if (bp->kind == PREDICT_GSHARE) {
+        return (pc ^ bp->history) & (bp->entries - 1);
+    }
+    return pc & (bp->entries - 1);
+}
+
+static void train(unsigned char *counter, int taken) {
+    if (taken && *counter < 3) {
+        ++*counter;
+    }
+    else if (!taken && *counter > 0) {
+        --*counter;
+    }
+}
+
+/*
+ * Predict the beq at pc, whose decoded target is target. Returns whether
+ * it is predicted taken, and if so where fetch should continue.
+ */
+int bpred_predict(predictorType *bp, int pc, int target, int *predictedTarget) {
+    *predictedTarget = target;
+    switch (bp->kind) {
+        case PREDICT_BTFN:
+            return target <= pc;
+        case PREDICT_BIMODAL:
+        case PREDICT_GSHARE:
+            return bp->counters[counterIndex(bp, pc)] >= 2;
+        case PREDICT_BTB: {
+            btbEntryType *entry = &bp->btb[pc & (bp->entries - 1)];
+            if (!entry->valid || entry->tag != pc) {
+                return 0;
+            }
+            *predictedTarget = entry->target;
+            return entry->counter >= 2;
+        }
+        default:
+            return 0;
+    }
+}
+
+// Train on the resolved outcome of the beq at pc
+void bpred_update(predictorType *bp, int pc, int taken, int target) {
+    switch (bp->kind) {
+        case PREDICT_BIMODAL:
+            train(&bp->counters[counterIndex(bp, pc)], taken);
+            break;
+        case PREDICT_GSHARE:
+            train(&bp->counters[counterIndex(bp, pc)], taken);
+            bp->history = ((bp->history << 1) | taken) & ((1u << bp->historyBits) - 1);
+            break;
+        case PREDICT_BTB: {
+            btbEntryType *entry = &bp->btb[pc & (bp->entries - 1)];
+            if (entry->valid && entry->tag == pc) {
+                train(&entry->counter, taken);
+                entry->target = target;
+            }
+            else if (taken) { // only taken branches are worth an entry
+                entry->valid = 1;
+                entry->tag = pc;
+                entry->target = target;
+                entry->counter = 2;
+            }
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+void bpred_save(const predictorType *bp, FILE *out) {
+    int config[3] = {bp->kind, bp->entries, bp->historyBits};
+    ckpt_write_int(out, CKPT_SECTION_PREDICTOR);
+    ckpt_write(out, config, sizeof(config));
+    ckpt_write(out, &bp->history, sizeof(bp->history));
+    if (bp->counters != NULL) {
+        ckpt_write(out, bp->counters, bp->entries);
+    }
+    if (bp->btb != NULL) {
+        ckpt_write(out, bp->btb, bp->entries * sizeof(btbEntryType));
+    }
+}
+
+// Read back what bpred_save wrote into bp, set up the same way
+void bpred_restore(predictorType *bp, FILE *in) {
+    ckpt_expect(in, CKPT_SECTION_PREDICTOR, "section");
+    ckpt_expect(in, bp->kind, "predictor");
+    ckpt_expect(in, bp->entries, "predictor entries");
+    ckpt_expect(in, bp->historyBits, "predictor history");
+    ckpt_read(in, &bp->history, sizeof(bp->history));
+    if (bp->counters != NULL) {
+        ckpt_read(in, bp->counters, bp->entries);
+    }
+    if (bp->btb != NULL) {
+        ckpt_read(in, bp->btb, bp->entries * sizeof(btbEntryType));
+    }
+}
@@ -0,0 +1,46 @@
+#ifndef BPRED_H
+#define BPRED_H
+
+#include <stdio.h>
+
+/*
+ * Branch predictors for the IF stage. IF asks for a prediction for every
+ * beq it fetches and MEM reports the outcome once the beq resolves. All
+ * predictor state is only updated on resolution, so fetches thrown away
+ * by stalls and flushes leave no trace.
+ */
+enum predictorKind
+{
+    PREDICT_NOT_TAKEN, // always fetch pc+1 (the original pipeline)
+    PREDICT_BTFN, // backward taken, forward not taken
+    PREDICT_BIMODAL, // table of 2-bit counters indexed by pc
+    PREDICT_GSHARE, // 2-bit counters indexed by pc xor global history
+    PREDICT_BTB // branch target buffer, 2-bit counter per entry
+};
+
+typedef struct btbEntryStruct {
+    int valid;
+    int tag; // pc of the branch
+    int target;
+    unsigned char counter;
+} btbEntryType;
+
+typedef struct predictorStruct {
+    int kind;
+    int entries; // table size, a power of two
+    int historyBits; // gshare only
+    unsigned int history;
+    unsigned char *counters; // bimodal and gshare
+    btbEntryType *btb;
+} predictorType;
+
+int bpred_parse_kind(const char *name);
+const char *bpred_name(int kind);
+void bpred_init(predictorType *bp, int kind, int entries, int historyBits);
+void bpred_free(predictorType *bp);
+int bpred_predict(predictorType *bp, int pc, int target, int *predictedTarget);
+void bpred_update(predictorType *bp, int pc, int taken, int target);
+void bpred_save(const predictorType *bp, FILE *out);
+void bpred_restore(predictorType *bp, FILE *in);
+
+#endif
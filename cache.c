@@ -1,204 +1,1583 @@
 
 #include <stdio.h>
-#include <math.h>
+#include <stdlib.h>
+#include <string.h>
 
-#define MAX_CACHE_SIZE 256
-#define MAX_BLOCK_SIZE 256
+#include "cache.h"
+#include "checkpoint.h"
+#include "trace.h"
 
 extern int mem_access(int addr, int write_flag, int write_data);
 extern int get_num_mem_accesses();
 
-enum actionType
-{
-    cacheToProcessor,
-    processorToCache,
-    memoryToCache,
-    cacheToMemory,
-    cacheToNowhere
-};
-
-typedef struct blockStruct
-{
-    int data[MAX_BLOCK_SIZE];
-    int valid; // ADDED VARIABLE
-    int addy; // ADDED VARIABLE
-    int dirty;
-    int lruLabel;
-    int set;
-    int tag;
-} blockStruct;
-
-typedef struct cacheStruct
-{
-    blockStruct blocks[MAX_CACHE_SIZE];
-    int blockSize;
-    int numSets;
-    int blocksPerSet;
-} cacheStruct;
-
 /* Global Cache variable */
 cacheStruct cache;
 
 void printAction(int, int, enum actionType);
-void printCache();
-void printStats();
+
+// The global cache's memory is the course supplied mem_access()
+static int courseMemAccess(void *ctx, int addr, int write_flag, int write_data) {
+    (void)ctx;
+    return mem_access(addr, write_flag, write_data);
+}
+
+static const char *policyNames[] = {"lru", "plru", "srrip", "brrip", "fifo", "random"};
+static const char *prefetcherNames[] = {"none", "nextline", "stride", "stream"};
+static const char *inclusionNames[] = {"inclusive", "exclusive", "nine"};
+
+#define RRPV_MAX 3 // 2-bit RRIP: 3 is "re-referenced in the distant future"
+#define BRRIP_LONG_ODDS 32 // BRRIP inserts at RRPV_MAX - 1 one fill in this many
 
 /*
  * Set up the cache with given command line parameters. This is 
  * called once in main(). You must implement this function.
  */
 void cache_init(int blockSize, int numSets, int blocksPerSet){
-    cache.blockSize = blockSize;
-    cache.numSets = numSets;
-    cache.blocksPerSet = blocksPerSet;
+    int policy = REPLACE_LRU;
+    char *name = getenv("CACHE_POLICY");
+    if (name != NULL && *name) {
+        policy = cacheParsePolicy(name);
+        if (policy < 0) {
+            printf("error: unknown CACHE_POLICY %s\n", name);
+            exit(1);
+        }
+    }
+    cacheSetup(&cache, blockSize, numSets, blocksPerSet, policy, courseMemAccess, NULL);
+    // no clock here: fills take no time, so prefetches are never late
+    cacheSetLatency(&cache, 0, 0);
+    name = getenv("CACHE_PREFETCH");
+    if (name != NULL && *name) {
+        int kind, degree, distance;
+        if (cacheParsePrefetcher(name, &kind, &degree, &distance) < 0) {
+            printf("error: bad CACHE_PREFETCH %s\n", name);
+            exit(1);
+        }
+        cacheSetPrefetcher(&cache, kind, degree, distance, 0, 0);
+    }
+    name = getenv("CACHE_VICTIM");
+    if (name != NULL && *name) {
+        cacheSetVictimCache(&cache, atoi(name));
+    }
+    trace_init_from_env(TRACE_KIND_CACHE);
     return;
 }
 
+int cache_access(int addr, int write_flag, int write_data) {
+    return cacheAccess(&cache, addr, write_flag, write_data);
+}
 
-// each set has own LRU
-// only update ones below 
-void updateLRU(int curr, int set) {
-    for (int block = 0; block < cache.blocksPerSet; ++block) {
-        if (cache.blocks[set * cache.blocksPerSet + block].lruLabel <= curr) {
-            cache.blocks[set * cache.blocksPerSet + block].lruLabel++;
+int cacheParsePolicy(const char *name) {
+    for (int policy = REPLACE_LRU; policy <= REPLACE_RANDOM; ++policy) {
+        if (!strcmp(name, policyNames[policy])) {
+            return policy;
         }
     }
+    return -1;
 }
 
+const char *cachePolicyName(int policy) {
+    return policyNames[policy];
+}
 
-// Add new block into cache
-void addBlock(int tag, int set, int addr, int startaddy, int block) {
-    cache.blocks[set * cache.blocksPerSet + block].valid = 1;
-    cache.blocks[set * cache.blocksPerSet + block].tag = tag;
-    cache.blocks[set * cache.blocksPerSet + block].set = set;
-    cache.blocks[set * cache.blocksPerSet + block].addy = addr;
-    cache.blocks[set * cache.blocksPerSet + block].dirty = 0;
-    updateLRU(cache.blocksPerSet - 1, set);
-    cache.blocks[set * cache.blocksPerSet + block].lruLabel = 0;
-    // Fill data from mem
-    for (int i = 0; i < cache.blockSize; ++i) {
-        cache.blocks[set * cache.blocksPerSet + block].data[i] = mem_access(startaddy + i, 0, 0);
-        // printf(" %d ", mem_access(startaddy + i, 0, 0));
+// Parse "kind[,degree[,distance]]", degree and distance defaulting to 1
+int cacheParsePrefetcher(const char *spec, int *kind, int *degree, int *distance) {
+    char name[16];
+    *degree = 1;
+    *distance = 1;
+    if (sscanf(spec, "%15[^,],%d,%d", name, degree, distance) < 1 || *degree < 1 || *distance < 1) {
+        return -1;
     }
+    for (*kind = PREFETCH_NONE; *kind <= PREFETCH_STREAM; ++*kind) {
+        if (!strcmp(name, prefetcherNames[*kind])) {
+            return *kind == PREFETCH_STREAM && *degree > MAX_STREAM_DEPTH ? -1 : 0;
+        }
+    }
+    return -1;
 }
 
+const char *cachePrefetcherName(int kind) {
+    return prefetcherNames[kind];
+}
 
-int cache_access(int addr, int write_flag, int write_data) {
-    // printStats();
+// GCC and clang only unroll the per-way loops if the helpers are inlined
+// and the prefetcher, which is off the common path, is kept out of line
+#ifdef __GNUC__
+#define CACHE_INLINE static inline __attribute__((always_inline))
+#define CACHE_NOINLINE static __attribute__((noinline))
+#else
+#define CACHE_INLINE static inline
+#define CACHE_NOINLINE static
+#endif
 
-    int blockOffsetBits = log2(cache.blockSize);
-    int setIndexBits = log2(cache.numSets);
-    
-    int tag = addr >> (blockOffsetBits + setIndexBits);
+// log2 of a power of two, or -1 if n is not one
+static int powerOfTwoBits(int n) {
+    if (n <= 0 || (n & (n - 1)) != 0) {
+        return -1;
+    }
+    int bits = 0;
+    while ((1 << bits) != n) {
+        ++bits;
+    }
+    return bits;
+}
 
-    // set index:
-    int mask = 0;
-    for (int i = 0; i < setIndexBits; ++i) {
-        mask *= 2;
-        mask++;
+/*
+ * (Re)allocate c's arena for its geometry, write buffer and victim cache,
+ * every block and entry empty. Whatever the old arena held is gone, so
+ * this is only for a cache just set up.
+ */
+static void layoutArena(cacheStruct *c) {
+    int numBlocks = c->numSets * c->blocksPerSet;
+    int numEntries = c->writeBufferSize;
+    size_t arenaSize = numBlocks * sizeof(blockStruct) + numEntries * sizeof(writeBufferEntryType)
+            + c->victimSize * sizeof(victimEntryType)
+            + ((size_t)(numBlocks + numEntries + c->victimSize) * c->blockSize + 3 * c->numSets) * sizeof(int)
+            + numBlocks + (size_t)numEntries * c->blockSize;
+    char *arena = calloc(1, arenaSize);
+    if (arena == NULL) {
+        printf("error: out of memory\n");
+        exit(1);
+    }
+    free(c->arena);
+    c->arena = arena;
+    c->blocks = (blockStruct *)arena;
+    c->writeBuffer = (writeBufferEntryType *)(c->blocks + numBlocks);
+    c->victims = (victimEntryType *)(c->writeBuffer + numEntries);
+    int *words = (int *)(c->victims + c->victimSize);
+    for (int i = 0; i < numBlocks; ++i) {
+        c->blocks[i].data = words;
+        words += c->blockSize;
+    }
+    for (int i = 0; i < numEntries; ++i) {
+        c->writeBuffer[i].data = words;
+        words += c->blockSize;
+    }
+    for (int i = 0; i < c->victimSize; ++i) {
+        c->victims[i].data = words;
+        words += c->blockSize;
+    }
+    c->lruHead = words;
+    c->lruTail = words + c->numSets;
+    c->fifoNext = words + 2 * c->numSets;
+    c->plruTree = (unsigned char *)(words + 3 * c->numSets);
+    unsigned char *bytes = c->plruTree + numBlocks;
+    for (int i = 0; i < numEntries; ++i) {
+        c->writeBuffer[i].written = bytes;
+        bytes += c->blockSize;
     }
-    int set = (addr >> blockOffsetBits) & mask;
+    for (int set = 0; set < c->numSets; ++set) {
+        c->lruHead[set] = -1;
+        c->lruTail[set] = -1;
+    }
+}
+
+/*
+ * Whether c is a lone, blocking, write-back and write-allocate cache on
+ * memory: no level below or above it, no prefetcher, write buffer, victim
+ * cache or bus. Every setter that changes one of those calls this.
+ */
+static void updatePlain(cacheStruct *c) {
+    c->plain = c->next == NULL && c->numAbove == 0 && c->prefetch.kind == PREFETCH_NONE
+            && c->numMshrs == 0 && c->writeBufferSize == 0 && !c->writeThrough && c->writeAllocate
+            && c->victimSize == 0 && c->bus == NULL;
+}
 
-    // block offset
-    mask = 0;
-    for (int i = 0; i < blockOffsetBits; ++i) {
-        mask *= 2;
-        mask++;
+/*
+ * Set up a cache of the given geometry and replacement policy in front of
+ * memAccess. All blocks start out invalid. The sizes must be powers of two
+ * so the address can be split with shifts and masks computed here once.
+ * The cache's storage comes from an arena allocated here, so a cache set
+ * up before must be freed with cacheFree() first.
+ */
+void cacheSetup(cacheStruct *c, int blockSize, int numSets, int blocksPerSet,
+        int policy, memAccessFn memAccess, void *memCtx) {
+    int offsetBits = powerOfTwoBits(blockSize);
+    int setBits = powerOfTwoBits(numSets);
+    int waysBits = powerOfTwoBits(blocksPerSet);
+    if (offsetBits < 0 || setBits < 0 || waysBits < 0) {
+        printf("error: cache geometry %d,%d,%d must be powers of two\n", blockSize, numSets, blocksPerSet);
+        exit(1);
     }
-    int offset = (addr & mask);
+    if (blockSize > MAX_BLOCK_SIZE || offsetBits + setBits + waysBits > powerOfTwoBits(MAX_CACHE_WORDS)) {
+        printf("error: cache %d,%d,%d is larger than the cache model allows\n", blockSize, numSets, blocksPerSet);
+        exit(1);
+    }
+    memset(c, 0, sizeof(*c));
+    c->blockSize = blockSize;
+    c->numSets = numSets;
+    c->blocksPerSet = blocksPerSet;
+    c->offsetBits = offsetBits;
+    c->tagShift = offsetBits + setBits;
+    c->waysBits = waysBits;
+    c->offsetMask = blockSize - 1;
+    c->setMask = numSets - 1;
+    c->policy = policy;
+    layoutArena(c);
+    c->rng = 0x2545f491;
+    c->memAccess = memAccess;
+    c->memCtx = memCtx;
+    c->hitLatency = 1;
+    c->missLatency = 1;
+    c->writeAllocate = 1;
+    updatePlain(c);
+}
 
-    // Check for a cache hit:
-    int startaddy = addr - (addr % cache.blockSize);
-    int maybe = addr & (cache.blockSize - 1); // MAYBE
-    int hit = 0;
-    for (int block = 0; block < cache.blocksPerSet; ++block) {
-        if (cache.blocks[set * cache.blocksPerSet + block].tag == tag && cache.blocks[set * cache.blocksPerSet + block].valid == 1) {
-            hit = 1;
-            if (!write_flag) { // if fetch/lw
-                printAction(addr, 1, cacheToProcessor);
-                updateLRU(cache.blocks[set * cache.blocksPerSet + block].lruLabel, set);
-                cache.blocks[set * cache.blocksPerSet + block].lruLabel = 0;
-                // printf(" %d ", cache.blocks[set * cache.blocksPerSet + block].data[addr]);
-                return cache.blocks[set * cache.blocksPerSet + block].data[maybe];
-            }
-            else { // if sw
-                printAction(addr, 1, processorToCache);
-                cache.blocks[set * cache.blocksPerSet + block].data[offset] = write_data;
-                cache.blocks[set * cache.blocksPerSet + block].dirty = 1;
-                updateLRU(cache.blocks[set * cache.blocksPerSet + block].lruLabel, set);
-                cache.blocks[set * cache.blocksPerSet + block].lruLabel = 0;
-                return 0;
-            }
+void cacheFree(cacheStruct *c) {
+    free(c->arena);
+    c->arena = NULL;
+    c->blocks = NULL;
+    c->writeBuffer = NULL;
+    c->victims = NULL;
+}
+
+// Give the memory below c a block level function too (see cache.h)
+void cacheSetBlockAccess(cacheStruct *c, memBlockFn memBlock) {
+    c->memBlock = memBlock;
+}
+
+int cacheParseInclusion(const char *name) {
+    for (int inclusion = INCLUDE_INCLUSIVE; inclusion <= INCLUDE_NINE; ++inclusion) {
+        if (!strcmp(name, inclusionNames[inclusion])) {
+            return inclusion;
         }
     }
+    return -1;
+}
 
-    // If a miss:
-    if (hit == 0) {
-        int full = 1;
-        for (int block = 0; block < cache.blocksPerSet; ++block) {
-            if (cache.blocks[set * cache.blocksPerSet + block].valid == 0) { // cache has empty spot
-                full = 0;
-                printAction(startaddy, cache.blockSize, memoryToCache);
-                addBlock(tag, set, addr, startaddy, block);
-                
-                if (!write_flag) { // if fetch/lw
-                    printAction(addr, 1, cacheToProcessor);
-                    // printf(" %d ", cache.blocks[set * cache.blocksPerSet + block].data[addr]);
-                    return cache.blocks[set * cache.blocksPerSet + block].data[maybe];
+const char *cacheInclusionName(int inclusion) {
+    return inclusionNames[inclusion];
+}
+
+/*
+ * Put c, just set up, on next instead of on memory, with next's contents
+ * kept to the given inclusion policy towards it (and any other caches
+ * above next, which must all be set up with the same one).
+ */
+void cacheSetNext(cacheStruct *c, cacheStruct *next, int inclusion) {
+    if (next->blockSize < c->blockSize || (inclusion == INCLUDE_EXCLUSIVE && next->blockSize != c->blockSize)) {
+        printf("error: a lower cache level needs blocks as large as the level above, the same size if exclusive\n");
+        exit(1);
+    }
+    if (next->numAbove == MAX_CACHES_ABOVE || (next->numAbove > 0 && next->inclusion != inclusion)) {
+        printf("error: at most %d caches, all of one inclusion policy, can share a lower level\n", MAX_CACHES_ABOVE);
+        exit(1);
+    }
+    c->next = next;
+    next->above[next->numAbove++] = c;
+    next->inclusion = inclusion;
+    updatePlain(c);
+    updatePlain(next);
+}
+
+// Make c coherent with the other caches on bus (see cache.h)
+void cacheSetBus(cacheStruct *c, busFn bus, void *busCtx) {
+    c->bus = bus;
+    c->busCtx = busCtx;
+    updatePlain(c);
+}
+
+/*
+ * Make shared the level the coherent cache c shares with others. c stays
+ * on its own memory below, as far as data goes; shared only mirrors what
+ * c holds, and back-invalidates it like an inclusive next level would.
+ */
+void cacheShareLevel(cacheStruct *c, cacheStruct *shared) {
+    if (c->victimSize > 0) {
+        printf("error: a coherent cache can't have a victim cache\n");
+        exit(1);
+    }
+    if (shared->blockSize < c->blockSize || shared->numAbove == MAX_CACHES_ABOVE) {
+        printf("error: a shared cache level takes up to %d caches with blocks no larger than its own\n",
+                MAX_CACHES_ABOVE);
+        exit(1);
+    }
+    shared->above[shared->numAbove++] = c;
+    shared->inclusion = INCLUDE_INCLUSIVE;
+    updatePlain(shared);
+}
+
+// Access latencies in cycles, which lastLatency is made of; 1 and 1 until set
+void cacheSetLatency(cacheStruct *c, int hitLatency, int missLatency) {
+    c->hitLatency = hitLatency;
+    c->missLatency = missLatency;
+}
+
+// Write policy and write buffer entries (0 for none), for a cache just set up
+void cacheSetWritePolicy(cacheStruct *c, int writeThrough, int writeAllocate, int writeBufferSize) {
+    if (writeBufferSize < 0 || writeBufferSize > MAX_WRITE_BUFFER) {
+        printf("error: write buffer must have 0 to %d entries\n", MAX_WRITE_BUFFER);
+        exit(1);
+    }
+    c->writeThrough = writeThrough;
+    c->writeAllocate = writeAllocate;
+    c->writeBufferSize = writeBufferSize;
+    layoutArena(c);
+    updatePlain(c);
+}
+
+// Fills that can be on their way at once, 0 for a blocking cache
+void cacheSetMshrs(cacheStruct *c, int numMshrs) {
+    if (numMshrs < 0 || numMshrs > MAX_MSHRS) {
+        printf("error: a cache can have 0 to %d MSHRs\n", MAX_MSHRS);
+        exit(1);
+    }
+    c->numMshrs = numMshrs;
+    memset(c->mshrReadyAt, 0, sizeof(c->mshrReadyAt));
+    updatePlain(c);
+}
+
+// Victim cache blocks (see cache.h), 0 for none, for a cache just set up
+void cacheSetVictimCache(cacheStruct *c, int victimSize) {
+    if (victimSize < 0 || victimSize > MAX_VICTIM_BLOCKS) {
+        printf("error: a victim cache holds 0 to %d blocks\n", MAX_VICTIM_BLOCKS);
+        exit(1);
+    }
+    c->victimSize = victimSize;
+    layoutArena(c);
+    updatePlain(c);
+}
+
+/*
+ * Attach a prefetcher (see cache.h) to a cache just set up, with its
+ * tables empty and its counters zero. Blocks at or past word addrLimit,
+ * unless it is 0, are never prefetched.
+ */
+void cacheSetPrefetcher(cacheStruct *c, int kind, int degree, int distance, int latency,
+        int addrLimit) {
+    prefetcherType *p = &c->prefetch;
+    memset(p, 0, sizeof(*p));
+    p->kind = kind;
+    p->degree = degree;
+    p->distance = distance;
+    p->latency = latency;
+    p->addrLimit = addrLimit;
+    for (int i = 0; i < PREFETCH_TABLE_SIZE; ++i) {
+        p->table[i].pc = -1;
+    }
+    updatePlain(c);
+}
+
+// xorshift32, so runs with the random policies are repeatable
+static unsigned int nextRandom(cacheStruct *c) {
+    unsigned int x = c->rng;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    c->rng = x;
+    return x;
+}
+
+
+/* -------------------------- replacement -------------------------- */
+
+// Unlink block from its set's LRU list
+CACHE_INLINE void lruRemove(cacheStruct *c, blockStruct *set, int setIndex, int block) {
+    int prev = set[block].lruPrev;
+    int next = set[block].lruNext;
+    if (prev >= 0) {
+        set[prev].lruNext = next;
+    }
+    else {
+        c->lruHead[setIndex] = next;
+    }
+    if (next >= 0) {
+        set[next].lruPrev = prev;
+    }
+    else {
+        c->lruTail[setIndex] = prev;
+    }
+}
+
+// Make block the most recently used of its set
+CACHE_INLINE void lruPushHead(cacheStruct *c, blockStruct *set, int setIndex, int block) {
+    int head = c->lruHead[setIndex];
+    set[block].lruPrev = -1;
+    set[block].lruNext = head;
+    if (head >= 0) {
+        set[head].lruPrev = block;
+    }
+    else {
+        c->lruTail[setIndex] = block;
+    }
+    c->lruHead[setIndex] = block;
+}
+
+/*
+ * Tree PLRU over a set of 2^waysBits ways: internal node n has children 2n
+ * and 2n+1, leaves are ways + way. Each node's bit points at the half to
+ * replace next, so an access flips the bits on its path to point away.
+ */
+CACHE_INLINE void plruTouch(cacheStruct *c, int setIndex, int ways, int block) {
+    unsigned char *tree = c->plruTree + setIndex * ways;
+    for (int node = ways + block; node > 1; node >>= 1) {
+        tree[node >> 1] = !(node & 1);
+    }
+}
+
+CACHE_INLINE int plruVictim(cacheStruct *c, int setIndex, int ways) {
+    unsigned char *tree = c->plruTree + setIndex * ways;
+    int node = 1;
+    while (node < ways) {
+        node = 2 * node + tree[node];
+    }
+    return node - ways;
+}
+
+// Policy bookkeeping for a hit on block
+CACHE_INLINE void policyHit(cacheStruct *c, blockStruct *set, int setIndex, int ways, int block) {
+    switch (c->policy) {
+        case REPLACE_LRU:
+            if (c->lruHead[setIndex] != block) {
+                lruRemove(c, set, setIndex, block);
+                lruPushHead(c, set, setIndex, block);
+            }
+            break;
+        case REPLACE_PLRU:
+            plruTouch(c, setIndex, ways, block);
+            break;
+        case REPLACE_SRRIP:
+        case REPLACE_BRRIP:
+            set[block].rrpv = 0;
+            break;
+    }
+}
+
+// The block of a full set to replace
+CACHE_INLINE int policyVictim(cacheStruct *c, blockStruct *set, int setIndex, int ways) {
+    int block;
+    switch (c->policy) {
+        case REPLACE_PLRU:
+            return plruVictim(c, setIndex, ways);
+        case REPLACE_SRRIP:
+        case REPLACE_BRRIP:
+            // the first block predicted distant, ageing the set until one is
+            for (;;) {
+                for (block = 0; block < ways; ++block) {
+                    if (set[block].rrpv == RRPV_MAX) {
+                        return block;
+                    }
                 }
-                else { // if sw
-                    printAction(addr, 1, processorToCache);
-                    cache.blocks[set * cache.blocksPerSet + block].data[offset] = write_data;
-                    cache.blocks[set * cache.blocksPerSet + block].dirty = 1;
-                    return 0;
+                for (block = 0; block < ways; ++block) {
+                    set[block].rrpv++;
                 }
             }
+        case REPLACE_FIFO:
+            block = c->fifoNext[setIndex];
+            c->fifoNext[setIndex] = (block + 1) & (ways - 1);
+            return block;
+        case REPLACE_RANDOM:
+            return nextRandom(c) & (ways - 1);
+        default:
+            return c->lruTail[setIndex];
+    }
+}
+
+// Policy bookkeeping for block having just been filled. wasValid says
+// whether it replaced a valid block.
+CACHE_INLINE void policyFill(cacheStruct *c, blockStruct *set, int setIndex, int ways, int block,
+        int wasValid) {
+    switch (c->policy) {
+        case REPLACE_LRU:
+            if (wasValid) {
+                lruRemove(c, set, setIndex, block);
+            }
+            lruPushHead(c, set, setIndex, block);
+            break;
+        case REPLACE_PLRU:
+            plruTouch(c, setIndex, ways, block);
+            break;
+        case REPLACE_SRRIP:
+            set[block].rrpv = RRPV_MAX - 1;
+            break;
+        case REPLACE_BRRIP:
+            set[block].rrpv = (nextRandom(c) % BRRIP_LONG_ODDS == 0) ? RRPV_MAX - 1 : RRPV_MAX;
+            break;
+    }
+}
+
+
+/* -------------------------- memory below ------------------------- */
+
+static int levelRead(cacheStruct *l, int addr, int n, int *data, int *dirty);
+static void levelWrite(cacheStruct *l, int addr, const int *data, const unsigned char *written,
+        int n, int dirty);
+
+/*
+ * Read the block starting at startaddy into data from the memory or cache
+ * level below c. Returns the cycles that takes; *dirty is set if the block
+ * comes up dirty from an exclusive level.
+ */
+CACHE_INLINE int readBelow(cacheStruct *c, int plain, int startaddy, int *data, int *dirty) {
+    c->memReads += c->blockSize;
+    if (plain || c->next == NULL) {
+        *dirty = 0;
+        if (c->memBlock != NULL) {
+            c->memBlock(c->memCtx, startaddy, data, c->blockSize, 0);
+            return c->missLatency;
+        }
+        for (int i = 0; i < c->blockSize; ++i) {
+            data[i] = c->memAccess(c->memCtx, startaddy + i, 0, 0);
+        }
+        return c->missLatency;
+    }
+    return levelRead(c->next, startaddy, c->blockSize, data, dirty);
+}
+
+/*
+ * Write n words starting at addr, or only those written marks if it is
+ * given, to the memory or cache level below c. Returns the cycles that
+ * takes when the write has to be waited for.
+ */
+static int writeBelow(cacheStruct *c, int addr, const int *data, const unsigned char *written, int n) {
+    if (c->next != NULL) {
+        for (int i = 0; i < n; ++i) {
+            c->memWrites += written == NULL || written[i];
         }
+        levelWrite(c->next, addr, data, written, n, 1);
+        return c->next->hitLatency;
+    }
+    if (written == NULL && c->memBlock != NULL) {
+        c->memBlock(c->memCtx, addr, (int *)data, n, 1);
+        c->memWrites += n;
+        return c->missLatency;
+    }
+    for (int i = 0; i < n; ++i) {
+        if (written == NULL || written[i]) {
+            c->memAccess(c->memCtx, addr + i, 1, data[i]);
+            c->memWrites++;
+        }
+    }
+    return c->missLatency;
+}
 
 
+/* -------------------------- write buffer ------------------------- */
 
-        // if cache is full and need to evict:
-        if (full == 1) {
+// Write entry i's words to memory and drop it from the buffer
+static void bufferDrain(cacheStruct *c, int i) {
+    writeBufferEntryType *e = &c->writeBuffer[i];
+    writeBelow(c, e->addy, e->data, e->written, c->blockSize);
+    c->writeBufferCount--;
+    writeBufferEntryType drained = *e; // its storage goes to the slot freed at the end
+    memmove(e, e + 1, (c->writeBufferCount - i) * sizeof(*e));
+    c->writeBuffer[c->writeBufferCount] = drained;
+}
 
-            for (int block = 0; block < cache.blocksPerSet; ++block) {
+// Drain the entries whose time has come; they are in the order they are due
+CACHE_INLINE void bufferRetire(cacheStruct *c) {
+    while (c->writeBufferCount > 0 && c->writeBuffer[0].drainAt <= c->now) {
+        bufferDrain(c, 0);
+    }
+}
 
-                if (cache.blocks[set * cache.blocksPerSet + block].lruLabel == (cache.blocksPerSet - 1)) { // evict this block
-                    int evictStart = cache.blocks[set * cache.blocksPerSet + block].addy - (cache.blocks[set * cache.blocksPerSet + block].addy % cache.blockSize);
-                    if (!cache.blocks[set * cache.blocksPerSet + block].dirty) { // if CLEAN
-                        printAction(evictStart, cache.blockSize, cacheToNowhere); // evict from cache
+// Before the block starting at addy is read from memory, write out what is buffered for it
+CACHE_INLINE void bufferFlushBlock(cacheStruct *c, int addy) {
+    for (int i = 0; i < c->writeBufferCount; ++i) {
+        if (c->writeBuffer[i].addy == addy) {
+            bufferDrain(c, i);
+            return;
+        }
+    }
+}
 
-                        printAction(startaddy, cache.blockSize, memoryToCache); // add new block from memory to cache
-                        addBlock(tag, set, addr, startaddy, block);
-                    }
+/*
+ * The entry for the block starting at addy, a new one if it has none. A
+ * full buffer first drains its oldest entry, which the write waits for:
+ * that is added to *wait.
+ */
+static writeBufferEntryType *bufferEntry(cacheStruct *c, int addy, int *wait) {
+    for (int i = 0; i < c->writeBufferCount; ++i) {
+        if (c->writeBuffer[i].addy == addy) {
+            c->writeBufferMerges++;
+            return &c->writeBuffer[i];
+        }
+    }
+    if (c->writeBufferCount == c->writeBufferSize) {
+        c->writeBufferStalls++;
+        *wait += c->missLatency;
+        bufferDrain(c, 0);
+    }
+    writeBufferEntryType *e = &c->writeBuffer[c->writeBufferCount++];
+    e->addy = addy;
+    e->drainAt = c->now + c->missLatency;
+    memset(e->written, 0, c->blockSize);
+    return e;
+}
 
-                    else { // if DIRTY
-                        printAction(evictStart, cache.blockSize, cacheToMemory); // evict from cache and write back to memory
-                        for (int i = 0; i < cache.blockSize; ++i) {
-                            mem_access(evictStart + i, 1, cache.blocks[set * cache.blocksPerSet + block].data[i]);
-                        }
+// Write one word below, through the buffer if there is one; returns the cycles it waits
+static int writeWord(cacheStruct *c, int addr, int data) {
+    if (c->writeBufferSize == 0) {
+        return writeBelow(c, addr, &data, NULL, 1);
+    }
+    int wait = 0;
+    writeBufferEntryType *e = bufferEntry(c, addr & ~c->offsetMask, &wait);
+    e->data[addr & c->offsetMask] = data;
+    e->written[addr & c->offsetMask] = 1;
+    return wait;
+}
 
-                        printAction(startaddy, cache.blockSize, memoryToCache); // add new block from memory to cache
-                        addBlock(tag, set, addr, startaddy, block);
-                    }
 
-                    if (!write_flag) { // if fetch/lw
-                        printAction(addr, 1, cacheToProcessor);
-                        // printf(" %d ", cache.blocks[set * cache.blocksPerSet + block].data[addr]);
-                        return cache.blocks[set * cache.blocksPerSet + block].data[maybe];
-                    }
-                    else { // if sw
-                        printAction(addr, 1, processorToCache);
-                        cache.blocks[set * cache.blocksPerSet + block].data[offset] = write_data;
-                        cache.blocks[set * cache.blocksPerSet + block].dirty = 1;
-                        return 0;
-                    }
+/* ------------------------- fill and evict ------------------------ */
+
+// Add new block into cache; returns the cycles it takes to come from below
+CACHE_INLINE int fillBlock(cacheStruct *c, int plain, blockStruct *set, int block,
+        int tag, int setIndex, int startaddy) {
+    set[block].valid = 1;
+    set[block].tag = tag;
+    set[block].set = setIndex;
+    set[block].addy = startaddy;
+    set[block].prefetched = 0;
+    set[block].readyAt = c->now;
+    if (!plain && c->writeBufferCount > 0) {
+        bufferFlushBlock(c, startaddy);
+    }
+    // Fill data from mem
+    return readBelow(c, plain, startaddy, set[block].data, &set[block].dirty);
+}
+
+static void backInvalidate(cacheStruct *c, blockStruct *b);
+
+/*
+ * Let go of the block starting at addy, writing it back first if it is
+ * dirty (or, if the level below is exclusive, in any case). Returns the
+ * cycles spent waiting for room in the write buffer.
+ */
+CACHE_INLINE int writeOut(cacheStruct *c, int plain, int addy, const int *data, int dirty) {
+    int top = plain || c->numAbove == 0; // only the top level traces
+    if (!dirty) { // if CLEAN
+        if (top) {
+            printAction(addy, c->blockSize, cacheToNowhere); // evict from cache
+        }
+        if (!plain && c->next != NULL && c->next->inclusion == INCLUDE_EXCLUSIVE) {
+            levelWrite(c->next, addy, data, NULL, c->blockSize, 0);
+        }
+        return 0;
+    }
+    // if DIRTY
+    if (top) {
+        printAction(addy, c->blockSize, cacheToMemory); // evict from cache and write back to memory
+    }
+    c->writebacks++;
+    if (!plain && c->writeBufferSize > 0) {
+        int wait = 0;
+        writeBufferEntryType *e = bufferEntry(c, addy, &wait);
+        memcpy(e->data, data, c->blockSize * sizeof(int));
+        memset(e->written, 1, c->blockSize);
+        return wait;
+    }
+    writeBelow(c, addy, data, NULL, c->blockSize);
+    return 0;
+}
+
+/*
+ * Put the block b is evicting into the victim cache, pushing out and
+ * writing out the oldest block there if it is full. Returns the cycles
+ * spent waiting for the write buffer.
+ */
+CACHE_NOINLINE int victimInsert(cacheStruct *c, const blockStruct *b) {
+    victimEntryType *e = &c->victims[0];
+    for (int i = 0; i < c->victimSize; ++i) {
+        if (!c->victims[i].valid) {
+            e = &c->victims[i];
+            break;
+        }
+        if (c->victims[i].age < e->age) {
+            e = &c->victims[i];
+        }
+    }
+    int wait = 0;
+    if (e->valid) {
+        c->victimEvictions++;
+        wait = writeOut(c, 0, e->addy, e->data, e->dirty);
+    }
+    e->valid = 1;
+    e->addy = b->addy;
+    e->dirty = b->dirty;
+    e->readyAt = b->readyAt;
+    e->age = ++c->victimClock;
+    memcpy(e->data, b->data, c->blockSize * sizeof(int));
+    return wait;
+}
+
+/*
+ * Throw out a valid block, into the victim cache if there is one, else
+ * written out as above. Returns the cycles spent waiting for room in the
+ * write buffer.
+ */
+CACHE_INLINE int evictBlock(cacheStruct *c, int plain, blockStruct *b) {
+    c->evictions++;
+    if (!plain && c->bus != NULL) {
+        c->bus(c->busCtx, b->dirty ? BUS_WRITEBACK : BUS_EVICT, b->addy, NULL);
+    }
+    if (!plain && c->numAbove > 0 && c->inclusion == INCLUDE_INCLUSIVE) {
+        backInvalidate(c, b);
+    }
+    if (!plain && c->victimSize > 0) {
+        return victimInsert(c, b);
+    }
+    return writeOut(c, plain, b->addy, b->data, b->dirty);
+}
+
+// The victim cache's entry for the block starting at addy, or NULL
+static victimEntryType *victimFind(cacheStruct *c, int addy) {
+    for (int i = 0; i < c->victimSize; ++i) {
+        if (c->victims[i].valid && c->victims[i].addy == addy) {
+            return &c->victims[i];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * A miss the victim cache has the block for, in e: swap it back into the
+ * set in place of the block the miss replaces, which goes into the victim
+ * cache. Returns the way it is in; *latency is what the access takes.
+ */
+CACHE_NOINLINE int victimSwap(cacheStruct *c, blockStruct *set, int setIndex, int tag,
+        victimEntryType *e, int write_flag, int *latency) {
+    int data[MAX_BLOCK_SIZE];
+    int addy = e->addy;
+    int dirty = e->dirty;
+    int readyAt = e->readyAt;
+    memcpy(data, e->data, c->blockSize * sizeof(int));
+    e->valid = 0;
+    c->victimHits++;
+    c->hits++;
+    c->lastHit = 1;
+
+    int ways = c->blocksPerSet;
+    int block;
+    for (block = 0; block < ways; ++block) {
+        if (!set[block].valid) {
+            break;
+        }
+    }
+    int full = (block == ways);
+    int wait = 0;
+    if (full) {
+        block = policyVictim(c, set, setIndex, ways);
+        wait = evictBlock(c, 0, &set[block]);
+    }
+    set[block].valid = 1;
+    set[block].tag = tag;
+    set[block].set = setIndex;
+    set[block].addy = addy;
+    set[block].dirty = dirty;
+    set[block].prefetched = 0;
+    set[block].readyAt = readyAt;
+    memcpy(set[block].data, data, c->blockSize * sizeof(int));
+    policyFill(c, set, setIndex, ways, block, full);
+
+    // a load of a block evicted before its fill completed still waits for it
+    *latency = c->hitLatency;
+    if (!write_flag && readyAt - c->now > *latency) {
+        *latency = readyAt - c->now;
+    }
+    *latency += wait;
+    return block;
+}
+
+
+/* -------------------------- lower levels ------------------------- */
+
+// The way of set holding tag, or -1
+static int findWay(const cacheStruct *c, const blockStruct *set, int tag) {
+    for (int block = 0; block < c->blocksPerSet; ++block) {
+        if (set[block].tag == tag && set[block].valid) {
+            return block;
+        }
+    }
+    return -1;
+}
+
+// Drop a block as if it had never been filled, writing it nowhere
+static void invalidateBlock(cacheStruct *c, blockStruct *set, int setIndex, int block) {
+    if (c->policy == REPLACE_LRU) {
+        lruRemove(c, set, setIndex, block);
+    }
+    set[block].valid = 0;
+    set[block].dirty = 0;
+    set[block].prefetched = 0;
+}
+
+/*
+ * Invalidate the copies the caches above c hold of its block b, all the
+ * way up. Dirty data they had is copied into b, which becomes dirty.
+ */
+static void backInvalidate(cacheStruct *c, blockStruct *b) {
+    for (int i = 0; i < c->numAbove; ++i) {
+        cacheStruct *above = c->above[i];
+        for (int addr = b->addy; addr < b->addy + c->blockSize; addr += above->blockSize) {
+            int setIndex = (addr >> above->offsetBits) & above->setMask;
+            blockStruct *set = above->blocks + (setIndex << above->waysBits);
+            int block = findWay(above, set, addr >> above->tagShift);
+            if (block < 0) {
+                continue;
+            }
+            if (above->numAbove > 0) {
+                backInvalidate(above, &set[block]);
+            }
+            if (set[block].dirty) {
+                memcpy(b->data + (addr - b->addy), set[block].data, above->blockSize * sizeof(int));
+                b->dirty = 1;
+            }
+            invalidateBlock(above, set, setIndex, block);
+            c->backInvalidations++;
+        }
+        for (int v = 0; v < above->victimSize; ++v) {
+            victimEntryType *e = &above->victims[v];
+            if (e->valid && e->addy >= b->addy && e->addy < b->addy + c->blockSize) {
+                if (e->dirty) {
+                    memcpy(b->data + (e->addy - b->addy), e->data, above->blockSize * sizeof(int));
+                    b->dirty = 1;
                 }
+                e->valid = 0;
+                c->backInvalidations++;
+            }
+        }
+    }
+}
+
+// A way of the set for a new block: the first empty one, else the evicted victim
+static int makeRoom(cacheStruct *c, blockStruct *set, int setIndex, int *full) {
+    int block;
+    for (block = 0; block < c->blocksPerSet; ++block) {
+        if (!set[block].valid) {
+            break;
+        }
+    }
+    *full = (block == c->blocksPerSet);
+    if (*full) {
+        block = policyVictim(c, set, setIndex, c->blocksPerSet);
+        evictBlock(c, 0, &set[block]);
+    }
+    return block;
+}
+
+/*
+ * A cache above l misses on its block of n words at addr: copy them into
+ * data, from l or, if l misses too, from below it. Returns the cycles that
+ * takes; *dirty is set if an exclusive l hands up a dirty block.
+ */
+static int levelRead(cacheStruct *l, int addr, int n, int *data, int *dirty) {
+    int tag = addr >> l->tagShift;
+    int setIndex = (addr >> l->offsetBits) & l->setMask;
+    blockStruct *set = l->blocks + (setIndex << l->waysBits);
+    int block = findWay(l, set, tag);
+    if (block >= 0) {
+        l->hits++;
+        memcpy(data, set[block].data + (addr & l->offsetMask), n * sizeof(int));
+        if (l->inclusion == INCLUDE_EXCLUSIVE) { // it moves up
+            *dirty = set[block].dirty;
+            invalidateBlock(l, set, setIndex, block);
+        }
+        else {
+            *dirty = 0;
+            policyHit(l, set, setIndex, l->blocksPerSet, block);
+        }
+        return l->hitLatency;
+    }
+    l->misses++;
+    if (l->inclusion == INCLUDE_EXCLUSIVE) { // straight past, the blocks are the same size
+        return readBelow(l, 0, addr, data, dirty);
+    }
+    int full;
+    block = makeRoom(l, set, setIndex, &full);
+    int latency = fillBlock(l, 0, set, block, tag, setIndex, addr & ~l->offsetMask);
+    set[block].sharers = 0;
+    policyFill(l, set, setIndex, l->blocksPerSet, block, full);
+    memcpy(data, set[block].data + (addr & l->offsetMask), n * sizeof(int));
+    *dirty = 0;
+    return latency;
+}
+
+/*
+ * A cache above l writes n words starting at addr, or those written marks
+ * if given, down into it: a whole evicted block, or buffered and write
+ * through words. Words for a block l doesn't hold go on below it, if
+ * dirty, except that an exclusive l takes in whole blocks.
+ */
+static void levelWrite(cacheStruct *l, int addr, const int *data, const unsigned char *written,
+        int n, int dirty) {
+    int tag = addr >> l->tagShift;
+    int setIndex = (addr >> l->offsetBits) & l->setMask;
+    blockStruct *set = l->blocks + (setIndex << l->waysBits);
+    int block = findWay(l, set, tag);
+    if (block >= 0) {
+        int *words = set[block].data + (addr & l->offsetMask);
+        for (int i = 0; i < n; ++i) {
+            if (written == NULL || written[i]) {
+                words[i] = data[i];
+            }
+        }
+        set[block].dirty |= dirty;
+    }
+    else if (l->inclusion == INCLUDE_EXCLUSIVE && written == NULL && n == l->blockSize) {
+        int full;
+        block = makeRoom(l, set, setIndex, &full);
+        set[block].valid = 1;
+        set[block].tag = tag;
+        set[block].set = setIndex;
+        set[block].addy = addr;
+        set[block].dirty = dirty;
+        set[block].prefetched = 0;
+        set[block].readyAt = l->now;
+        memcpy(set[block].data, data, n * sizeof(int));
+        policyFill(l, set, setIndex, l->blocksPerSet, block, full);
+    }
+    else if (dirty) {
+        writeBelow(l, addr, data, written, n);
+    }
+}
+
+
+/* --------------------------- coherence --------------------------- */
+
+// The valid block holding addr, or NULL; looking changes nothing
+blockStruct *cacheFindBlock(const cacheStruct *c, int addr) {
+    blockStruct *set = c->blocks + (((addr >> c->offsetBits) & c->setMask) << c->waysBits);
+    int block = findWay(c, set, addr >> c->tagShift);
+    return block >= 0 ? &set[block] : NULL;
+}
+
+// The cycles c and the levels below it would take to supply addr's block, looking only
+int cacheProbeLatency(const cacheStruct *c, int addr) {
+    for (; c->next != NULL; c = c->next) {
+        if (cacheFindBlock(c, addr) != NULL) {
+            return c->hitLatency;
+        }
+    }
+    return cacheFindBlock(c, addr) != NULL ? c->hitLatency : c->missLatency;
+}
+
+// A cache above c misses on n words at addr: as on a level below, see levelRead
+int cacheReadBlock(cacheStruct *c, int addr, int n, int *data) {
+    int dirty;
+    return levelRead(c, addr, n, data, &dirty);
+}
+
+// A cache above c writes back n dirty words at addr: as on a level below
+void cacheWriteBlock(cacheStruct *c, int addr, const int *data, int n) {
+    levelWrite(c, addr, data, NULL, n, 1);
+}
+
+// Drop c's copy of addr's block, if it has one, dirty or not
+void cacheInvalidate(cacheStruct *c, int addr) {
+    int setIndex = (addr >> c->offsetBits) & c->setMask;
+    blockStruct *set = c->blocks + (setIndex << c->waysBits);
+    int block = findWay(c, set, addr >> c->tagShift);
+    if (block >= 0) {
+        invalidateBlock(c, set, setIndex, block);
+    }
+}
+
+// A coherent cache's fill of b: from the bus, shared, or exclusive for a store
+CACHE_NOINLINE int busFill(cacheStruct *c, blockStruct *b, int write_flag) {
+    int exclusive = write_flag;
+    int latency = c->bus(c->busCtx, write_flag ? BUS_READ_EXCLUSIVE : BUS_READ, b->addy, &exclusive);
+    b->exclusive = exclusive;
+    return latency;
+}
+
+// A coherent cache's store to its shared copy b: the other copies go first
+CACHE_NOINLINE int busUpgrade(cacheStruct *c, blockStruct *b) {
+    b->exclusive = 1;
+    return c->bus(c->busCtx, BUS_UPGRADE, b->addy, NULL);
+}
+
+
+/* ------------------------------ MSHRs ---------------------------- */
+
+// Whether an MSHR is free now
+static int mshrFree(const cacheStruct *c) {
+    for (int i = 0; i < c->numMshrs; ++i) {
+        if (c->mshrReadyAt[i] <= c->now) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Start a fill of the given latency in an MSHR, now or, if all are busy,
+ * as soon as the first frees up. Returns when the fill completes.
+ */
+static int mshrStart(cacheStruct *c, int latency) {
+    int first = 0;
+    for (int i = 1; i < c->numMshrs; ++i) {
+        if (c->mshrReadyAt[i] < c->mshrReadyAt[first]) {
+            first = i;
+        }
+    }
+    int start = c->now;
+    if (c->mshrReadyAt[first] > start) {
+        start = c->mshrReadyAt[first];
+        c->mshrStalls++;
+    }
+    c->mshrReadyAt[first] = start + latency;
+    return c->mshrReadyAt[first];
+}
+
+
+/* --------------------------- prefetching -------------------------- */
+
+// Bring the block holding addr into the cache, unless it is there already
+static void prefetchBlock(cacheStruct *c, int addr) {
+    prefetcherType *p = &c->prefetch;
+    int startaddy = addr & ~c->offsetMask;
+    if (addr < 0 || (p->addrLimit && startaddy >= p->addrLimit)) {
+        return;
+    }
+    int ways = c->blocksPerSet;
+    int tag = addr >> c->tagShift;
+    int setIndex = (addr >> c->offsetBits) & c->setMask;
+    blockStruct *set = c->blocks + (setIndex << c->waysBits);
+    int block;
+    for (block = 0; block < ways; ++block) {
+        if (set[block].tag == tag && set[block].valid) {
+            return;
+        }
+    }
+    if ((c->numMshrs > 0 && !mshrFree(c)) || (c->victimSize > 0 && victimFind(c, startaddy) != NULL)) {
+        return;
+    }
+    for (block = 0; block < ways; ++block) {
+        if (!set[block].valid) {
+            break;
+        }
+    }
+    int full = (block == ways);
+    if (full) {
+        block = policyVictim(c, set, setIndex, ways);
+        // remembered, so a demand miss on it later is charged to us
+        int victim = set[block].addy;
+        p->filter[(victim >> c->offsetBits) & (PREFETCH_FILTER_SIZE - 1)] = victim + 1;
+        evictBlock(c, 0, &set[block]);
+    }
+    printAction(startaddy, c->blockSize, memoryToCache);
+    int latency = fillBlock(c, 0, set, block, tag, setIndex, startaddy);
+    if (c->bus != NULL) {
+        latency = busFill(c, &set[block], 0);
+    }
+    policyFill(c, set, setIndex, ways, block, full);
+    set[block].prefetched = 1;
+    set[block].readyAt = c->numMshrs > 0 ? mshrStart(c, latency) : c->now + latency;
+    p->issued++;
+}
+
+// Fetch the next block of stream buffer s into its tail
+static void streamFetch(cacheStruct *c, streamBufferType *s) {
+    prefetcherType *p = &c->prefetch;
+    if (s->next < 0 || (p->addrLimit && s->next >= p->addrLimit)) {
+        return;
+    }
+    int slot = (s->head + s->count) % MAX_STREAM_DEPTH;
+    s->blocks[slot] = s->next;
+    s->readyAt[slot] = c->now + p->latency;
+    s->count++;
+    printAction(s->next, c->blockSize, memoryToCache);
+    s->next += c->blockSize;
+    p->issued++;
+}
+
+/*
+ * A demand miss on the block starting at startaddy: charge it to an earlier
+ * prefetch that evicted it, then look for it in the stream buffers. Returns
+ * 1 if a buffer had it ready, -1 if a buffer had it on its way, and 0 if
+ * it has to come from memory.
+ */
+CACHE_NOINLINE int prefetchMiss(cacheStruct *c, int startaddy) {
+    prefetcherType *p = &c->prefetch;
+    int *evicted = &p->filter[(startaddy >> c->offsetBits) & (PREFETCH_FILTER_SIZE - 1)];
+    if (*evicted == startaddy + 1) {
+        p->polluting++;
+        *evicted = 0;
+    }
+    if (p->kind != PREFETCH_STREAM) {
+        return 0;
+    }
+
+    streamBufferType *s;
+    streamBufferType *oldest = &p->streams[0];
+    for (s = p->streams; s < p->streams + STREAM_BUFFERS; ++s) {
+        for (int i = 0; i < s->count; ++i) {
+            int slot = (s->head + i) % MAX_STREAM_DEPTH;
+            if (s->blocks[slot] != startaddy) {
+                continue;
+            }
+            int ready = s->readyAt[slot] <= c->now;
+            if (ready) {
+                p->useful++;
+            }
+            else {
+                p->late++;
+            }
+            // the blocks ahead of it were skipped over, drop them too
+            s->head = (slot + 1) % MAX_STREAM_DEPTH;
+            s->count -= i + 1;
+            s->lastUse = ++p->streamClock;
+            while (s->count < p->degree) {
+                streamFetch(c, s);
             }
+            return ready ? 1 : -1;
         }
+        if (s->lastUse < oldest->lastUse) {
+            oldest = s;
+        }
+    }
+
+    // a new stream, in place of the least recently used one
+    s = oldest;
+    s->count = 0;
+    s->head = 0;
+    s->next = startaddy + p->distance * c->blockSize;
+    s->lastUse = ++p->streamClock;
+    while (s->count < p->degree) {
+        streamFetch(c, s);
+    }
+    return 0;
+}
+
+// The first demand access to a prefetched block: whether it had arrived
+CACHE_NOINLINE int prefetchFirstUse(cacheStruct *c, blockStruct *b) {
+    b->prefetched = 0;
+    if (b->readyAt <= c->now) {
+        c->prefetch.useful++;
+        return 1;
     }
+    c->prefetch.late++;
     return 0;
 }
 
+/*
+ * Train on a demand access and prefetch what it predicts. trigger is set
+ * for a miss or the first use of a prefetched block, which is what sets
+ * off next-line prefetching.
+ */
+CACHE_NOINLINE void prefetchAfter(cacheStruct *c, int addr, int trigger) {
+    prefetcherType *p = &c->prefetch;
+    if (p->kind == PREFETCH_NEXT_LINE && trigger) {
+        int startaddy = addr & ~c->offsetMask;
+        for (int i = 0; i < p->degree; ++i) {
+            prefetchBlock(c, startaddy + (p->distance + i) * c->blockSize);
+        }
+    }
+    else if (p->kind == PREFETCH_STRIDE) {
+        strideEntryType *e = &p->table[c->pc & (PREFETCH_TABLE_SIZE - 1)];
+        if (e->pc != c->pc) {
+            e->pc = c->pc;
+            e->lastAddr = addr;
+            e->stride = 0;
+            return;
+        }
+        int stride = addr - e->lastAddr;
+        int repeated = stride != 0 && stride == e->stride;
+        e->stride = stride;
+        e->lastAddr = addr;
+        for (int i = 0; repeated && i < p->degree; ++i) {
+            prefetchBlock(c, addr + (p->distance + i) * stride);
+        }
+    }
+}
+
+
+/* ---------------------------- access ----------------------------- */
+
+/*
+ * The body of cacheAccess for a set of the given number of ways. It is
+ * inlined below with ways a constant for the common associativities, which
+ * turns the tag and empty block scans into straight line code, and with
+ * plain a constant too, 1 for a plain cache (see updatePlain), which drops
+ * the checks for everything such a cache lacks. hint is a way to look in
+ * before searching the set, or -1; the way the access used, -1 if none,
+ * goes in *way unless way is NULL.
+ */
+CACHE_INLINE int accessWays(cacheStruct *c, int ways, int plain, int addr, int write_flag,
+        int write_data, int hint, int *way) {
+    int tag = addr >> c->tagShift;
+    int setIndex = (addr >> c->offsetBits) & c->setMask;
+    int offset = addr & c->offsetMask;
+    blockStruct *set = c->blocks + (setIndex << c->waysBits);
+
+    if (!plain && c->writeBufferCount > 0) {
+        bufferRetire(c);
+    }
+
+    // Check for a cache hit:
+    int block;
+    if (hint >= 0 && set[hint].tag == tag && set[hint].valid) {
+        block = hint;
+    }
+    else {
+        for (block = 0; block < ways; ++block) {
+            if (set[block].tag == tag && set[block].valid) {
+                break;
+            }
+        }
+    }
+
+    int trigger = 0; // for the prefetcher: a miss, or a prefetched block's first use
+    int latency;
+    victimEntryType *victim;
+    if (block < ways) {
+        int ready = 1;
+        if (!plain && set[block].prefetched) { // one still on its way is as good as a miss
+            trigger = 1;
+            ready = prefetchFirstUse(c, &set[block]);
+        }
+        c->hits += ready;
+        c->misses += !ready;
+        c->lastHit = ready;
+        policyHit(c, set, setIndex, ways, block);
+        latency = ready ? c->hitLatency : c->missLatency;
+        if (!plain && c->numMshrs > 0 && set[block].readyAt > c->now) {
+            // its fill is still on its way: a load waits for the rest of
+            // it, a store merges into its MSHR
+            c->mshrMerges++;
+            latency = c->hitLatency;
+            if (!write_flag && set[block].readyAt - c->now > latency) {
+                latency = set[block].readyAt - c->now;
+            }
+        }
+    }
+    else if (!plain && c->victimSize > 0 && (victim = victimFind(c, addr & ~c->offsetMask)) != NULL) {
+        block = victimSwap(c, set, setIndex, tag, victim, write_flag, &latency);
+    }
+    else if (!plain && write_flag && !c->writeAllocate) { // a store miss goes around the cache
+        c->misses++;
+        c->lastHit = 0;
+        printAction(addr, 1, processorToMemory);
+        int wait = writeWord(c, addr, write_data);
+        c->lastLatency = wait > c->hitLatency ? wait : c->hitLatency;
+        if (way != NULL) {
+            *way = -1;
+        }
+        if (c->prefetch.kind != PREFETCH_NONE) {
+            prefetchAfter(c, addr, 1);
+        }
+        return 0;
+    }
+    else { // If a miss:
+        trigger = 1;
+        int startaddy = addr & ~c->offsetMask;
+        int streamed = !plain && c->prefetch.kind != PREFETCH_NONE ? prefetchMiss(c, startaddy) : 0;
+        c->hits += streamed > 0;
+        c->misses += streamed <= 0;
+        c->lastHit = streamed > 0;
+
+        // take the first empty spot, or evict the policy's victim
+        for (block = 0; block < ways; ++block) {
+            if (!set[block].valid) {
+                break;
+            }
+        }
+        int full = (block == ways);
+        int wait = 0;
+        if (full) {
+            block = policyVictim(c, set, setIndex, ways);
+            wait = evictBlock(c, plain, &set[block]);
+        }
+        if (!streamed) { // a stream buffer already fetched it
+            printAction(startaddy, c->blockSize, memoryToCache); // add new block from memory to cache
+        }
+        int fill = fillBlock(c, plain, set, block, tag, setIndex, startaddy);
+        if (!plain && c->bus != NULL) {
+            fill = busFill(c, &set[block], write_flag);
+        }
+        policyFill(c, set, setIndex, ways, block, full);
+
+        if (streamed > 0) {
+            latency = c->hitLatency;
+        }
+        else if (plain || c->numMshrs == 0 || streamed < 0) {
+            latency = fill;
+        }
+        else {
+            // a load waits for the fill, a store only for its MSHR
+            set[block].readyAt = mshrStart(c, fill);
+            latency = set[block].readyAt - c->now;
+            if (write_flag) {
+                latency += c->hitLatency - fill;
+            }
+        }
+        latency += wait;
+    }
+
+    int result = 0;
+    if (!write_flag) { // if fetch/lw
+        printAction(addr, 1, cacheToProcessor);
+        result = set[block].data[offset];
+    }
+    else { // if sw
+        printAction(addr, 1, processorToCache);
+        set[block].data[offset] = write_data;
+        if (!plain && c->bus != NULL && !set[block].exclusive) {
+            int wait = busUpgrade(c, &set[block]);
+            if (wait > latency) {
+                latency = wait;
+            }
+        }
+        if (plain || !c->writeThrough) {
+            set[block].dirty = 1;
+        }
+        else {
+            printAction(addr, 1, cacheToMemory);
+            int wait = writeWord(c, addr, write_data);
+            if (wait > latency) {
+                latency = wait;
+            }
+        }
+    }
+    c->lastLatency = latency;
+    if (way != NULL) {
+        *way = block;
+    }
+    if (!plain && c->prefetch.kind != PREFETCH_NONE) {
+        prefetchAfter(c, addr, trigger);
+    }
+    return result;
+}
+
+// accessWays for c's number of ways, with plain as c->plain
+CACHE_INLINE int accessSized(cacheStruct *c, int plain, int addr, int write_flag, int write_data,
+        int hint, int *way) {
+    switch (c->blocksPerSet) {
+        case 1:
+            return accessWays(c, 1, plain, addr, write_flag, write_data, hint, way);
+        case 2:
+            return accessWays(c, 2, plain, addr, write_flag, write_data, hint, way);
+        case 4:
+            return accessWays(c, 4, plain, addr, write_flag, write_data, hint, way);
+        case 8:
+            return accessWays(c, 8, plain, addr, write_flag, write_data, hint, way);
+        default:
+            return accessWays(c, c->blocksPerSet, plain, addr, write_flag, write_data, hint, way);
+    }
+}
+
+int cacheAccess(cacheStruct *c, int addr, int write_flag, int write_data) {
+    if (c->plain) {
+        return accessSized(c, 1, addr, write_flag, write_data, -1, NULL);
+    }
+    return accessSized(c, 0, addr, write_flag, write_data, -1, NULL);
+}
+
+/*
+ * cacheAccessBatch for a set of the given number of ways. The accesses
+ * stay in order: any other would change what replacement, the prefetcher,
+ * the MSHRs and write buffer and the levels below see.
+ */
+CACHE_INLINE void batchWays(cacheStruct *c, int ways, int plain, const cacheRequestType *requests,
+        int n, int *results) {
+    int lastBlock = -1; // the block number of the previous access
+    int lastWay = -1; // and the way it used
+    for (int i = 0; i < n; ++i) {
+        const cacheRequestType *r = &requests[i];
+        int blockNumber = r->addr >> c->offsetBits;
+        int hint = blockNumber == lastBlock ? lastWay : -1;
+        results[i] = accessWays(c, ways, plain, r->addr, r->write_flag, r->write_data, hint, &lastWay);
+        lastBlock = blockNumber;
+    }
+}
+
+// batchWays for c's number of ways, with plain as c->plain
+CACHE_INLINE void batchSized(cacheStruct *c, int plain, const cacheRequestType *requests, int n,
+        int *results) {
+    switch (c->blocksPerSet) {
+        case 1:
+            batchWays(c, 1, plain, requests, n, results);
+            break;
+        case 2:
+            batchWays(c, 2, plain, requests, n, results);
+            break;
+        case 4:
+            batchWays(c, 4, plain, requests, n, results);
+            break;
+        case 8:
+            batchWays(c, 8, plain, requests, n, results);
+            break;
+        default:
+            batchWays(c, c->blocksPerSet, plain, requests, n, results);
+            break;
+    }
+}
+
+// Make n accesses in order, as cacheAccess would, each one's result in results
+void cacheAccessBatch(cacheStruct *c, const cacheRequestType *requests, int n, int *results) {
+    if (c->plain) {
+        batchSized(c, 1, requests, n, results);
+    }
+    else {
+        batchSized(c, 0, requests, n, results);
+    }
+}
+
+
+/* -------------------------- checkpoints -------------------------- */
+
+#define BLOCK_FIELDS 10
+
+/*
+ * Write everything an access can change: the blocks in use (with only
+ * blockSize words of data each), the replacement state, the MSHRs and
+ * write buffer, the prefetcher's tables and the counters.
+ */
+void cacheSave(const cacheStruct *c, FILE *out) {
+    int numBlocks = c->numSets * c->blocksPerSet;
+    int geometry[4] = {c->blockSize, c->numSets, c->blocksPerSet, c->policy};
+    ckpt_write_int(out, CKPT_SECTION_CACHE);
+    ckpt_write(out, geometry, sizeof(geometry));
+    for (int i = 0; i < numBlocks; ++i) {
+        const blockStruct *b = &c->blocks[i];
+        int fields[BLOCK_FIELDS] = {b->valid, b->addy, b->dirty, b->lruPrev, b->lruNext, b->rrpv, b->set, b->tag,
+                b->prefetched, b->readyAt};
+        ckpt_write(out, fields, sizeof(fields));
+        ckpt_write(out, b->data, c->blockSize * sizeof(int));
+    }
+    ckpt_write(out, c->lruHead, c->numSets * sizeof(int));
+    ckpt_write(out, c->lruTail, c->numSets * sizeof(int));
+    ckpt_write(out, c->fifoNext, c->numSets * sizeof(int));
+    ckpt_write(out, c->plruTree, numBlocks);
+    ckpt_write(out, &c->rng, sizeof(c->rng));
+    long long counters[11] = {c->hits, c->misses, c->writebacks, c->evictions, c->memReads,
+        c->memWrites, c->mshrMerges, c->mshrStalls, c->writeBufferMerges, c->writeBufferStalls,
+        c->backInvalidations};
+    ckpt_write(out, counters, sizeof(counters));
+    ckpt_write_int(out, c->lastHit);
+    ckpt_write_int(out, c->lastLatency);
+
+    int policy[6] = {c->writeThrough, c->writeAllocate, c->numMshrs, c->writeBufferSize,
+        c->numAbove, c->inclusion};
+    ckpt_write(out, policy, sizeof(policy));
+    ckpt_write(out, c->mshrReadyAt, c->numMshrs * sizeof(int));
+    ckpt_write_int(out, c->writeBufferCount);
+    for (int i = 0; i < c->writeBufferCount; ++i) {
+        const writeBufferEntryType *e = &c->writeBuffer[i];
+        ckpt_write_int(out, e->addy);
+        ckpt_write_int(out, e->drainAt);
+        ckpt_write(out, e->data, c->blockSize * sizeof(int));
+        ckpt_write(out, e->written, c->blockSize);
+    }
+    ckpt_write_int(out, c->victimSize);
+    ckpt_write_int(out, c->victimClock);
+    for (int i = 0; i < c->victimSize; ++i) {
+        const victimEntryType *e = &c->victims[i];
+        int fields[5] = {e->valid, e->addy, e->dirty, e->readyAt, e->age};
+        ckpt_write(out, fields, sizeof(fields));
+        ckpt_write(out, e->data, c->blockSize * sizeof(int));
+    }
+    long long victims[2] = {c->victimHits, c->victimEvictions};
+    ckpt_write(out, victims, sizeof(victims));
+
+    const prefetcherType *p = &c->prefetch;
+    int prefetcher[3] = {p->kind, p->degree, p->distance};
+    ckpt_write(out, prefetcher, sizeof(prefetcher));
+    ckpt_write(out, p->table, sizeof(p->table));
+    ckpt_write(out, p->streams, sizeof(p->streams));
+    ckpt_write_int(out, p->streamClock);
+    ckpt_write(out, p->filter, sizeof(p->filter));
+    long long prefetches[4] = {p->issued, p->useful, p->late, p->polluting};
+    ckpt_write(out, prefetches, sizeof(prefetches));
+}
+
+// Read back what cacheSave wrote into c, set up with the same geometry
+void cacheRestore(cacheStruct *c, FILE *in) {
+    int numBlocks = c->numSets * c->blocksPerSet;
+    ckpt_expect(in, CKPT_SECTION_CACHE, "section");
+    ckpt_expect(in, c->blockSize, "cache block size");
+    ckpt_expect(in, c->numSets, "cache set count");
+    ckpt_expect(in, c->blocksPerSet, "cache associativity");
+    ckpt_expect(in, c->policy, "cache policy");
+    for (int i = 0; i < numBlocks; ++i) {
+        blockStruct *b = &c->blocks[i];
+        int fields[BLOCK_FIELDS];
+        ckpt_read(in, fields, sizeof(fields));
+        b->valid = fields[0];
+        b->addy = fields[1];
+        b->dirty = fields[2];
+        b->lruPrev = fields[3];
+        b->lruNext = fields[4];
+        b->rrpv = fields[5];
+        b->set = fields[6];
+        b->tag = fields[7];
+        b->prefetched = fields[8];
+        b->readyAt = fields[9];
+        ckpt_read(in, b->data, c->blockSize * sizeof(int));
+    }
+    ckpt_read(in, c->lruHead, c->numSets * sizeof(int));
+    ckpt_read(in, c->lruTail, c->numSets * sizeof(int));
+    ckpt_read(in, c->fifoNext, c->numSets * sizeof(int));
+    ckpt_read(in, c->plruTree, numBlocks);
+    ckpt_read(in, &c->rng, sizeof(c->rng));
+    long long counters[11];
+    ckpt_read(in, counters, sizeof(counters));
+    c->hits = counters[0];
+    c->misses = counters[1];
+    c->writebacks = counters[2];
+    c->evictions = counters[3];
+    c->memReads = counters[4];
+    c->memWrites = counters[5];
+    c->mshrMerges = counters[6];
+    c->mshrStalls = counters[7];
+    c->writeBufferMerges = counters[8];
+    c->writeBufferStalls = counters[9];
+    c->backInvalidations = counters[10];
+    c->lastHit = ckpt_read_int(in);
+    c->lastLatency = ckpt_read_int(in);
+
+    ckpt_expect(in, c->writeThrough, "write through flag");
+    ckpt_expect(in, c->writeAllocate, "write allocate flag");
+    ckpt_expect(in, c->numMshrs, "MSHR count");
+    ckpt_expect(in, c->writeBufferSize, "write buffer size");
+    ckpt_expect(in, c->numAbove, "caches above");
+    ckpt_expect(in, c->inclusion, "inclusion policy");
+    ckpt_read(in, c->mshrReadyAt, c->numMshrs * sizeof(int));
+    c->writeBufferCount = ckpt_read_int(in);
+    if (c->writeBufferCount < 0 || c->writeBufferCount > c->writeBufferSize) {
+        printf("error: checkpoint write buffer holds %d entries\n", c->writeBufferCount);
+        exit(1);
+    }
+    for (int i = 0; i < c->writeBufferCount; ++i) {
+        writeBufferEntryType *e = &c->writeBuffer[i];
+        e->addy = ckpt_read_int(in);
+        e->drainAt = ckpt_read_int(in);
+        ckpt_read(in, e->data, c->blockSize * sizeof(int));
+        ckpt_read(in, e->written, c->blockSize);
+    }
+    ckpt_expect(in, c->victimSize, "victim cache size");
+    c->victimClock = ckpt_read_int(in);
+    for (int i = 0; i < c->victimSize; ++i) {
+        victimEntryType *e = &c->victims[i];
+        int fields[5];
+        ckpt_read(in, fields, sizeof(fields));
+        e->valid = fields[0];
+        e->addy = fields[1];
+        e->dirty = fields[2];
+        e->readyAt = fields[3];
+        e->age = fields[4];
+        ckpt_read(in, e->data, c->blockSize * sizeof(int));
+    }
+    long long victims[2];
+    ckpt_read(in, victims, sizeof(victims));
+    c->victimHits = victims[0];
+    c->victimEvictions = victims[1];
+
+    prefetcherType *p = &c->prefetch;
+    ckpt_expect(in, p->kind, "prefetcher");
+    ckpt_expect(in, p->degree, "prefetch degree");
+    ckpt_expect(in, p->distance, "prefetch distance");
+    ckpt_read(in, p->table, sizeof(p->table));
+    ckpt_read(in, p->streams, sizeof(p->streams));
+    p->streamClock = ckpt_read_int(in);
+    ckpt_read(in, p->filter, sizeof(p->filter));
+    long long prefetches[4];
+    ckpt_read(in, prefetches, sizeof(prefetches));
+    p->issued = prefetches[0];
+    p->useful = prefetches[1];
+    p->late = prefetches[2];
+    p->polluting = prefetches[3];
+}
+
 void printStats(){
     printf("\ncache:\n");
     for (int set = 0; set < cache.numSets; ++set) {
@@ -210,7 +1589,7 @@ void printStats(){
             }
             /*
             printf(" Dirty:%i ", cache.blocks[set * cache.blocksPerSet + block].dirty);
-            printf("LRU:%i ", cache.blocks[set * cache.blocksPerSet + block].lruLabel);
+            printf("RRPV:%i ", cache.blocks[set * cache.blocksPerSet + block].rrpv);
             printf("Tag:%i ", cache.blocks[set * cache.blocksPerSet + block].tag);
             printf("Valid:%i ", cache.blocks[set * cache.blocksPerSet + block].valid);
             */
@@ -232,41 +1611,50 @@ void printStats(){
  *  -    memoryToCache: reading data from the memory to the cache          // LW / SW
  *  -    cacheToMemory: evicting cache data and writing it to the memory   // SW / LW
  *  -    cacheToNowhere: evicting cache data and throwing it away          // SW / LW
+ *  -    processorToMemory: a store written around the cache               // SW
+ *
+ * The text only appears at TRACE_LEVEL diff or full (see trace.h).
  */
 void printAction(int address, int size, enum actionType type)
 {
-    printf("$$$ transferring word [%d-%d] ", address, address + size - 1);
-
-    if (type == cacheToProcessor) {
-        printf("from the cache to the processor\n");
-    }
-    else if (type == processorToCache) {
-        printf("from the processor to the cache\n");
-    }
-    else if (type == memoryToCache) {
-        printf("from the memory to the cache\n");
-    }
-    else if (type == cacheToMemory) {
-        printf("from the cache to the memory\n");
+    if (traceLevel >= TRACE_DIFF) {
+        trace_print_action(address, size, type);
     }
-    else if (type == cacheToNowhere) {
-        printf("from the cache to nowhere\n");
+    if (traceBinary != NULL) {
+        trace_write_action(address, size, type);
     }
 }
 
 
 void printCache()
+{
+    printCacheStruct(&cache);
+}
+
+void printCacheStruct(cacheStruct *c)
 {
     printf("\ncache:\n");
-    for (int set = 0; set < cache.numSets; ++set) {
+    for (int set = 0; set < c->numSets; ++set) {
         printf("\tset %i:\n", set);
-        for (int block = 0; block < cache.blocksPerSet; ++block) {
+        for (int block = 0; block < c->blocksPerSet; ++block) {
             printf("\t\t[ %i ]: {", block);
-            for (int index = 0; index < cache.blockSize; ++index) {
-                printf(" %i", cache.blocks[set * cache.blocksPerSet + block].data[index]);
+            for (int index = 0; index < c->blockSize; ++index) {
+                printf(" %i", c->blocks[set * c->blocksPerSet + block].data[index]);
             }
             printf(" }\n");
         }
     }
+    if (c->victimSize > 0) {
+        printf("\tvictim cache:\n");
+        for (int i = 0; i < c->victimSize; ++i) {
+            if (c->victims[i].valid) {
+                printf("\t\t[ %i ]: {", c->victims[i].addy);
+                for (int index = 0; index < c->blockSize; ++index) {
+                    printf(" %i", c->victims[i].data[index]);
+                }
+                printf(" }\n");
+            }
+        }
+    }
     printf("end cache\n");
-}
\ No newline at end of file
+}
@@ -0,0 +1,367 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdio.h>
+
+#define MAX_BLOCK_SIZE 256
+#define MAX_CACHE_WORDS (1 << 24) // data words in one cache
+#define MAX_CACHES_ABOVE 16 // caches a lower level can sit under
+
+enum actionType
+{
+    cacheToProcessor,
+    processorToCache,
+    memoryToCache,
+    cacheToMemory,
+    cacheToNowhere,
+    processorToMemory // a store written around the cache (no write allocate)
+};
+
+/*
+ * Which block of a full set a miss replaces. Empty blocks are always
+ * filled first, lowest index first, whatever the policy.
+ */
+enum replacementPolicy
+{
+    REPLACE_LRU, // least recently used, kept as a per-set list
+    REPLACE_PLRU, // tree pseudo-LRU, one bit per internal node
+    REPLACE_SRRIP, // static re-reference interval prediction, 2-bit RRPV
+    REPLACE_BRRIP, // bimodal RRIP: most fills predicted distant
+    REPLACE_FIFO, // oldest fill first
+    REPLACE_RANDOM
+};
+
+/*
+ * Hardware prefetchers, which watch the demand accesses and bring in the
+ * blocks they expect to be wanted soon. Each has a degree (blocks per
+ * prefetch) and a distance (how far ahead the first of them is):
+ *  - next-line: on a demand miss, or the first use of a prefetched block,
+ *    the degree blocks starting distance blocks past the accessed one
+ *  - stride: a table, indexed by the pc of the access, of the last address
+ *    and stride; once a stride repeats, the addresses distance through
+ *    distance + degree - 1 strides ahead
+ *  - stream: STREAM_BUFFERS buffers beside the cache, each allocated on a
+ *    miss no buffer holds and filled with the degree blocks starting
+ *    distance blocks past it. A miss a buffer holds moves that block into
+ *    the cache, drops the ones ahead of it and tops the buffer up.
+ * Next-line and stride prefetch into the cache itself, replacing blocks
+ * like a miss does.
+ *
+ * A prefetch into the cache takes as long as a demand fill of its block
+ * from below would, a stream buffer's latency cycles, on the clock the
+ * owner keeps in now.
+ * A demand access to a prefetched block that has not arrived yet is a late
+ * prefetch and counts as a miss (without fetching the block again). The
+ * owner also sets pc before each access for the stride table; left at 0,
+ * every prefetch is on time and all accesses share one table entry.
+ */
+enum prefetchKind
+{
+    PREFETCH_NONE,
+    PREFETCH_NEXT_LINE,
+    PREFETCH_STRIDE,
+    PREFETCH_STREAM
+};
+
+#define PREFETCH_TABLE_SIZE 64 // stride table entries, a power of two
+#define PREFETCH_FILTER_SIZE 256 // blocks evicted by prefetches, a power of two
+#define STREAM_BUFFERS 4
+#define MAX_STREAM_DEPTH 16 // the largest stream prefetch degree
+
+typedef struct strideEntryStruct
+{
+    int pc; // -1 if unused
+    int lastAddr;
+    int stride;
+} strideEntryType;
+
+typedef struct streamBufferStruct
+{
+    int count; // blocks held, 0 if the buffer is free
+    int head; // the oldest block's slot
+    int next; // the first word of the block to fetch next
+    int lastUse; // stream buffer clock value, to replace the least recent
+    int blocks[MAX_STREAM_DEPTH]; // first word addresses, oldest at head
+    int readyAt[MAX_STREAM_DEPTH];
+} streamBufferType;
+
+typedef struct prefetcherStruct
+{
+    int kind; // enum prefetchKind
+    int degree;
+    int distance;
+    int latency; // cycles from issue until a stream buffer's block can be used
+    int addrLimit; // blocks at or past this word are not prefetched, 0 for no limit
+    strideEntryType table[PREFETCH_TABLE_SIZE];
+    streamBufferType streams[STREAM_BUFFERS];
+    int streamClock;
+    int filter[PREFETCH_FILTER_SIZE]; // first word + 1 of blocks prefetches evicted, 0 if none
+    long long issued; // blocks brought in from memory by prefetches
+    long long useful; // demand accesses that found a prefetched block ready
+    long long late; // ... and that found it still on its way
+    long long polluting; // demand misses on blocks a prefetch had evicted
+} prefetcherType;
+
+/*
+ * Misses and writes. By default a cache is blocking, write-back and
+ * write-allocate, and writes dirty blocks straight to memory when it
+ * evicts them. Optionally:
+ *  - MSHRs (miss status holding registers) let up to numMshrs fills be on
+ *    their way at once. A store miss then only waits for a free MSHR, not
+ *    for its block, and a later access to a block still being filled
+ *    merges with that fill: a load waits for what is left of it, a store
+ *    not at all. A miss that finds every MSHR busy waits for the first to
+ *    free up. Prefetches need a free MSHR too, or are dropped.
+ *  - a coalescing write buffer of writeBufferSize block sized entries
+ *    holds dirty evictions and write-through or write-around stores.
+ *    Writes to a block already buffered merge into its entry. An entry
+ *    goes to memory missLatency cycles after it was made, when the buffer
+ *    is full and needs its place (the write waits missLatency cycles for
+ *    that), or before its block is read from memory again.
+ *  - write-through stores also write the word to memory (through the
+ *    buffer, if any, or waiting missLatency cycles); blocks stay clean.
+ *  - without write allocate, a store miss writes the word to memory the
+ *    same way and leaves the cache alone.
+ * Times are on the owner's clock in now; lastLatency is what the most
+ * recent access takes, hitLatency or missLatency for a blocking cache.
+ */
+#define MAX_MSHRS 16
+#define MAX_WRITE_BUFFER 16
+
+typedef struct writeBufferEntryStruct
+{
+    int addy; // first word address of the block
+    int drainAt; // when it goes to memory, on now's clock
+    int *data; // blockSize words of the cache's arena
+    unsigned char *written; // which words of data are to be written
+} writeBufferEntryType;
+
+/*
+ * Victim cache. A cache can have a small fully associative buffer of
+ * victimSize blocks beside it that catches the blocks it evicts, clean or
+ * dirty, instead of dropping or writing them back. A miss looks there
+ * before going below: a block found is swapped back into the cache for the
+ * one the miss replaces, and the access counts as a hit at the hit
+ * latency. Only a block pushed out of the full buffer, oldest first, is
+ * written back (or handed to an exclusive level below).
+ */
+#define MAX_VICTIM_BLOCKS 16
+
+typedef struct victimEntryStruct
+{
+    int valid;
+    int addy; // first word address of the block
+    int dirty;
+    int readyAt; // when its fill completes, if it was still on its way
+    int age; // victim clock value when it came in, to push out the oldest
+    int *data; // blockSize words of the cache's arena
+} victimEntryType;
+
+// Word level access to the memory below a cache, as mem_access() but with
+// the context given to cacheSetup()
+typedef int (*memAccessFn)(void *ctx, int addr, int write_flag, int write_data);
+
+// Block level access to the same memory: read or write the n words at addr
+// in one call. Optional (cacheSetBlockAccess); refills and whole block
+// writes then use it instead of n calls of the word level function.
+typedef void (*memBlockFn)(void *ctx, int addr, int *words, int n, int write_flag);
+
+/*
+ * One access of a batch for cacheAccessBatch(), which makes them in order,
+ * exactly as that many cacheAccess() calls would, and puts what each
+ * returns in results. A run of accesses to one block looks for it in the
+ * way the previous one used before searching the set.
+ */
+typedef struct cacheRequestStruct
+{
+    int addr;
+    int write_flag;
+    int write_data;
+} cacheRequestType;
+
+/*
+ * Levels. A cache can sit on a lower level cache instead of on memory
+ * (cacheSetNext), and that on another, down to the last level, which is
+ * on memAccess. The lower levels only move whole blocks: a miss above
+ * reads its block from the level below, and an eviction above writes a
+ * dirty block back into it. How the levels' contents relate is the lower
+ * level's inclusion policy:
+ *  - inclusive: it holds everything the caches above it hold, so evicting
+ *    a block also invalidates (back-invalidates) it above, taking any
+ *    dirty data along
+ *  - exclusive: it holds what the caches above do not. A hit moves the
+ *    block up, dirty or not, a miss goes past it to the level below, and
+ *    the blocks the caches above evict come down into it, clean or dirty.
+ *    Its blocks must be the size of theirs.
+ *  - nine (non-inclusive non-exclusive): a miss fills it as well as the
+ *    cache above, and either evicts on its own
+ * A level's blocks are at least as large as those of the caches above it.
+ * An access that misses in a level takes as long as the level below takes
+ * to supply the block, its hit latency or, if it misses too, what the
+ * next one down takes; the last level's miss latency is memory's. Only
+ * the caches at the top trace their actions, and lower levels are always
+ * blocking and write-back, without a prefetcher.
+ */
+enum inclusionPolicy
+{
+    INCLUDE_INCLUSIVE,
+    INCLUDE_EXCLUSIVE,
+    INCLUDE_NINE
+};
+
+/*
+ * Coherence. A cache that shares the memory below it with the caches of
+ * other cores has a bus (cacheSetBus), which it tells about each block it
+ * fills, upgrades or evicts; coherence.c answers and keeps the copies
+ * coherent. A block's MESI state is its valid, dirty and exclusive bits:
+ * modified is dirty, exclusive is exclusive and clean, shared is valid and
+ * not exclusive. A fill asks for a shared copy, or an exclusive one for a
+ * store, and a store to a shared copy first asks for an upgrade. The bus
+ * returns how many cycles the request takes; for BUS_READ it also says
+ * whether the block may be held exclusive anyway (MESI's E state).
+ *
+ * The shared level under such caches is attached with cacheShareLevel():
+ * it stays inclusive of them and, as the directory, records in each of its
+ * blocks' sharers which of them may hold a copy.
+ */
+enum busRequest
+{
+    BUS_READ, // a load miss
+    BUS_READ_EXCLUSIVE, // a store miss
+    BUS_UPGRADE, // a store to a shared copy
+    BUS_EVICT, // a clean block thrown out
+    BUS_WRITEBACK // a dirty block written back
+};
+
+typedef int (*busFn)(void *ctx, int request, int addr, int *exclusive);
+
+typedef struct blockStruct
+{
+    int *data; // blockSize words of the cache's arena
+    int valid; // ADDED VARIABLE
+    int addy; // ADDED VARIABLE: first word address of the block
+    int dirty;
+    int lruPrev; // LRU list neighbours within the set, -1 at the ends
+    int lruNext;
+    int rrpv; // RRIP re-reference prediction value
+    int set;
+    int tag;
+    int prefetched; // brought in by a prefetch and not used since
+    int readyAt; // when the prefetch that brought it in completes
+    int exclusive; // coherent caches: no other cache holds it (M or E)
+    unsigned int sharers; // shared levels: the caches above that may hold it, by bit
+} blockStruct;
+
+/*
+ * A cache's blocks, their data, the per-set replacement state and the
+ * write buffer and victim cache entries are all carved out of one
+ * allocation, its arena, sized for its geometry when it is set up and laid
+ * out again for the write buffer cacheSetWritePolicy() and the victim
+ * cache cacheSetVictimCache() give it. cacheFree() releases it.
+ */
+typedef struct cacheStruct
+{
+    blockStruct *blocks; // numSets * blocksPerSet, a set's ways together
+    int blockSize;
+    int numSets;
+    int blocksPerSet;
+    int offsetBits; // log2(blockSize)
+    int tagShift; // log2(blockSize) + log2(numSets)
+    int waysBits; // log2(blocksPerSet), to find a set's first block
+    int offsetMask; // blockSize - 1
+    int setMask; // numSets - 1
+    int policy; // enum replacementPolicy
+    int *lruHead; // per set: most recently used way, or -1
+    int *lruTail; // per set: least recently used way, or -1
+    int *fifoNext; // per set: the next way FIFO replaces
+    unsigned char *plruTree; // per set: nodes 1..ways-1 from the set's first slot
+    void *arena; // where all of the above live
+    unsigned int rng; // random and BRRIP state
+    memAccessFn memAccess; // the memory below this cache, or below the last level
+    memBlockFn memBlock; // the same a block at a time, or NULL
+    void *memCtx;
+    struct cacheStruct *next; // the level below, NULL if memory is
+    struct cacheStruct *above[MAX_CACHES_ABOVE]; // the caches this is the next level of
+    int numAbove;
+    int inclusion; // enum inclusionPolicy, towards the caches above
+    busFn bus; // coherent caches only, else NULL
+    void *busCtx;
+    long long hits;
+    long long misses;
+    long long writebacks; // dirty blocks written back on eviction
+    long long evictions; // valid blocks replaced
+    int lastHit; // whether the most recent access hit
+    int plain; // a lone cache on memory with none of the options below: cacheAccess skips them
+    prefetcherType prefetch;
+    int now; // the owner's clock, for whether prefetches arrived in time
+    int pc; // the instruction making the next access, for the stride prefetcher
+    int hitLatency; // cycles on now's clock
+    int missLatency;
+    int lastLatency; // cycles the most recent access takes
+    int writeThrough; // stores also go to memory, blocks are never dirty
+    int writeAllocate; // store misses fill the block, rather than write around it
+    int numMshrs; // fills that can be on their way at once, 0 for a blocking cache
+    int mshrReadyAt[MAX_MSHRS]; // when each MSHR's fill completes
+    int writeBufferSize; // entries, 0 to write straight to memory
+    int writeBufferCount;
+    writeBufferEntryType *writeBuffer; // writeBufferSize entries, those in use oldest first
+    long long memReads; // words read from the memory or level below
+    long long memWrites; // words written to it
+    long long mshrMerges; // accesses to a block whose fill was still on its way
+    long long mshrStalls; // misses that waited for a free MSHR
+    long long writeBufferMerges; // writes merged into a buffered block
+    long long writeBufferStalls; // writes that waited for a full buffer
+    long long backInvalidations; // blocks above invalidated to keep an inclusive level inclusive
+    int victimSize; // victim cache blocks, 0 for none
+    int victimClock;
+    victimEntryType *victims; // victimSize entries
+    long long victimHits; // misses the victim cache supplied the block for
+    long long victimEvictions; // blocks pushed out of it
+} cacheStruct;
+
+/*
+ * The course interface (cache_init, cache_access, printCache) drives the
+ * global cache on top of mem_access(). It takes its replacement policy from
+ * the CACHE_POLICY environment variable (lru if unset), a prefetcher from
+ * CACHE_PREFETCH (kind[,degree[,distance]], none if unset), the blocks of a
+ * victim cache from CACHE_VICTIM (none if unset) and its tracing from
+ * TRACE_LEVEL and TRACE_BINARY. Simulators that need several caches use
+ * the same model through a cacheStruct of their own; with tracing off,
+ * separate instances can be used from separate threads.
+ */
+void cache_init(int blockSize, int numSets, int blocksPerSet);
+int cache_access(int addr, int write_flag, int write_data);
+void printCache();
+void printStats();
+
+int cacheParsePolicy(const char *name);
+const char *cachePolicyName(int policy);
+void cacheSetup(cacheStruct *c, int blockSize, int numSets, int blocksPerSet,
+        int policy, memAccessFn memAccess, void *memCtx);
+void cacheFree(cacheStruct *c);
+void cacheSetBlockAccess(cacheStruct *c, memBlockFn memBlock);
+int cacheParseInclusion(const char *name);
+const char *cacheInclusionName(int inclusion);
+void cacheSetNext(cacheStruct *c, cacheStruct *next, int inclusion);
+void cacheSetBus(cacheStruct *c, busFn bus, void *busCtx);
+void cacheShareLevel(cacheStruct *c, cacheStruct *shared);
+blockStruct *cacheFindBlock(const cacheStruct *c, int addr);
+int cacheProbeLatency(const cacheStruct *c, int addr);
+int cacheReadBlock(cacheStruct *c, int addr, int n, int *data);
+void cacheWriteBlock(cacheStruct *c, int addr, const int *data, int n);
+void cacheInvalidate(cacheStruct *c, int addr);
+int cacheParsePrefetcher(const char *spec, int *kind, int *degree, int *distance);
+const char *cachePrefetcherName(int kind);
+void cacheSetPrefetcher(cacheStruct *c, int kind, int degree, int distance, int latency,
+        int addrLimit);
+void cacheSetLatency(cacheStruct *c, int hitLatency, int missLatency);
+void cacheSetWritePolicy(cacheStruct *c, int writeThrough, int writeAllocate, int writeBufferSize);
+void cacheSetMshrs(cacheStruct *c, int numMshrs);
+void cacheSetVictimCache(cacheStruct *c, int victimSize);
+int cacheAccess(cacheStruct *c, int addr, int write_flag, int write_data);
+void cacheAccessBatch(cacheStruct *c, const cacheRequestType *requests, int n, int *results);
+void cacheSave(const cacheStruct *c, FILE *out);
+void cacheRestore(cacheStruct *c, FILE *in);
+void printCacheStruct(cacheStruct *c);
+
+#endif
@@ -0,0 +1,351 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "trace.h"
+
+/*
+ * Tag-only cache simulation of an address trace written with the
+ * simulator's --addr-trace.
+ *
+ * build: gcc -O2 -o cachesim cachesim.c trace.c
+ * usage: cachesim [--policy lru|fifo] [--only instr|data] [--no-classify]
+ *                 <blockSize,numSets,blocksPerSet> <trace file>
+ *
+ * The trace is mapped into memory and streamed through a write-back,
+ * write-allocate cache that keeps only tags and dirty bits, so geometries
+ * are not limited by the data-carrying model in cache.c. Fetches count as
+ * reads. Unless --no-classify is given, every miss is also classified as
+ * compulsory (first touch of the block), capacity (a fully associative LRU
+ * cache of the same size misses too) or conflict (it hits).
+ */
+
+typedef struct tagCacheStruct {
+    int offsetBits;
+    int setMask;
+    int ways;
+    int policy;
+    // Per set, the blocks present, most recently used (lru) or most
+    // recently filled (fifo) first, each as block number << 1 | dirty
+    unsigned int *lines;
+    int *used; // per set: how many of its lines are valid
+    long long hits;
+    long long misses;
+    long long writebacks;
+} tagCacheType;
+
+enum tagPolicy
+{
+    TAG_LRU,
+    TAG_FIFO
+};
+
+/*
+ * Fully associative LRU shadow for the miss classification. Every block
+ * ever touched gets a node, found through an open addressing hash table;
+ * resident nodes are also on the recency list.
+ */
+typedef struct shadowNodeStruct {
+    unsigned int block;
+    int prev;
+    int next;
+    int resident;
+} shadowNodeType;
+
+typedef struct shadowStruct {
+    shadowNodeType *nodes;
+    int numNodes;
+    int maxNodes;
+    int *slots; // node index + 1, 0 if empty
+    unsigned int slotMask;
+    int capacity; // blocks the shadow holds, the size of the real cache
+    int resident;
+    int head; // most recently used, or -1
+    int tail;
+    long long compulsory;
+    long long capacityMisses;
+    long long conflict;
+} shadowType;
+
+static void *allocOrDie(size_t size) {
+    void *p = calloc(1, size);
+    if (p == NULL) {
+        printf("error: out of memory\n");
+        exit(1);
+    }
+    return p;
+}
+
+static int isPowerOfTwo(int n) {
+    return n > 0 && (n & (n - 1)) == 0;
+}
+
+static void tagCacheInit(tagCacheType *c, int blockSize, int numSets, int ways, int policy) {
+    memset(c, 0, sizeof(*c));
+    while ((1 << c->offsetBits) != blockSize) {
+        c->offsetBits++;
+    }
+    c->setMask = numSets - 1;
+    c->ways = ways;
+    c->policy = policy;
+    c->lines = allocOrDie((size_t)numSets * ways * sizeof(unsigned int));
+    c->used = allocOrDie((size_t)numSets * sizeof(int));
+}
+
+/*
+ * One access. Returns whether it hit. On a hit under lru, and on every
+ * fill, the block moves to the front of its set; a full set loses the
+ * block at the back.
+ */
+static inline int tagCacheAccess(tagCacheType *c, unsigned int block, int write) {
+    int set = block & c->setMask;
+    unsigned int *lines = c->lines + (size_t)set * c->ways;
+    int used = c->used[set];
+    unsigned int key = block << 1;
+    int way;
+    for (way = 0; way < used; ++way) {
+        if ((lines[way] & ~1u) == key) {
+            break;
+        }
+    }
+    if (way < used) {
+        c->hits++;
+        unsigned int line = lines[way] | write;
+        if (c->policy == TAG_LRU) {
+            memmove(lines + 1, lines, way * sizeof(unsigned int));
+            lines[0] = line;
+        }
+        else {
+            lines[way] = line;
+        }
+        return 1;
+    }
+
+    c->misses++;
+    if (used == c->ways) {
+        c->writebacks += lines[used - 1] & 1;
+        used--;
+    }
+    else {
+        c->used[set] = used + 1;
+    }
+    memmove(lines + 1, lines, used * sizeof(unsigned int));
+    lines[0] = key | write;
+    return 0;
+}
+
+static void shadowInit(shadowType *s, int capacity) {
+    memset(s, 0, sizeof(*s));
+    s->capacity = capacity;
+    s->head = -1;
+    s->tail = -1;
+    s->maxNodes = 1024;
+    s->nodes = allocOrDie(s->maxNodes * sizeof(shadowNodeType));
+    s->slotMask = 2 * s->maxNodes - 1;
+    s->slots = allocOrDie((s->slotMask + 1) * sizeof(int));
+}
+
+static inline unsigned int hashBlock(unsigned int block) {
+    return block * 0x9e3779b1u;
+}
+
+// Double the node array and the hash table, which stays at most half full
+static void shadowGrow(shadowType *s) {
+    s->maxNodes *= 2;
+    s->nodes = realloc(s->nodes, s->maxNodes * sizeof(shadowNodeType));
+    if (s->nodes == NULL) {
+        printf("error: out of memory\n");
+        exit(1);
+    }
+    free(s->slots);
+    s->slotMask = 2 * s->maxNodes - 1;
+    s->slots = allocOrDie((s->slotMask + 1) * sizeof(int));
+    for (int n = 0; n < s->numNodes; ++n) {
+        unsigned int slot = hashBlock(s->nodes[n].block) & s->slotMask;
+        while (s->slots[slot]) {
+            slot = (slot + 1) & s->slotMask;
+        }
+        s->slots[slot] = n + 1;
+    }
+}
+
+static void shadowUnlink(shadowType *s, int n) {
+    shadowNodeType *node = &s->nodes[n];
+    if (node->prev >= 0) {
+        s->nodes[node->prev].next = node->next;
+    }
+    else {
+        s->head = node->next;
+    }
+    if (node->next >= 0) {
+        s->nodes[node->next].prev = node->prev;
+    }
+    else {
+        s->tail = node->prev;
+    }
+}
+
+/*
+ * Touch block in the fully associative shadow and, if the real cache
+ * missed, classify that miss.
+ */
+static void shadowAccess(shadowType *s, unsigned int block, int realHit) {
+    unsigned int slot = hashBlock(block) & s->slotMask;
+    int n;
+    while ((n = s->slots[slot]) && s->nodes[n - 1].block != block) {
+        slot = (slot + 1) & s->slotMask;
+    }
+    int shadowHit = 0;
+    if (n == 0) {
+        if (!realHit) {
+            s->compulsory++;
+        }
+        if (s->numNodes == s->maxNodes) {
+            shadowGrow(s);
+            slot = hashBlock(block) & s->slotMask;
+            while (s->slots[slot]) {
+                slot = (slot + 1) & s->slotMask;
+            }
+        }
+        n = s->numNodes++;
+        s->slots[slot] = n + 1;
+        s->nodes[n].block = block;
+        s->nodes[n].resident = 0;
+    }
+    else {
+        n--;
+        shadowHit = s->nodes[n].resident;
+        if (!realHit) {
+            if (shadowHit) {
+                s->conflict++;
+            }
+            else {
+                s->capacityMisses++;
+            }
+        }
+    }
+
+    if (shadowHit) {
+        shadowUnlink(s, n);
+    }
+    else if (s->resident == s->capacity) {
+        s->nodes[s->tail].resident = 0;
+        shadowUnlink(s, s->tail);
+    }
+    else {
+        s->resident++;
+    }
+    shadowNodeType *node = &s->nodes[n];
+    node->resident = 1;
+    node->prev = -1;
+    node->next = s->head;
+    if (s->head >= 0) {
+        s->nodes[s->head].prev = n;
+    }
+    else {
+        s->tail = n;
+    }
+    s->head = n;
+}
+
+static void usage(char *name) {
+    printf("error: usage: %s [--policy lru|fifo] [--only instr|data] [--no-classify] <blockSize,numSets,blocksPerSet> <trace file>\n", name);
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    int policy = TAG_LRU;
+    int only = -1; // -1 all accesses, 0 data only, 1 fetches only
+    int classify = 1;
+    char *geometryArg = NULL;
+    char *filename = NULL;
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--policy") && i + 1 < argc) {
+            ++i;
+            if (!strcmp(argv[i], "lru")) {
+                policy = TAG_LRU;
+            }
+            else if (!strcmp(argv[i], "fifo")) {
+                policy = TAG_FIFO;
+            }
+            else {
+                usage(argv[0]);
+            }
+        }
+        else if (!strcmp(argv[i], "--only") && i + 1 < argc) {
+            ++i;
+            if (!strcmp(argv[i], "instr")) {
+                only = 1;
+            }
+            else if (!strcmp(argv[i], "data")) {
+                only = 0;
+            }
+            else {
+                usage(argv[0]);
+            }
+        }
+        else if (!strcmp(argv[i], "--no-classify")) {
+            classify = 0;
+        }
+        else if (geometryArg == NULL && argv[i][0] != '-') {
+            geometryArg = argv[i];
+        }
+        else if (filename == NULL && argv[i][0] != '-') {
+            filename = argv[i];
+        }
+        else {
+            usage(argv[0]);
+        }
+    }
+    if (filename == NULL) {
+        usage(argv[0]);
+    }
+
+    int blockSize, numSets, blocksPerSet;
+    if (sscanf(geometryArg, "%d,%d,%d", &blockSize, &numSets, &blocksPerSet) != 3
+            || !isPowerOfTwo(blockSize) || !isPowerOfTwo(numSets) || !isPowerOfTwo(blocksPerSet)) {
+        printf("error: cache geometry %s must be three powers of two\n", geometryArg);
+        exit(1);
+    }
+
+    size_t numRecords;
+    const unsigned int *records = trace_map_address(filename, &numRecords);
+
+    tagCacheType cache;
+    shadowType shadow;
+    tagCacheInit(&cache, blockSize, numSets, blocksPerSet, policy);
+    if (classify) {
+        shadowInit(&shadow, numSets * blocksPerSet);
+    }
+
+    long long counts[TRACE_ACCESS_FETCH + 1] = {0};
+    int shift = TRACE_ACCESS_BITS + cache.offsetBits;
+    for (size_t i = 0; i < numRecords; ++i) {
+        unsigned int record = records[i];
+        int type = record & TRACE_ACCESS_MASK;
+        if (only >= 0 && (type == TRACE_ACCESS_FETCH) != only) {
+            continue;
+        }
+        counts[type]++;
+        unsigned int block = record >> shift;
+        int hit = tagCacheAccess(&cache, block, type == TRACE_ACCESS_WRITE);
+        if (classify) {
+            shadowAccess(&shadow, block, hit);
+        }
+    }
+
+    long long accesses = cache.hits + cache.misses;
+    printf("cache %d,%d,%d (%s)\n", blockSize, numSets, blocksPerSet, policy == TAG_LRU ? "lru" : "fifo");
+    printf("accesses %lld (reads %lld, writes %lld, fetches %lld)\n", accesses,
+            counts[TRACE_ACCESS_READ], counts[TRACE_ACCESS_WRITE], counts[TRACE_ACCESS_FETCH]);
+    printf("hits %lld\n", cache.hits);
+    printf("misses %lld\n", cache.misses);
+    printf("hit rate %.2f%%\n", accesses ? 100.0 * cache.hits / accesses : 0.0);
+    printf("writebacks %lld\n", cache.writebacks);
+    if (classify) {
+        printf("compulsory %lld\n", shadow.compulsory);
+        printf("capacity %lld\n", shadow.capacityMisses);
+        printf("conflict %lld\n", shadow.conflict);
+    }
+    return 0;
+}
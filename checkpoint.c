@@ -0,0 +1,37 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "checkpoint.h"
+
+void ckpt_write(FILE *out, const void *data, size_t size) {
+    if (fwrite(data, 1, size, out) != size) {
+        printf("error: can't write checkpoint\n");
+        exit(1);
+    }
+}
+
+void ckpt_write_int(FILE *out, int value) {
+    ckpt_write(out, &value, sizeof(int));
+}
+
+void ckpt_read(FILE *in, void *data, size_t size) {
+    if (fread(data, 1, size, in) != size) {
+        printf("error: checkpoint is truncated\n");
+        exit(1);
+    }
+}
+
+int ckpt_read_int(FILE *in) {
+    int value;
+    ckpt_read(in, &value, sizeof(int));
+    return value;
+}
+
+// Read an int that has to be expected, such as a section tag or a size
+void ckpt_expect(FILE *in, int expected, const char *what) {
+    int value = ckpt_read_int(in);
+    if (value != expected) {
+        printf("error: checkpoint %s is %d, expected %d\n", what, value, expected);
+        exit(1);
+    }
+}
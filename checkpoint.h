@@ -0,0 +1,36 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <stdio.h>
+
+/*
+ * Checkpoint files: a snapshot of a whole simulator instance, written by
+ * the simulator's --checkpoint-every / --checkpoint-at-pc and read back by
+ * --restore. The header is CKPT_MAGIC and CKPT_VERSION; the rest is a
+ * sequence of sections, each starting with its CKPT_SECTION_* tag and
+ * written by the module that owns the state (cache.c, bpred.c, memory.c,
+ * stats.c). Like traces and program images, everything is in native ints.
+ *
+ * Readers check each tag and every geometry or size against the instance
+ * being restored, and refuse a checkpoint that doesn't match it.
+ */
+#define CKPT_MAGIC 0x504b434c // "LCKP"
+#define CKPT_VERSION 6
+
+enum checkpointSection
+{
+    CKPT_SECTION_PIPELINE = 1,
+    CKPT_SECTION_STATS,
+    CKPT_SECTION_PREDICTOR,
+    CKPT_SECTION_CACHE,
+    CKPT_SECTION_MEMORY,
+    CKPT_SECTION_END
+};
+
+void ckpt_write(FILE *out, const void *data, size_t size);
+void ckpt_write_int(FILE *out, int value);
+void ckpt_read(FILE *in, void *data, size_t size);
+int ckpt_read_int(FILE *in);
+void ckpt_expect(FILE *in, int expected, const char *what);
+
+#endif
@@ -0,0 +1,234 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "coherence.h"
+
+static const char *protocolNames[] = {"msi", "mesi"};
+
+int coherence_parse_protocol(const char *name) {
+    for (int protocol = COHERENCE_MSI; protocol <= COHERENCE_MESI; ++protocol) {
+        if (!strcmp(name, protocolNames[protocol])) {
+            return protocol;
+        }
+    }
+    return -1;
+}
+
+const char *coherence_protocol_name(int protocol) {
+    return protocolNames[protocol];
+}
+
+static void logEvent(coreCoherenceType *core, int cycle, int kind, int addr, int value) {
+    if (core->numEvents == core->maxEvents) {
+        core->maxEvents = core->maxEvents ? 2 * core->maxEvents : 1024;
+        core->events = realloc(core->events, core->maxEvents * sizeof(coherenceEventType));
+        if (core->events == NULL) {
+            printf("error: out of memory\n");
+            exit(1);
+        }
+    }
+    coherenceEventType *e = &core->events[core->numEvents++];
+    e->cycle = cycle;
+    e->kind = kind;
+    e->addr = addr;
+    e->value = value;
+}
+
+/*
+ * The bus of a core's data cache, called from the core's own thread in the
+ * middle of a quantum: log the request and answer it from the shared level
+ * without touching it.
+ */
+static int busRequest(void *ctx, int request, int addr, int *exclusive) {
+    coreCoherenceType *core = ctx;
+    const coherenceType *coh = core->coh;
+    logEvent(core, core->cache->now, request, addr, 0);
+    switch (request) {
+        case BUS_READ: {
+            // exclusive if the directory knows of no other copy
+            const blockStruct *b = cacheFindBlock(coh->shared, addr);
+            *exclusive = coh->protocol == COHERENCE_MESI
+                    && (b == NULL || (b->sharers & ~(1u << core->id)) == 0);
+            return cacheProbeLatency(coh->shared, addr);
+        }
+        case BUS_READ_EXCLUSIVE:
+            return cacheProbeLatency(coh->shared, addr);
+        case BUS_UPGRADE: // only the directory is asked
+            return coh->shared->hitLatency;
+        default:
+            return 0;
+    }
+}
+
+void coherence_init(coherenceType *coh, int protocol, int numCores, cacheStruct *shared) {
+    if (numCores < 1 || numCores > MAX_CORES) {
+        printf("error: coherence needs 1 to %d cores\n", MAX_CORES);
+        exit(1);
+    }
+    memset(coh, 0, sizeof(*coh));
+    coh->protocol = protocol;
+    coh->numCores = numCores;
+    coh->shared = shared;
+    for (int i = 0; i < numCores; ++i) {
+        coh->cores[i].coh = coh;
+        coh->cores[i].id = i;
+    }
+}
+
+// Give core its memory and data cache (or NULL), which goes on the shared level
+void coherence_attach(coherenceType *coh, int core, cacheStruct *cache, memoryType *mem) {
+    coreCoherenceType *c = &coh->cores[core];
+    c->mem = mem;
+    c->cache = cache;
+    if (cache != NULL) {
+        if (coh->shared == NULL) {
+            printf("error: coherent caches need a shared level under them\n");
+            exit(1);
+        }
+        cacheSetBus(cache, busRequest, c);
+        cacheShareLevel(cache, coh->shared);
+    }
+}
+
+// Log a store core made in cycle, for the other cores to see at the next sync
+void coherence_store(coherenceType *coh, int core, int cycle, int addr, int value) {
+    logEvent(&coh->cores[core], cycle, COHERENCE_STORE, addr, value);
+}
+
+
+/* ----------------------------- replay ---------------------------- */
+
+// Whether c holds any part of the shared level's block b
+static int holdsPart(const coherenceType *coh, const cacheStruct *c, const blockStruct *b) {
+    for (int a = b->addy; a < b->addy + coh->shared->blockSize; a += c->blockSize) {
+        if (cacheFindBlock(c, a) != NULL) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Take core off the directory entry for addr's block, unless it still holds part of it
+static void dropSharer(coherenceType *coh, int core, int addr) {
+    blockStruct *b = cacheFindBlock(coh->shared, addr);
+    if (b != NULL && !holdsPart(coh, coh->cores[core].cache, b)) {
+        b->sharers &= ~(1u << core);
+    }
+}
+
+// Write c's modified copy b down into the shared level, leaving it clean
+static void writeDown(coherenceType *coh, const cacheStruct *c, blockStruct *b) {
+    cacheWriteBlock(coh->shared, b->addy, b->data, c->blockSize);
+    b->dirty = 0;
+}
+
+static void replayRequest(coherenceType *coh, coreCoherenceType *core, const coherenceEventType *e) {
+    cacheStruct *shared = coh->shared;
+    int n = core->cache->blockSize;
+    if (e->kind == BUS_EVICT || e->kind == BUS_WRITEBACK) {
+        if (e->kind == BUS_WRITEBACK) {
+            // the block is gone from the cache, but the core's memory has it
+            for (int i = 0; i < n; ++i) {
+                coh->scratch[i] = memory_read(core->mem, e->addr + i);
+            }
+            cacheWriteBlock(shared, e->addr, coh->scratch, n);
+            core->writebacks++;
+        }
+        dropSharer(coh, core->id, e->addr);
+        return;
+    }
+
+    if (e->kind == BUS_READ) {
+        core->reads++;
+    }
+    else if (e->kind == BUS_READ_EXCLUSIVE) {
+        core->readExclusives++;
+    }
+    else {
+        core->upgrades++;
+    }
+    if (e->kind != BUS_UPGRADE || cacheFindBlock(shared, e->addr) == NULL) {
+        cacheReadBlock(shared, e->addr, n, coh->scratch);
+    }
+    blockStruct *entry = cacheFindBlock(shared, e->addr);
+    unsigned int others = entry->sharers & ~(1u << core->id);
+    entry->sharers |= 1u << core->id;
+    int stillShared = 0;
+    for (int i = 0; others != 0; ++i, others >>= 1) {
+        cacheStruct *c = coh->cores[i].cache;
+        blockStruct *copy = (others & 1) ? cacheFindBlock(c, e->addr) : NULL;
+        if (copy == NULL) {
+            continue;
+        }
+        if (copy->dirty) {
+            writeDown(coh, c, copy);
+            core->interventions++;
+        }
+        if (e->kind == BUS_READ) {
+            copy->exclusive = 0;
+            stillShared = 1;
+        }
+        else {
+            cacheInvalidate(c, e->addr);
+            dropSharer(coh, i, e->addr);
+            core->invalidations++;
+        }
+    }
+    // a read granted exclusive on a directory entry from the start of the
+    // quantum, while another core was reading it too: it is shared after all
+    blockStruct *own = cacheFindBlock(core->cache, e->addr);
+    if (own == NULL) { // gone again by the end of the quantum
+        dropSharer(coh, core->id, e->addr);
+    }
+    else if (stillShared && !own->dirty) {
+        own->exclusive = 0;
+    }
+}
+
+static void replayStore(coherenceType *coh, coreCoherenceType *core, const coherenceEventType *e) {
+    for (int i = 0; i < coh->numCores; ++i) {
+        coreCoherenceType *other = &coh->cores[i];
+        memory_write(other->mem, e->addr, e->value);
+        if (other != core && other->cache != NULL && cacheFindBlock(other->cache, e->addr) != NULL) {
+            cacheInvalidate(other->cache, e->addr);
+            dropSharer(coh, i, e->addr);
+            core->invalidations++;
+        }
+    }
+}
+
+// Replay every core's log since the last sync, with the cores stopped
+void coherence_sync(coherenceType *coh) {
+    int next[MAX_CORES] = {0};
+    for (;;) {
+        coreCoherenceType *first = NULL;
+        for (int i = 0; i < coh->numCores; ++i) {
+            coreCoherenceType *core = &coh->cores[i];
+            if (next[i] < core->numEvents && (first == NULL
+                    || core->events[next[i]].cycle < first->events[next[first->id]].cycle)) {
+                first = core;
+            }
+        }
+        if (first == NULL) {
+            break;
+        }
+        const coherenceEventType *e = &first->events[next[first->id]++];
+        if (e->kind == COHERENCE_STORE) {
+            replayStore(coh, first, e);
+        }
+        else {
+            replayRequest(coh, first, e);
+        }
+    }
+    for (int i = 0; i < coh->numCores; ++i) {
+        coh->cores[i].numEvents = 0;
+    }
+}
+
+void coherence_free(coherenceType *coh) {
+    for (int i = 0; i < coh->numCores; ++i) {
+        free(coh->cores[i].events);
+        coh->cores[i].events = NULL;
+    }
+}
@@ -0,0 +1,81 @@
+#ifndef COHERENCE_H
+#define COHERENCE_H
+
+#include "cache.h"
+#include "memory.h"
+
+/*
+ * Cache coherence between the cores of a multicore run, each with its own
+ * pipeline, data cache and copy of data memory, over a shared inclusive
+ * cache level that also serves as the directory (see cache.h).
+ *
+ * The cores run in parallel for a quantum of cycles at a time. Within a
+ * quantum a core touches nothing but its own state: its cache's requests
+ * are answered from the shared level as it stood at the start of the
+ * quantum (the latency, and under MESI whether a read may be held
+ * exclusive) without changing it, and are logged, as is every store the
+ * core makes. coherence_sync(), run with every core stopped, replays the
+ * logs in cycle order, lower core first within a cycle:
+ *  - reads and read-exclusives fill the shared level, upgrades find it
+ *  - a read downgrades the other copies to shared, taking modified data
+ *    down into the shared level (an intervention); a read-exclusive or an
+ *    upgrade invalidates them
+ *  - evictions and writebacks update the directory and the shared level
+ *  - a store is applied to every core's memory, and invalidates any copy
+ *    another core still holds, so no cache ever holds a word that differs
+ *    from its core's memory
+ * So a store becomes visible to the other cores at the end of its
+ * quantum, and with a quantum of one cycle in the very next cycle. The
+ * outcome depends only on the quantum, never on how the host threads ran.
+ */
+enum coherenceProtocol
+{
+    COHERENCE_MSI,
+    COHERENCE_MESI
+};
+
+#define MAX_CORES 16
+
+// One logged request or store; kind is an enum busRequest or COHERENCE_STORE
+typedef struct coherenceEventStruct {
+    int cycle;
+    int kind;
+    int addr;
+    int value; // stores only
+} coherenceEventType;
+
+#define COHERENCE_STORE (BUS_WRITEBACK + 1)
+
+typedef struct coreCoherenceStruct {
+    struct coherenceStruct *coh;
+    int id;
+    cacheStruct *cache; // its data cache, or NULL
+    memoryType *mem; // its copy of data memory
+    coherenceEventType *events; // since the last sync, oldest first
+    int numEvents;
+    int maxEvents;
+    long long reads; // bus requests its cache made, by kind
+    long long readExclusives;
+    long long upgrades;
+    long long writebacks;
+    long long invalidations; // other cores' copies its requests and stores invalidated
+    long long interventions; // modified copies of other cores its requests had written down
+} coreCoherenceType;
+
+typedef struct coherenceStruct {
+    int protocol; // enum coherenceProtocol
+    int numCores;
+    cacheStruct *shared; // the level under the cores' caches, NULL without caches
+    coreCoherenceType cores[MAX_CORES];
+    int scratch[MAX_BLOCK_SIZE]; // blocks read into the shared level land here
+} coherenceType;
+
+int coherence_parse_protocol(const char *name);
+const char *coherence_protocol_name(int protocol);
+void coherence_init(coherenceType *coh, int protocol, int numCores, cacheStruct *shared);
+void coherence_attach(coherenceType *coh, int core, cacheStruct *cache, memoryType *mem);
+void coherence_store(coherenceType *coh, int core, int cycle, int addr, int value);
+void coherence_sync(coherenceType *coh);
+void coherence_free(coherenceType *coh);
+
+#endif
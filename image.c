@@ -0,0 +1,109 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "image.h"
+
+static void tooLarge(const char *filename, int maxWords) {
+    printf("error: %s has more than %d words\n", filename, maxWords);
+    exit(1);
+}
+
+static int loadBinary(const char *filename, const int *map, size_t size, int *words, int maxWords) {
+    if (size < 3 * sizeof(int) || map[1] != IMAGE_VERSION) {
+        printf("error: %s is not a version %d program image\n", filename, IMAGE_VERSION);
+        exit(1);
+    }
+    int numWords = map[2];
+    if (numWords < 0 || (size - 3 * sizeof(int)) / sizeof(int) != (size_t)numWords) {
+        printf("error: %s is truncated\n", filename);
+        exit(1);
+    }
+    if (numWords > maxWords) {
+        tooLarge(filename, maxWords);
+    }
+    memcpy(words, map + 3, numWords * sizeof(int));
+    return numWords;
+}
+
+/*
+ * One decimal word per line, read the way sscanf("%d") would: leading
+ * blanks, an optional sign and at least one digit; anything after the
+ * digits is ignored.
+ */
+static int loadText(const char *filename, const char *text, size_t size, int *words, int maxWords) {
+    const char *end = text + size;
+    int numWords = 0;
+    for (const char *p = text; p < end; ++numWords) {
+        while (p < end && *p != '\n' && (*p == ' ' || (*p >= '\t' && *p <= '\r'))) {
+            p++;
+        }
+        int negative = p < end && *p == '-';
+        if (p < end && (*p == '-' || *p == '+')) {
+            p++;
+        }
+        if (p == end || *p < '0' || *p > '9') {
+            printf("error in reading address %d\n", numWords);
+            exit(1);
+        }
+        unsigned int value = 0;
+        while (p < end && *p >= '0' && *p <= '9') {
+            value = value * 10 + (*p++ - '0');
+        }
+        if (numWords == maxWords) {
+            tooLarge(filename, maxWords);
+        }
+        words[numWords] = negative ? -value : value;
+        const char *eol = memchr(p, '\n', end - p);
+        p = eol != NULL ? eol + 1 : end;
+    }
+    return numWords;
+}
+
+int image_load(const char *filename, int *words, int maxWords) {
+    int fd = open(filename, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        printf("error: can't open file %s\n", filename);
+        exit(1);
+    }
+    size_t size = st.st_size;
+    if (size == 0) {
+        close(fd);
+        return 0;
+    }
+    const void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        printf("error: can't map file %s\n", filename);
+        exit(1);
+    }
+    close(fd);
+
+    int numWords;
+    if (size >= sizeof(int) && *(const int *)map == IMAGE_MAGIC) {
+        numWords = loadBinary(filename, map, size, words, maxWords);
+    }
+    else {
+        numWords = loadText(filename, map, size, words, maxWords);
+    }
+    munmap((void *)map, size);
+    return numWords;
+}
+
+void image_write(const char *filename, const int *words, int numWords) {
+    FILE *out = fopen(filename, "wb");
+    if (out == NULL) {
+        printf("error: can't open file %s\n", filename);
+        exit(1);
+    }
+    int header[3] = {IMAGE_MAGIC, IMAGE_VERSION, numWords};
+    if (fwrite(header, sizeof(int), 3, out) != 3
+            || fwrite(words, sizeof(int), numWords, out) != (size_t)numWords || fclose(out) != 0) {
+        printf("error: can't write file %s\n", filename);
+        exit(1);
+    }
+}
@@ -0,0 +1,23 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+
+/*
+ * Program images: the machine code the simulator loads into instruction
+ * memory, either as assembler output (one decimal word per line) or as a
+ * binary image made from it by mkimage.
+ *
+ * A binary image is IMAGE_MAGIC, IMAGE_VERSION and the word count, then
+ * that many words, all native ints. It is mapped and copied in one go
+ * instead of being parsed.
+ */
+#define IMAGE_MAGIC 0x494b434c // "LCKI"
+#define IMAGE_VERSION 1
+
+/*
+ * Load filename, in either format, into words[0..maxWords-1] and return
+ * the number of words. A program longer than maxWords is an error.
+ */
+int image_load(const char *filename, int *words, int maxWords);
+void image_write(const char *filename, const int *words, int numWords);
+
+#endif
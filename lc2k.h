@@ -0,0 +1,40 @@
+#ifndef LC2K_H
+#define LC2K_H
+
+// Machine Definitions
+#define NUMMEMORY 65536 // maximum number of data words in memory
+#define NUMREGS 8 // number of machine registers
+
+#define ADD 0
+#define NOR 1
+#define LW 2
+#define SW 3
+#define BEQ 4
+#define JALR 5 // will not implemented for Project 3
+#define HALT 6
+#define NOOP 7
+
+#define NOOPINSTRUCTION (NOOP << 22)
+
+static inline int opcode(int instruction) {
+    return instruction>>22;
+}
+
+static inline int field0(int instruction) {
+    return (instruction>>19) & 0x7;
+}
+
+static inline int field1(int instruction) {
+    return (instruction>>16) & 0x7;
+}
+
+static inline int field2(int instruction) {
+    return instruction & 0xFFFF;
+}
+
+// convert a 16-bit number into a 32-bit Linux integer
+static inline int convertNum(int num) {
+    return num - ( (num & (1<<15)) ? 1<<16 : 0 );
+}
+
+#endif
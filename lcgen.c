@@ -0,0 +1,57 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "image.h"
+#include "lc2k.h"
+#include "workload.h"
+
+/*
+ * Generate a synthetic stress program (see workload.h for the patterns).
+ *
+ * build: gcc -O2 -o lcgen lcgen.c workload.c image.c
+ * usage: lcgen [--text] <kind[,key=value...]> <output file>
+ *
+ * e.g. lcgen loaduse,iterations=100000,length=32 loaduse.img
+ *      lcgen random,footprint=8192,seed=7 random.img
+ *
+ * The output is a binary program image, or assembler style machine code,
+ * one decimal word per line, with --text.
+ */
+int main(int argc, char *argv[]) {
+    int text = argc == 4 && !strcmp(argv[1], "--text");
+    if (argc != 3 + text) {
+        printf("error: usage: %s [--text] <kind[,key=value...]> <output file>\n", argv[0]);
+        exit(1);
+    }
+    workloadType w;
+    if (workload_parse(argv[1 + text], &w) < 0) {
+        exit(1);
+    }
+    int *words = malloc(NUMMEMORY * sizeof(int));
+    if (words == NULL) {
+        printf("error: out of memory\n");
+        exit(1);
+    }
+    int numWords = workload_generate(&w, words, NUMMEMORY);
+    const char *filename = argv[2 + text];
+    if (!text) {
+        image_write(filename, words, numWords);
+    }
+    else {
+        FILE *out = fopen(filename, "w");
+        if (out == NULL) {
+            printf("error: can't open file %s\n", filename);
+            exit(1);
+        }
+        for (int i = 0; i < numWords; ++i) {
+            fprintf(out, "%d\n", words[i]);
+        }
+        if (fclose(out) != 0) {
+            printf("error: can't write file %s\n", filename);
+            exit(1);
+        }
+    }
+    free(words);
+    return 0;
+}
@@ -0,0 +1,158 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "checkpoint.h"
+#include "memory.h"
+
+// Never written: writes to it allocate a page of their own first
+int memZeroPage[MEM_PAGE_SIZE];
+static memTableType emptyTable = {{[0 ... MEM_TABLE_SIZE - 1] = memZeroPage}, {0}};
+
+static void *allocOrDie(size_t size) {
+    void *p = calloc(1, size);
+    if (p == NULL) {
+        printf("error: out of memory\n");
+        exit(1);
+    }
+    return p;
+}
+
+void memory_init(memoryType *m, int addrBits) {
+    if (addrBits < MEM_MIN_ADDR_BITS || addrBits > MEM_MAX_ADDR_BITS) {
+        printf("error: address bits must be %d to %d\n", MEM_MIN_ADDR_BITS, MEM_MAX_ADDR_BITS);
+        exit(1);
+    }
+    m->addrBits = addrBits;
+    m->addrMask = (int)((1u << addrBits) - 1);
+    m->numTables = addrBits > MEM_TABLE_SHIFT ? 1 << (addrBits - MEM_TABLE_SHIFT) : 1;
+    m->tables = allocOrDie(m->numTables * sizeof(memTableType *));
+    for (int i = 0; i < m->numTables; ++i) {
+        m->tables[i] = &emptyTable;
+    }
+    m->pagesInUse = 0;
+}
+
+void memory_free(memoryType *m) {
+    for (int i = 0; i < m->numTables; ++i) {
+        memTableType *table = m->tables[i];
+        if (table == &emptyTable) {
+            continue;
+        }
+        for (int j = 0; j < MEM_TABLE_SIZE; ++j) {
+            if (table->pages[j] != memZeroPage) {
+                free(table->pages[j]);
+            }
+        }
+        free(table);
+    }
+    free(m->tables);
+    m->tables = NULL;
+}
+
+// Give page (still reading as zero) memory of its own
+int *memory_alloc_page(memoryType *m, int page) {
+    memTableType **table = &m->tables[page >> MEM_TABLE_BITS];
+    if (*table == &emptyTable) {
+        *table = allocOrDie(sizeof(memTableType));
+        for (int j = 0; j < MEM_TABLE_SIZE; ++j) {
+            (*table)->pages[j] = memZeroPage;
+        }
+    }
+    int *words = allocOrDie(MEM_PAGE_SIZE * sizeof(int));
+    (*table)->pages[page & MEM_TABLE_MASK] = words;
+    m->pagesInUse++;
+    return words;
+}
+
+// Copy words to addresses 0..numWords-1, a page at a time
+void memory_load(memoryType *m, const int *words, int numWords) {
+    for (int addr = 0; addr < numWords; addr += MEM_PAGE_SIZE) {
+        int count = numWords - addr < MEM_PAGE_SIZE ? numWords - addr : MEM_PAGE_SIZE;
+        memory_write(m, addr, words[addr]); // allocates the page, marks it dirty
+        int page = addr >> MEM_PAGE_BITS;
+        memTableType *table = m->tables[page >> MEM_TABLE_BITS];
+        memcpy(table->pages[page & MEM_TABLE_MASK], words + addr, count * sizeof(int));
+    }
+}
+
+// Copy numWords words starting at addr out of memory, a page at a time
+void memory_read_range(const memoryType *m, int addr, int *words, int numWords) {
+    while (numWords > 0) {
+        addr &= m->addrMask;
+        int offset = addr & MEM_PAGE_MASK;
+        int count = MEM_PAGE_SIZE - offset < numWords ? MEM_PAGE_SIZE - offset : numWords;
+        memcpy(words, memory_page(m, addr >> MEM_PAGE_BITS) + offset, count * sizeof(int));
+        words += count;
+        addr += count;
+        numWords -= count;
+    }
+}
+
+void memory_clean(memoryType *m) {
+    for (int i = 0; i < m->numTables; ++i) {
+        if (m->tables[i] != &emptyTable) {
+            memset(m->tables[i]->dirty, 0, sizeof(m->tables[i]->dirty));
+        }
+    }
+}
+
+// The first dirty page numbered page or higher, or -1 if there is none
+int memory_next_dirty(const memoryType *m, int page) {
+    int numPages = m->numTables << MEM_TABLE_BITS;
+    if (m->addrBits < MEM_TABLE_SHIFT) {
+        numPages = 1 << (m->addrBits - MEM_PAGE_BITS);
+    }
+    while (page < numPages) {
+        const memTableType *table = m->tables[page >> MEM_TABLE_BITS];
+        if (table == &emptyTable) {
+            page = ((page >> MEM_TABLE_BITS) + 1) << MEM_TABLE_BITS;
+            continue;
+        }
+        if (table->dirty[page & MEM_TABLE_MASK]) {
+            return page;
+        }
+        page++;
+    }
+    return -1;
+}
+
+/*
+ * Write the dirty pages. Memory starts out as the program image and is
+ * cleaned after loading it, so those are all a checkpoint needs.
+ */
+void memory_save(const memoryType *m, FILE *out) {
+    int numDirty = 0;
+    for (int page = memory_next_dirty(m, 0); page >= 0; page = memory_next_dirty(m, page + 1)) {
+        numDirty++;
+    }
+    ckpt_write_int(out, CKPT_SECTION_MEMORY);
+    ckpt_write_int(out, m->addrBits);
+    ckpt_write_int(out, numDirty);
+    for (int page = memory_next_dirty(m, 0); page >= 0; page = memory_next_dirty(m, page + 1)) {
+        ckpt_write_int(out, page);
+        ckpt_write(out, memory_page(m, page), MEM_PAGE_SIZE * sizeof(int));
+    }
+}
+
+// Put the pages memory_save wrote back over the program image, still dirty
+void memory_restore(memoryType *m, FILE *in) {
+    ckpt_expect(in, CKPT_SECTION_MEMORY, "section");
+    ckpt_expect(in, m->addrBits, "address bits");
+    int numDirty = ckpt_read_int(in);
+    for (int i = 0; i < numDirty; ++i) {
+        int page = ckpt_read_int(in);
+        if (page < 0 || page > (m->addrMask >> MEM_PAGE_BITS)) {
+            printf("error: checkpoint page %d out of range\n", page);
+            exit(1);
+        }
+        memTableType *table = m->tables[page >> MEM_TABLE_BITS];
+        int *words = table->pages[page & MEM_TABLE_MASK];
+        if (words == memZeroPage) {
+            words = memory_alloc_page(m, page);
+            table = m->tables[page >> MEM_TABLE_BITS];
+        }
+        ckpt_read(in, words, MEM_PAGE_SIZE * sizeof(int));
+        table->dirty[page & MEM_TABLE_MASK] = 1;
+    }
+}
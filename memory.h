@@ -0,0 +1,80 @@
+#ifndef MEMORY_H
+#define MEMORY_H
+
+#include <stdio.h>
+
+/*
+ * Sparse, paged data memory. The address space is 2^addrBits words, split
+ * into pages of MEM_PAGE_SIZE words that are only allocated the first time
+ * something is written to them; until then they read as zero. Addresses
+ * wrap around the address space, the way a machine with that many address
+ * lines would see them.
+ *
+ * The page table has two levels, each a power of two, so a lookup is two
+ * shifts and masks. Ranges never written to point at a shared, all-zero
+ * table and page, which keeps reads branch free and lets any number of
+ * instances share them.
+ *
+ * Every write marks its page dirty. memory_clean() clears the marks, so
+ * dumps and checkpoints can visit just the pages written since.
+ */
+#define MEM_PAGE_BITS 10
+#define MEM_PAGE_SIZE (1 << MEM_PAGE_BITS)
+#define MEM_PAGE_MASK (MEM_PAGE_SIZE - 1)
+#define MEM_TABLE_BITS 10 // pages per second level table, as a power of two
+#define MEM_TABLE_SIZE (1 << MEM_TABLE_BITS)
+#define MEM_TABLE_MASK (MEM_TABLE_SIZE - 1)
+#define MEM_TABLE_SHIFT (MEM_PAGE_BITS + MEM_TABLE_BITS)
+
+#define MEM_MIN_ADDR_BITS 16
+#define MEM_MAX_ADDR_BITS 30 // what fits in an address trace record
+
+typedef struct memTableStruct {
+    int *pages[MEM_TABLE_SIZE];
+    unsigned char dirty[MEM_TABLE_SIZE]; // written since memory_clean()
+} memTableType;
+
+typedef struct memoryStruct {
+    memTableType **tables;
+    int numTables;
+    int addrBits;
+    int addrMask;
+    int pagesInUse; // pages allocated, i.e. ever written
+} memoryType;
+
+extern int memZeroPage[MEM_PAGE_SIZE];
+
+void memory_init(memoryType *m, int addrBits);
+void memory_free(memoryType *m);
+int *memory_alloc_page(memoryType *m, int page);
+void memory_load(memoryType *m, const int *words, int numWords);
+void memory_read_range(const memoryType *m, int addr, int *words, int numWords);
+void memory_clean(memoryType *m);
+int memory_next_dirty(const memoryType *m, int page);
+void memory_save(const memoryType *m, FILE *out);
+void memory_restore(memoryType *m, FILE *in);
+
+// The page holding word page * MEM_PAGE_SIZE, memZeroPage if never written
+static inline const int *memory_page(const memoryType *m, int page) {
+    return m->tables[page >> MEM_TABLE_BITS]->pages[page & MEM_TABLE_MASK];
+}
+
+static inline int memory_read(const memoryType *m, int addr) {
+    addr &= m->addrMask;
+    return memory_page(m, addr >> MEM_PAGE_BITS)[addr & MEM_PAGE_MASK];
+}
+
+static inline void memory_write(memoryType *m, int addr, int value) {
+    addr &= m->addrMask;
+    int page = addr >> MEM_PAGE_BITS;
+    memTableType *table = m->tables[page >> MEM_TABLE_BITS];
+    int *words = table->pages[page & MEM_TABLE_MASK];
+    if (words == memZeroPage) {
+        words = memory_alloc_page(m, page);
+        table = m->tables[page >> MEM_TABLE_BITS];
+    }
+    words[addr & MEM_PAGE_MASK] = value;
+    table->dirty[page & MEM_TABLE_MASK] = 1;
+}
+
+#endif
@@ -0,0 +1,28 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "image.h"
+#include "lc2k.h"
+
+/*
+ * Turn assembler output (one decimal word per line) into a binary program
+ * image, which the simulator maps and loads without parsing.
+ *
+ * build: gcc -O2 -o mkimage mkimage.c image.c
+ * usage: mkimage <machine-code file> <image file>
+ */
+int main(int argc, char *argv[]) {
+    if (argc != 3) {
+        printf("error: usage: %s <machine-code file> <image file>\n", argv[0]);
+        exit(1);
+    }
+    int *words = malloc(NUMMEMORY * sizeof(int));
+    if (words == NULL) {
+        printf("error: out of memory\n");
+        exit(1);
+    }
+    int numWords = image_load(argv[1], words, NUMMEMORY);
+    image_write(argv[2], words, numWords);
+    free(words);
+    return 0;
+}
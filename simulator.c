@@ -1,65 +1,208 @@
 
+/*
+ * Five stage pipelined LC-2K simulator.
+ *
+ * build: gcc -O2 -o simulator simulator.c trace.c stats.c bpred.c cache.c batch.c image.c memory.c checkpoint.c coherence.c -lpthread
+ * usage: simulator [--trace off|final|diff|full] [--trace-binary <file>]
+ *                  [--addr-trace <file>] [--fast-forward <n>]
+ *                  [--stats <file>] [--stats-interval <n>] [--profile <file>]
+ *                  [--predictor <kind>] [--bp-entries <n>] [--bp-history <bits>]
+ *                  [--icache <b,s,a>] [--dcache <b,s,a>]
+ *                  [--icache-latency <hit,miss>] [--dcache-latency <hit,miss>]
+ *                  [--cache-policy <policy>]
+ *                  [--icache-prefetch <p>] [--dcache-prefetch <p>]
+ *                  [--mshrs <n>] [--write-buffer <n>] [--write-through]
+ *                  [--no-write-allocate] [--victim-cache <n>]
+ *                  [--l2 <b,s,a>] [--l3 <b,s,a>]
+ *                  [--l2-latency <hit,miss>] [--l3-latency <hit,miss>]
+ *                  [--inclusion <policy>] [--cores <n>] [--quantum <n>]
+ *                  [--coherence msi|mesi] [--quiet-load]
+ *                  [--addr-bits <n>] [--checkpoint-every <n>]
+ *                  [--checkpoint-at-pc <pc>] [--checkpoint-out <prefix>]
+ *                  [--restore <file>] [--run-cycles <n>] [--debug]
+ *                  <machine-code file>
+ *        simulator --batch <manifest> [--jobs <n>] [--batch-out <file>]
+ *                  [options for every job]
+ *
+ * The machine-code file is either assembler output, one decimal word per
+ * line, or a binary image of it made with mkimage, which loads without
+ * parsing. --quiet-load leaves out the instruction memory listing that the
+ * diff and full trace levels print while loading.
+ *
+ * Data memory is paged and only takes up host memory for the pages the
+ * program writes. --addr-bits widens its address space from the default
+ * 2^16 words to up to 2^30; lw/sw addresses wrap around it. Instruction
+ * memory stays NUMMEMORY words.
+ *
+ * --checkpoint-every and --checkpoint-at-pc save the whole simulator, from
+ * the pipeline latches to the memory pages and the cache and predictor
+ * contents, to <prefix>.<cycle>.ckpt before every n-th cycle or before
+ * the first cycle that fetches from pc. The prefix defaults to the
+ * machine-code file name. --restore picks such a run back up in a
+ * simulator started with the same program and options, and it goes on
+ * exactly as the original did. --run-cycles stops after n cycles, for
+ * running sample windows from checkpoints.
+ *
+ * --debug steps the machine interactively, with commands read from stdin
+ * (type help for the list): step and continue, breakpoints on pc or cycle,
+ * watchpoints on reg[] and dataMem, and reverse-step and goto, which rewind
+ * to the nearest in-memory snapshot and simulate forward from it. Tracing
+ * is off unless --trace says otherwise.
+ *
+ * --addr-trace records every instruction fetch and lw/sw address the
+ * pipeline makes, for replay through cachesim.
+ *
+ * --fast-forward runs the first n instructions on the functional
+ * interpreter and only then starts the cycle accurate pipeline, so the
+ * cycle count and trace cover the detailed part of the run only. The
+ * interpreter runs each basic block as threaded code translated the first
+ * time it is reached.
+ *
+ * --stats writes the performance counters at halt, and every n cycles with
+ * --stats-interval. --profile writes the per-PC stall and flush counts.
+ * Both are JSON, or CSV if the file name ends in .csv.
+ *
+ * --predictor picks the IF stage branch predictor: nottaken (the default,
+ * and the original behavior), btfn, bimodal, gshare or btb. A beq whose
+ * prediction turns out wrong is flushed when it resolves in MEM, exactly
+ * like a taken beq without prediction.
+ *
+ * --icache and --dcache put an L1 cache (block size, sets, blocks per set)
+ * in front of instruction fetch and of lw/sw. Accesses take the hit or miss
+ * latency in cycles (default 1 and 10). An instruction cache miss sends
+ * bubbles down from IF. A data cache miss holds IF through MEM. Once a
+ * stall has left the pipeline idle, the rest of it is skipped in one step
+ * (counters included) unless every cycle is traced or debugged.
+ * --cache-policy picks how both replace blocks: lru (the default), plru,
+ * srrip, brrip, fifo or random. --icache-prefetch and --dcache-prefetch
+ * attach a prefetcher, kind[,degree[,distance]] with kind nextline, stride
+ * (indexed by the pc of the fetch or lw/sw) or stream, to a cache; its
+ * prefetches take the cache's miss latency to arrive.
+ *
+ * --mshrs lets both caches have up to n misses (and prefetches) on their
+ * way at once instead of blocking: a store miss then doesn't hold up the
+ * pipeline, and a load of a block still on its way waits only for the rest
+ * of it. The data cache is write-back and write-allocate unless
+ * --write-through or --no-write-allocate say otherwise. --write-buffer
+ * gives it a coalescing buffer of n blocks for the writes to memory.
+ * These print the memory traffic with the cache summary. --victim-cache
+ * puts a fully associative victim cache of n blocks beside both caches,
+ * which catches what they evict and hands it back on a later miss.
+ *
+ * --l2 puts a second level cache under the data cache, and --l3 a third
+ * under that (see cache.h for how the levels work together). The data
+ * cache's miss latency then only times its write buffer: a miss takes the
+ * L2 hit latency (default 4), or if the L2 misses too, its miss latency
+ * (default 20), or what the L3 takes (default 10 and 40). --inclusion
+ * picks inclusive (the default), exclusive or nine (neither) levels. The
+ * levels use --cache-policy too, and each prints a summary line.
+ *
+ * --cores runs the program on n cores (up to 16), each a pipeline with
+ * its own caches and predictor, core i starting with i in reg 7. The
+ * cores' data caches share the L2, which --l2 must give them and which
+ * keeps track of who holds what, and are kept coherent with --coherence
+ * msi or mesi (the default); see coherence.h. Each core runs on a host
+ * thread of its own, and the threads sync every --quantum cycles
+ * (default 100): that is when the cores see each other's stores, so a
+ * smaller quantum is more faithful and a larger one faster, but the
+ * results never depend on how the threads happened to run. The run ends
+ * once every core has halted. Its trace goes up to the final level: each
+ * core's summaries, with its coherence traffic, then the shared levels'
+ * and each core's final state. --stats gets one record per core. Tracing
+ * cycles, checkpoints, --fast-forward, --debug and --batch all stay
+ * single core.
+ *
+ * --batch runs one simulation per line of the manifest, each line being
+ * options and a machine-code file as above ('#' starts a comment line).
+ * Options on the command line apply to every job. Jobs run on --jobs
+ * threads (default: one per core), each with its own simulator instance;
+ * every distinct program is loaded once and shared. One stats record per
+ * job, tagged with its manifest line, goes to --batch-out (JSON, or CSV
+ * for a .csv name; stdout if not given) in manifest order. Jobs can't
+ * trace or write stats files or checkpoints of their own, but can
+ * --restore one, so sample windows can run in parallel.
+ */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-// Machine Definitions
-#define NUMMEMORY 65536 // maximum number of data words in memory
-#define NUMREGS 8 // number of machine registers
+#include "batch.h"
+#include "bpred.h"
+#include "cache.h"
+#include "checkpoint.h"
+#include "coherence.h"
+#include "image.h"
+#include "lc2k.h"
+#include "memory.h"
+#include "stats.h"
+#include "trace.h"
 
-#define ADD 0
-#define NOR 1
-#define LW 2
-#define SW 3
-#define BEQ 4
-#define JALR 5 // will not implemented for Project 3
-#define HALT 6
-#define NOOP 7
+// Predecoded instruction store, one entry per instruction address, laid out
+// as a struct of arrays. The pipeline latches carry an index into it instead
+// of the raw instruction word. The extra entry at NOOPINDEX is the noop that
+// stalls and squashes insert.
+#define NOOPINDEX NUMMEMORY
 
-#define NOOPINSTRUCTION (NOOP << 22)
+#define MAXLINELENGTH 1000 // MAXLINELENGTH is the max number of characters we read
+
+typedef struct decodeStruct {
+	int word[NUMMEMORY + 1]; // raw instruction word
+	int opcode[NUMMEMORY + 1];
+	signed char regA[NUMMEMORY + 1];
+	signed char regB[NUMMEMORY + 1];
+	signed char dest[NUMMEMORY + 1]; // register written, or -1 if none
+	int offset[NUMMEMORY + 1]; // sign-extended offsetField
+	char writesReg[NUMMEMORY + 1];
+} decodeType;
 
 typedef struct IFIDStruct {
-	int instr;
+	int instrIdx; // index into the predecoded instruction store
 	int pcPlus1;
+	int predictedTaken; // IF redirected fetch to the beq's target
 } IFIDType;
 
 typedef struct IDEXStruct {
-	int instr;
+	int instrIdx;
 	int pcPlus1;
 	int readRegA;
 	int readRegB;
 	int offset;
     int opcode;
     int dest;
+    int predictedTaken;
 } IDEXType;
 
 typedef struct EXMEMStruct {
-	int instr;
+	int instrIdx;
 	int branchTarget;
     int eq;
 	int aluResult;
 	int readRegB;
     int opcode;
     int dest;
+    int predictedTaken;
 } EXMEMType;
 
 typedef struct MEMWBStruct {
-	int instr;
+	int instrIdx;
 	int writeData;
     int opcode;
     int dest;
 } MEMWBType;
 
 typedef struct WBENDStruct {
-	int instr;
+	int instrIdx;
 	int writeData;
     int dest;
 } WBENDType;
 
+// Only the latches, pc and registers are double buffered; both buffers share
+// the same instruction and data memory, which is updated in place.
 typedef struct stateStruct {
 	int pc;
-	int instrMem[NUMMEMORY];
-	int dataMem[NUMMEMORY];
+	int *instrMem;
+	memoryType *dataMem;
+	decodeType *decoded;
 	int reg[NUMREGS];
 	int numMemory;
 	IFIDType IFID;
@@ -70,364 +213,2338 @@ typedef struct stateStruct {
 	int cycles; // number of cycles run so far
 } stateType;
 
-static inline int opcode(int instruction) {
-    return instruction>>22;
+// A store performed in MEM is held here and committed at the end of the
+// cycle, so memory changes at the same point the latches do.
+typedef struct memWriteStruct {
+	int valid;
+	int addr;
+	int data;
+} memWriteType;
+
+// A loaded program. It is only read while simulating, so batch jobs
+// running the same file share one.
+typedef struct programStruct {
+	char *filename;
+	int *instrMem;
+	decodeType *decoded;
+	int numMemory;
+} programType;
+
+// Fill in the decoded entry for one instruction word
+static void decodeInstruction(decodeType *dec, int idx, int instr) {
+    int op = opcode(instr);
+    dec->word[idx] = instr;
+    dec->opcode[idx] = op;
+    dec->regA[idx] = field0(instr);
+    dec->regB[idx] = field1(instr);
+    dec->offset[idx] = convertNum(field2(instr));
+    dec->writesReg[idx] = (op == ADD || op == NOR || op == LW);
+    if (op == ADD || op == NOR) {
+        dec->dest[idx] = field2(instr) & 0b111;
+    }
+    else if (op == LW) {
+        dec->dest[idx] = field1(instr);
+    }
+    else {
+        dec->dest[idx] = -1;
+    }
+}
+
+// Put a bubble in every pipeline register
+static void resetPipeline(stateType *state) {
+    state->IFID.instrIdx = NOOPINDEX;
+    state->IDEX.instrIdx = NOOPINDEX;
+    state->IDEX.opcode = NOOP;
+    state->IDEX.dest = -1;
+    state->EXMEM.instrIdx = NOOPINDEX;
+    state->EXMEM.opcode = NOOP;
+    state->EXMEM.dest = -1;
+    state->MEMWB.instrIdx = NOOPINDEX;
+    state->MEMWB.opcode = NOOP;
+    state->MEMWB.dest = -1;
+    state->WBEND.instrIdx = NOOPINDEX;
+    state->WBEND.dest = -1;
+}
+
+/*
+ * Functional (ISA level) interpreter, one instruction at a time. Executes
+ * up to count instructions starting at state->pc, updating pc, reg[] and
+ * dataMem only, and stops in front of a halt so the pipeline can retire
+ * it. Returns the number of instructions executed.
+ */
+static long long stepFunctional(stateType *state, long long count) {
+    decodeType *dec = state->decoded;
+    int *reg = state->reg;
+    memoryType *dataMem = state->dataMem;
+    int pc = state->pc;
+    long long executed = 0;
+
+    for (; executed < count; ++executed) {
+        switch (dec->opcode[pc]) {
+            case ADD:
+                reg[dec->dest[pc]] = reg[dec->regA[pc]] + reg[dec->regB[pc]];
+                break;
+            case NOR:
+                reg[dec->dest[pc]] = ~(reg[dec->regA[pc]] | reg[dec->regB[pc]]);
+                break;
+            case LW:
+                reg[dec->regB[pc]] = memory_read(dataMem, reg[dec->regA[pc]] + dec->offset[pc]);
+                break;
+            case SW:
+                memory_write(dataMem, reg[dec->regA[pc]] + dec->offset[pc], reg[dec->regB[pc]]);
+                break;
+            case BEQ:
+                if (reg[dec->regA[pc]] == reg[dec->regB[pc]]) {
+                    pc += dec->offset[pc];
+                }
+                break;
+            case HALT:
+                state->pc = pc;
+                return executed;
+            default: // noop, and words the pipeline also ignores
+                break;
+        }
+        ++pc;
+    }
+    state->pc = pc;
+    return executed;
+}
+
+/*
+ * Threaded code for the functional interpreter. The straight-line run of
+ * instructions from a pc up to and including the next beq or halt is
+ * translated the first time execution enters it, into ops whose register
+ * operands are already resolved to pointers, and each op jumps straight to
+ * the handler of the next (computed goto where the compiler has it). A
+ * block entered in the middle is translated again from there. Stores go
+ * to dataMem, never to the instruction store, so a translation stays good
+ * for the whole run.
+ */
+#define MAX_BLOCK_INSTRS 64 // a longer run is split, falling through to the next block
+
+enum threadedKind {OP_ADD, OP_NOR, OP_LW, OP_SW, OP_BEQ, OP_HALT, OP_NEXT};
+
+typedef struct threadedOpStruct {
+    const void *handler;
+    int kind; // enum threadedKind
+    int *a; // reg[regA]
+    int *b; // reg[regB]
+    int *dest; // reg[destReg] for add and nor
+    int imm; // lw/sw offset, or where a taken beq goes
+    int next; // the pc after a beq or a block cut short; a halt's own pc
+} threadedOpType;
+
+typedef struct translationStruct {
+    int *start; // per pc, 1 + the index of its block's first op, 0 if none yet
+    int *length; // per pc, the instructions its block retires, a halt not counted
+    threadedOpType *ops;
+    int numOps;
+    int maxOps;
+} translationType;
+
+static threadedOpType *emitOp(translationType *t, int kind, int *a, int *b) {
+    if (t->numOps == t->maxOps) {
+        t->maxOps = t->maxOps ? 2 * t->maxOps : 1024;
+        t->ops = realloc(t->ops, t->maxOps * sizeof(threadedOpType));
+        if (t->ops == NULL) {
+            printf("error: out of memory\n");
+            exit(1);
+        }
+    }
+    threadedOpType *op = &t->ops[t->numOps++];
+    op->kind = kind;
+    op->a = a;
+    op->b = b;
+    return op;
+}
+
+// Translate the block starting at pc; noops and jalr retire without an op
+static void translateBlock(translationType *t, const decodeType *dec, int *reg, int pc) {
+    int first = t->numOps;
+    int length = 0;
+    int i = pc;
+    for (; i < NUMMEMORY && length < MAX_BLOCK_INSTRS; ++i) {
+        threadedOpType *op;
+        switch (dec->opcode[i]) {
+            case ADD:
+            case NOR:
+                op = emitOp(t, dec->opcode[i] == ADD ? OP_ADD : OP_NOR, &reg[dec->regA[i]], &reg[dec->regB[i]]);
+                op->dest = &reg[dec->dest[i]];
+                break;
+            case LW:
+            case SW:
+                op = emitOp(t, dec->opcode[i] == LW ? OP_LW : OP_SW, &reg[dec->regA[i]], &reg[dec->regB[i]]);
+                op->imm = dec->offset[i];
+                break;
+            case BEQ:
+                op = emitOp(t, OP_BEQ, &reg[dec->regA[i]], &reg[dec->regB[i]]);
+                op->imm = i + 1 + dec->offset[i];
+                op->next = i + 1;
+                t->start[pc] = first + 1;
+                t->length[pc] = length + 1;
+                return;
+            case HALT:
+                emitOp(t, OP_HALT, NULL, NULL)->next = i;
+                t->start[pc] = first + 1;
+                t->length[pc] = length;
+                return;
+            default:
+                break;
+        }
+        ++length;
+    }
+    emitOp(t, OP_NEXT, NULL, NULL)->next = i;
+    t->start[pc] = first + 1;
+    t->length[pc] = length;
+}
+
+#ifdef __GNUC__
+#define DISPATCH(op) goto *(op)->handler
+#else
+#define DISPATCH(op) \
+    switch ((op)->kind) { \
+        case OP_ADD: goto add; \
+        case OP_NOR: goto nor; \
+        case OP_LW: goto lw; \
+        case OP_SW: goto sw; \
+        case OP_BEQ: goto beq; \
+        case OP_HALT: goto halt; \
+        default: goto next; \
+    }
+#endif
+
+/*
+ * Functional (ISA level) interpreter. Executes up to count instructions
+ * starting at state->pc, updating pc, reg[] and dataMem only, and stops
+ * in front of a halt so the pipeline can retire it. Returns the number of
+ * instructions executed. Whole blocks run as threaded code; the few
+ * instructions left when the next block would overshoot count are stepped.
+ */
+static long long runFunctional(stateType *state, long long count) {
+#ifdef __GNUC__
+    static const void *handlers[] = {&&add, &&nor, &&lw, &&sw, &&beq, &&halt, &&next};
+#endif
+    translationType t = {0};
+    t.start = calloc(NUMMEMORY, sizeof(int));
+    t.length = calloc(NUMMEMORY, sizeof(int));
+    if (t.start == NULL || t.length == NULL) {
+        printf("error: out of memory\n");
+        exit(1);
+    }
+    memoryType *dataMem = state->dataMem;
+    int pc = state->pc;
+    long long executed = 0;
+    const threadedOpType *op;
+
+    while (pc >= 0 && pc < NUMMEMORY) {
+        if (t.start[pc] == 0) {
+            int first = t.numOps;
+            translateBlock(&t, state->decoded, state->reg, pc);
+#ifdef __GNUC__
+            for (int i = first; i < t.numOps; ++i) {
+                t.ops[i].handler = handlers[t.ops[i].kind];
+            }
+#else
+            (void)first;
+#endif
+        }
+        if (t.length[pc] > count - executed) {
+            break;
+        }
+        executed += t.length[pc];
+        op = &t.ops[t.start[pc] - 1];
+        DISPATCH(op);
+    add:
+        *op->dest = *op->a + *op->b;
+        ++op;
+        DISPATCH(op);
+    nor:
+        *op->dest = ~(*op->a | *op->b);
+        ++op;
+        DISPATCH(op);
+    lw:
+        *op->b = memory_read(dataMem, *op->a + op->imm);
+        ++op;
+        DISPATCH(op);
+    sw:
+        memory_write(dataMem, *op->a + op->imm, *op->b);
+        ++op;
+        DISPATCH(op);
+    beq:
+        pc = *op->a == *op->b ? op->imm : op->next;
+        continue;
+    next:
+        pc = op->next;
+        continue;
+    halt:
+        pc = op->next;
+        count = executed; // nothing more to step
+        break;
+    }
+    free(t.start);
+    free(t.length);
+    free(t.ops);
+    state->pc = pc;
+    return executed + stepFunctional(state, count - executed);
+}
+
+// Memory below the instruction cache, which never writes; ctx is instrMem
+static int instrMemAccess(void *ctx, int addr, int write_flag, int write_data) {
+    (void)write_flag;
+    (void)write_data;
+    return ((int *)ctx)[addr];
+}
+
+// Memory below the data cache; ctx is the instance's memoryType
+static int dataMemAccess(void *ctx, int addr, int write_flag, int write_data) {
+    if (write_flag) {
+        memory_write(ctx, addr, write_data);
+        return 0;
+    }
+    return memory_read(ctx, addr);
+}
+
+// The same two a block at a time, for refills and whole block writebacks
+static void instrMemBlock(void *ctx, int addr, int *words, int n, int write_flag) {
+    (void)write_flag;
+    memcpy(words, (int *)ctx + addr, n * sizeof(int));
 }
 
-static inline int field0(int instruction) {
-    return (instruction>>19) & 0x7;
+static void dataMemBlock(void *ctx, int addr, int *words, int n, int write_flag) {
+    if (!write_flag) {
+        memory_read_range(ctx, addr, words, n);
+        return;
+    }
+    for (int i = 0; i < n; ++i) {
+        memory_write(ctx, addr + i, words[i]);
+    }
+}
+
+/*
+ * cache.c also exports the course's single global cache, which sits on
+ * mem_access(). The simulator only uses caches of its own (see
+ * dataMemAccess), so there is no memory behind that one.
+ */
+int mem_access(int addr, int write_flag, int write_data) {
+    printf("error: mem_access(%d, %d, %d) reached the unused global cache\n", addr, write_flag, write_data);
+    exit(1);
 }
 
-static inline int field1(int instruction) {
-    return (instruction>>16) & 0x7;
+int get_num_mem_accesses() {
+    return 0;
+}
+
+// Parse "blockSize,numSets,blocksPerSet" for --icache / --dcache
+static void parseCacheGeometry(char *arg, int geometry[3]) {
+    if (sscanf(arg, "%d,%d,%d", &geometry[0], &geometry[1], &geometry[2]) != 3) {
+        printf("error: cache geometry must be <blockSize,numSets,blocksPerSet>\n");
+        exit(1);
+    }
 }
 
-static inline int field2(int instruction) {
-    return instruction & 0xFFFF;
+// Parse "hit,miss" for --icache-latency / --dcache-latency
+static void parseLatency(char *arg, int *hit, int *miss) {
+    if (sscanf(arg, "%d,%d", hit, miss) != 2 || *hit < 1 || *miss < 1) {
+        printf("error: cache latency must be <hit,miss>, at least one cycle each\n");
+        exit(1);
+    }
 }
 
-// convert a 16-bit number into a 32-bit Linux integer
-static inline int convertNum(int num) {
-    return num - ( (num & (1<<15)) ? 1<<16 : 0 );
+// Parse "kind[,degree[,distance]]" for --icache-prefetch / --dcache-prefetch
+static void parsePrefetcher(char *arg, int prefetch[3]) {
+    if (cacheParsePrefetcher(arg, &prefetch[0], &prefetch[1], &prefetch[2]) < 0) {
+        printf("error: prefetcher must be none|nextline|stride|stream[,degree[,distance]], degree at most %d for stream\n",
+                MAX_STREAM_DEPTH);
+        exit(1);
+    }
 }
 
+// One line of hit rate and stall summary for a cache, and one for its prefetcher
+static void printCacheSummary(const char *name, cacheStruct *c, long long stallCycles) {
+    char line[256];
+    long long accesses = c->hits + c->misses;
+    snprintf(line, sizeof(line), "%s (%s): %lld accesses, %lld hits, %lld misses, hit rate %.2f%%, %lld evictions, %lld writebacks, %lld stall cycles\n",
+            name, cachePolicyName(c->policy), accesses, c->hits, c->misses,
+            accesses ? 100.0 * c->hits / accesses : 0.0, c->evictions, c->writebacks, stallCycles);
+    trace_puts(line);
+    const prefetcherType *p = &c->prefetch;
+    if (p->kind != PREFETCH_NONE) {
+        // accuracy: prefetches used at all; coverage: misses they removed
+        snprintf(line, sizeof(line), "%s prefetch (%s, degree %d, distance %d): %lld issued, %lld useful, %lld late, %lld polluting, accuracy %.2f%%, coverage %.2f%%\n",
+                name, cachePrefetcherName(p->kind), p->degree, p->distance, p->issued, p->useful,
+                p->late, p->polluting, p->issued ? 100.0 * (p->useful + p->late) / p->issued : 0.0,
+                p->useful + c->misses ? 100.0 * p->useful / (p->useful + c->misses) : 0.0);
+        trace_puts(line);
+    }
+    if (c->victimSize > 0) {
+        // absorbed: the misses it turned into hits, of all it could have
+        snprintf(line, sizeof(line), "%s victim cache (%d blocks): %lld hits, %lld evictions, %.2f%% of misses absorbed\n",
+                name, c->victimSize, c->victimHits, c->victimEvictions,
+                c->victimHits + c->misses ? 100.0 * c->victimHits / (c->victimHits + c->misses) : 0.0);
+        trace_puts(line);
+    }
+    if (c->numMshrs > 0 || c->writeBufferSize > 0 || c->writeThrough || !c->writeAllocate) {
+        snprintf(line, sizeof(line), "%s traffic (%s, %s, %d MSHRs, %d write buffer entries): %lld words read, %lld words written, %lld MSHR merges, %lld MSHR stalls, %lld write buffer merges, %lld write buffer stalls\n",
+                name, c->writeThrough ? "write-through" : "write-back",
+                c->writeAllocate ? "write-allocate" : "no-write-allocate", c->numMshrs,
+                c->writeBufferSize, c->memReads, c->memWrites, c->mshrMerges, c->mshrStalls,
+                c->writeBufferMerges, c->writeBufferStalls);
+        trace_puts(line);
+    }
+}
+
+// One line for a cache level under the data cache
+static void printLevelSummary(const char *name, cacheStruct *c) {
+    char line[256];
+    long long accesses = c->hits + c->misses;
+    snprintf(line, sizeof(line), "%s (%s, %s): %lld accesses, %lld hits, %lld misses, hit rate %.2f%%, %lld evictions, %lld writebacks, %lld back-invalidations\n",
+            name, cachePolicyName(c->policy), cacheInclusionName(c->inclusion), accesses, c->hits,
+            c->misses, accesses ? 100.0 * c->hits / accesses : 0.0, c->evictions, c->writebacks,
+            c->backInvalidations);
+    trace_puts(line);
+}
+
+static void collectCacheStats(statsType *stats, cacheStruct *icache, cacheStruct *dcache,
+        cacheStruct *l2, cacheStruct *l3) {
+    if (icache != NULL) {
+        stats->icacheHits = icache->hits;
+        stats->icacheMisses = icache->misses;
+        stats->icachePrefetches = icache->prefetch.issued;
+        stats->icachePrefetchUseful = icache->prefetch.useful;
+        stats->icachePrefetchLate = icache->prefetch.late;
+        stats->icachePrefetchPolluting = icache->prefetch.polluting;
+        stats->icacheVictimHits = icache->victimHits;
+        stats->icacheVictimEvictions = icache->victimEvictions;
+    }
+    if (dcache != NULL) {
+        stats->dcacheHits = dcache->hits;
+        stats->dcacheMisses = dcache->misses;
+        stats->dcachePrefetches = dcache->prefetch.issued;
+        stats->dcachePrefetchUseful = dcache->prefetch.useful;
+        stats->dcachePrefetchLate = dcache->prefetch.late;
+        stats->dcachePrefetchPolluting = dcache->prefetch.polluting;
+        stats->dcacheMemReads = dcache->memReads;
+        stats->dcacheMemWrites = dcache->memWrites;
+        stats->dcacheVictimHits = dcache->victimHits;
+        stats->dcacheVictimEvictions = dcache->victimEvictions;
+    }
+    if (l2 != NULL) {
+        stats->l2Hits = l2->hits;
+        stats->l2Misses = l2->misses;
+        stats->l2Writebacks = l2->writebacks;
+    }
+    if (l3 != NULL) {
+        stats->l3Hits = l3->hits;
+        stats->l3Misses = l3->misses;
+        stats->l3Writebacks = l3->writebacks;
+    }
+}
+
+/*
+ * Everything one run is configured with: the command line, or one line of
+ * a batch manifest on top of the batch's own command line.
+ */
+typedef struct simConfigStruct {
+    char *filename;
+    int traceLevel; // -1 to leave it as it is
+    char *binaryTrace;
+    char *addressTrace;
+    long long fastForward;
+    char *statsFile;
+    char *profileFile;
+    long long statsInterval;
+    int predictorKind;
+    int predictorEntries;
+    int predictorHistory;
+    int icacheOn;
+    int icacheGeometry[3];
+    int icacheHitLatency;
+    int icacheMissLatency;
+    int dcacheOn;
+    int dcacheGeometry[3];
+    int dcacheHitLatency;
+    int dcacheMissLatency;
+    int cachePolicy;
+    int icachePrefetch[3]; // kind, degree, distance
+    int dcachePrefetch[3];
+    int mshrs; // per cache, 0 for blocking caches
+    int writeBuffer; // data cache write buffer entries
+    int writeThrough;
+    int noWriteAllocate;
+    int victimCache; // victim cache blocks per cache, 0 for none
+    int l2On; // a second level under the data cache
+    int l2Geometry[3];
+    int l2HitLatency;
+    int l2MissLatency;
+    int l3On; // and a third under that
+    int l3Geometry[3];
+    int l3HitLatency;
+    int l3MissLatency;
+    int inclusion; // of the L2 and L3
+    int cores; // pipelines sharing the L2 and memory, 1 for a plain run
+    int quantum; // cycles the cores of a multicore run go between syncs
+    int coherence; // their enum coherenceProtocol
+    int quietLoad;
+    int addrBits;
+    long long checkpointEvery;
+    int checkpointPc; // -1 if none
+    char *checkpointOut;
+    char *restoreFile;
+    long long runCycles; // 0 to run until halt
+    int debug;
+} simConfigType;
+
+/*
+ * One simulator instance: the pipeline state and everything hanging off it.
+ * Instances share nothing but their (read-only) program, so several can run
+ * at once on different threads.
+ */
+typedef struct simulatorStruct {
+    const simConfigType *config;
+    const programType *program;
+    stateType buffers[2];
+    stateType *state; // the state before the current cycle
+    stateType *newState; // the state being computed
+    memWriteType memWrite;
+    memoryType dataMem;
+    statsType stats;
+    predictorType predictor;
+    cacheStruct *icache;
+    cacheStruct *dcache;
+    cacheStruct *l2; // under the data cache, or NULL
+    cacheStruct *l3; // under the L2, or NULL
+    // Outstanding cache accesses. The access itself happens in the first
+    // cycle; the stage then waits out the rest of the latency. -1 means no
+    // access has been started for the instruction currently in the stage.
+    int fetchWait;
+    int memWait;
+    int memData; // what the waiting lw will write back
+    long long fastForwarded; // instructions run by the functional interpreter
+    FILE *statsOut; // for --stats-interval, or NULL
+    int statsFormat;
+    int statsRecords; // written to statsOut so far
+    struct debuggerStruct *debug; // breakpoints to check, or NULL
+    coherenceType *coherence; // a core of a multicore run is told of stores, else NULL
+    int coreId;
+} simulatorType;
+
+void snapshotState(stateType*, traceStateType*);
 void printState(stateType*);
-void printInstruction(int);
-void readMachineCode(stateType*, char*);
+void readMachineCode(programType*, char*, int);
 
-int main(int argc, char *argv[]) {
-    stateType state, newState;
+static void usage(char *name) {
+    printf("error: usage: %s [--trace off|final|diff|full] [--trace-binary <file>] [--addr-trace <file>] [--fast-forward <n>] [--stats <file>] [--stats-interval <n>] [--profile <file>] [--predictor nottaken|btfn|bimodal|gshare|btb] [--bp-entries <n>] [--bp-history <bits>] [--icache <b,s,a>] [--dcache <b,s,a>] [--icache-latency <hit,miss>] [--dcache-latency <hit,miss>] [--cache-policy lru|plru|srrip|brrip|fifo|random] [--icache-prefetch none|nextline|stride|stream[,degree[,distance]]] [--dcache-prefetch none|nextline|stride|stream[,degree[,distance]]] [--mshrs <n>] [--write-buffer <n>] [--write-through] [--no-write-allocate] [--victim-cache <n>] [--l2 <b,s,a>] [--l3 <b,s,a>] [--l2-latency <hit,miss>] [--l3-latency <hit,miss>] [--inclusion inclusive|exclusive|nine] [--cores <n>] [--quantum <n>] [--coherence msi|mesi] [--quiet-load] [--addr-bits <n>] [--checkpoint-every <n>] [--checkpoint-at-pc <pc>] [--checkpoint-out <prefix>] [--restore <file>] [--run-cycles <n>] [--debug] <machine-code file>\n", name);
+    printf("       %s --batch <manifest> [--jobs <n>] [--batch-out <file>] [options for every job]\n", name);
+    exit(1);
+}
+
+static void defaultConfig(simConfigType *cfg) {
+    memset(cfg, 0, sizeof(*cfg));
+    cfg->traceLevel = -1;
+    cfg->predictorKind = PREDICT_NOT_TAKEN;
+    cfg->predictorEntries = 256;
+    cfg->predictorHistory = 8;
+    cfg->icacheHitLatency = 1;
+    cfg->icacheMissLatency = 10;
+    cfg->dcacheHitLatency = 1;
+    cfg->dcacheMissLatency = 10;
+    cfg->l2HitLatency = 4;
+    cfg->l2MissLatency = 20;
+    cfg->l3HitLatency = 10;
+    cfg->l3MissLatency = 40;
+    cfg->inclusion = INCLUDE_INCLUSIVE;
+    cfg->cores = 1;
+    cfg->quantum = 100;
+    cfg->coherence = COHERENCE_MESI;
+    cfg->cachePolicy = REPLACE_LRU;
+    cfg->addrBits = MEM_MIN_ADDR_BITS;
+    cfg->checkpointPc = -1;
+}
+
+/*
+ * Apply the simulator options in argv[first..argc-1] to cfg. Returns the
+ * index of the first argument that is not one of them, so the caller can
+ * handle its own.
+ */
+static int parseOptions(simConfigType *cfg, int argc, char *argv[], int first) {
+    int i;
+    for (i = first; i < argc; ++i) {
+        if (!strcmp(argv[i], "--trace") && i + 1 < argc) {
+            cfg->traceLevel = trace_parse_level(argv[++i]);
+            if (cfg->traceLevel < 0) {
+                printf("error: unknown trace level %s\n", argv[i]);
+                exit(1);
+            }
+        }
+        else if (!strcmp(argv[i], "--trace-binary") && i + 1 < argc) {
+            cfg->binaryTrace = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--addr-trace") && i + 1 < argc) {
+            cfg->addressTrace = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--fast-forward") && i + 1 < argc) {
+            cfg->fastForward = atoll(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "--stats") && i + 1 < argc) {
+            cfg->statsFile = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--stats-interval") && i + 1 < argc) {
+            cfg->statsInterval = atoll(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "--profile") && i + 1 < argc) {
+            cfg->profileFile = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--predictor") && i + 1 < argc) {
+            cfg->predictorKind = bpred_parse_kind(argv[++i]);
+            if (cfg->predictorKind < 0) {
+                printf("error: unknown predictor %s\n", argv[i]);
+                exit(1);
+            }
+        }
+        else if (!strcmp(argv[i], "--bp-entries") && i + 1 < argc) {
+            cfg->predictorEntries = atoi(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "--bp-history") && i + 1 < argc) {
+            cfg->predictorHistory = atoi(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "--icache") && i + 1 < argc) {
+            parseCacheGeometry(argv[++i], cfg->icacheGeometry);
+            cfg->icacheOn = 1;
+        }
+        else if (!strcmp(argv[i], "--dcache") && i + 1 < argc) {
+            parseCacheGeometry(argv[++i], cfg->dcacheGeometry);
+            cfg->dcacheOn = 1;
+        }
+        else if (!strcmp(argv[i], "--icache-latency") && i + 1 < argc) {
+            parseLatency(argv[++i], &cfg->icacheHitLatency, &cfg->icacheMissLatency);
+        }
+        else if (!strcmp(argv[i], "--dcache-latency") && i + 1 < argc) {
+            parseLatency(argv[++i], &cfg->dcacheHitLatency, &cfg->dcacheMissLatency);
+        }
+        else if (!strcmp(argv[i], "--icache-prefetch") && i + 1 < argc) {
+            parsePrefetcher(argv[++i], cfg->icachePrefetch);
+        }
+        else if (!strcmp(argv[i], "--dcache-prefetch") && i + 1 < argc) {
+            parsePrefetcher(argv[++i], cfg->dcachePrefetch);
+        }
+        else if (!strcmp(argv[i], "--mshrs") && i + 1 < argc) {
+            cfg->mshrs = atoi(argv[++i]);
+            if (cfg->mshrs < 0 || cfg->mshrs > MAX_MSHRS) {
+                printf("error: --mshrs must be 0 to %d\n", MAX_MSHRS);
+                exit(1);
+            }
+        }
+        else if (!strcmp(argv[i], "--write-buffer") && i + 1 < argc) {
+            cfg->writeBuffer = atoi(argv[++i]);
+            if (cfg->writeBuffer < 0 || cfg->writeBuffer > MAX_WRITE_BUFFER) {
+                printf("error: --write-buffer must be 0 to %d\n", MAX_WRITE_BUFFER);
+                exit(1);
+            }
+        }
+        else if (!strcmp(argv[i], "--victim-cache") && i + 1 < argc) {
+            cfg->victimCache = atoi(argv[++i]);
+            if (cfg->victimCache < 0 || cfg->victimCache > MAX_VICTIM_BLOCKS) {
+                printf("error: --victim-cache must be 0 to %d\n", MAX_VICTIM_BLOCKS);
+                exit(1);
+            }
+        }
+        else if (!strcmp(argv[i], "--write-through")) {
+            cfg->writeThrough = 1;
+        }
+        else if (!strcmp(argv[i], "--no-write-allocate")) {
+            cfg->noWriteAllocate = 1;
+        }
+        else if (!strcmp(argv[i], "--l2") && i + 1 < argc) {
+            parseCacheGeometry(argv[++i], cfg->l2Geometry);
+            cfg->l2On = 1;
+        }
+        else if (!strcmp(argv[i], "--l3") && i + 1 < argc) {
+            parseCacheGeometry(argv[++i], cfg->l3Geometry);
+            cfg->l3On = 1;
+        }
+        else if (!strcmp(argv[i], "--l2-latency") && i + 1 < argc) {
+            parseLatency(argv[++i], &cfg->l2HitLatency, &cfg->l2MissLatency);
+        }
+        else if (!strcmp(argv[i], "--l3-latency") && i + 1 < argc) {
+            parseLatency(argv[++i], &cfg->l3HitLatency, &cfg->l3MissLatency);
+        }
+        else if (!strcmp(argv[i], "--inclusion") && i + 1 < argc) {
+            cfg->inclusion = cacheParseInclusion(argv[++i]);
+            if (cfg->inclusion < 0) {
+                printf("error: unknown inclusion policy %s\n", argv[i]);
+                exit(1);
+            }
+        }
+        else if (!strcmp(argv[i], "--cores") && i + 1 < argc) {
+            cfg->cores = atoi(argv[++i]);
+            if (cfg->cores < 1 || cfg->cores > MAX_CORES) {
+                printf("error: --cores must be 1 to %d\n", MAX_CORES);
+                exit(1);
+            }
+        }
+        else if (!strcmp(argv[i], "--quantum") && i + 1 < argc) {
+            cfg->quantum = atoi(argv[++i]);
+            if (cfg->quantum < 1) {
+                printf("error: --quantum must be at least one cycle\n");
+                exit(1);
+            }
+        }
+        else if (!strcmp(argv[i], "--coherence") && i + 1 < argc) {
+            cfg->coherence = coherence_parse_protocol(argv[++i]);
+            if (cfg->coherence < 0) {
+                printf("error: unknown coherence protocol %s\n", argv[i]);
+                exit(1);
+            }
+        }
+        else if (!strcmp(argv[i], "--cache-policy") && i + 1 < argc) {
+            cfg->cachePolicy = cacheParsePolicy(argv[++i]);
+            if (cfg->cachePolicy < 0) {
+                printf("error: unknown cache policy %s\n", argv[i]);
+                exit(1);
+            }
+        }
+        else if (!strcmp(argv[i], "--quiet-load")) {
+            cfg->quietLoad = 1;
+        }
+        else if (!strcmp(argv[i], "--addr-bits") && i + 1 < argc) {
+            cfg->addrBits = atoi(argv[++i]);
+            if (cfg->addrBits < MEM_MIN_ADDR_BITS || cfg->addrBits > MEM_MAX_ADDR_BITS) {
+                printf("error: --addr-bits must be %d to %d\n", MEM_MIN_ADDR_BITS, MEM_MAX_ADDR_BITS);
+                exit(1);
+            }
+        }
+        else if (!strcmp(argv[i], "--checkpoint-every") && i + 1 < argc) {
+            cfg->checkpointEvery = atoll(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "--checkpoint-at-pc") && i + 1 < argc) {
+            cfg->checkpointPc = atoi(argv[++i]);
+            if (cfg->checkpointPc < 0 || cfg->checkpointPc >= NUMMEMORY) {
+                printf("error: --checkpoint-at-pc must be an instruction address\n");
+                exit(1);
+            }
+        }
+        else if (!strcmp(argv[i], "--checkpoint-out") && i + 1 < argc) {
+            cfg->checkpointOut = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--restore") && i + 1 < argc) {
+            cfg->restoreFile = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--run-cycles") && i + 1 < argc) {
+            cfg->runCycles = atoll(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "--debug")) {
+            cfg->debug = 1;
+        }
+        else if (cfg->filename == NULL && argv[i][0] != '-') {
+            cfg->filename = argv[i];
+        }
+        else {
+            break;
+        }
+    }
+    return i;
+}
+
+static cacheStruct *newCache(const int geometry[3], int policy, memAccessFn memAccess,
+        memBlockFn memBlock, void *mem) {
+    cacheStruct *c = malloc(sizeof(cacheStruct));
+    if (c == NULL) {
+        printf("error: out of memory\n");
+        exit(1);
+    }
+    cacheSetup(c, geometry[0], geometry[1], geometry[2], policy, memAccess, mem);
+    cacheSetBlockAccess(c, memBlock);
+    return c;
+}
+
+// FNV-1a over the program, so a checkpoint is only restored onto its own
+static unsigned int programHash(const programType *program) {
+    unsigned int hash = 2166136261u;
+    for (int i = 0; i < program->numMemory; ++i) {
+        hash = (hash ^ (unsigned int)program->instrMem[i]) * 16777619u;
+    }
+    return hash;
+}
+
+/*
+ * Write a checkpoint of sim, stopped between two cycles, to out. The
+ * pipeline section is the state before the next cycle plus the cache
+ * accesses in flight; a store is never pending between cycles.
+ */
+static void simWrite(const simulatorType *sim, FILE *out) {
+    const stateType *state = sim->state;
+    int header[4] = {CKPT_MAGIC, CKPT_VERSION, sim->program->numMemory, (int)programHash(sim->program)};
+    ckpt_write(out, header, sizeof(header));
+
+    ckpt_write_int(out, CKPT_SECTION_PIPELINE);
+    ckpt_write_int(out, state->pc);
+    ckpt_write_int(out, state->cycles);
+    ckpt_write(out, state->reg, sizeof(state->reg));
+    ckpt_write(out, &state->IFID, sizeof(state->IFID));
+    ckpt_write(out, &state->IDEX, sizeof(state->IDEX));
+    ckpt_write(out, &state->EXMEM, sizeof(state->EXMEM));
+    ckpt_write(out, &state->MEMWB, sizeof(state->MEMWB));
+    ckpt_write(out, &state->WBEND, sizeof(state->WBEND));
+    ckpt_write_int(out, sim->fetchWait);
+    ckpt_write_int(out, sim->memWait);
+    ckpt_write_int(out, sim->memData);
+    ckpt_write(out, &sim->fastForwarded, sizeof(sim->fastForwarded));
+
+    stats_save(&sim->stats, NUMMEMORY, out);
+    bpred_save(&sim->predictor, out);
+    ckpt_write_int(out, sim->icache != NULL);
+    if (sim->icache != NULL) {
+        cacheSave(sim->icache, out);
+    }
+    ckpt_write_int(out, sim->dcache != NULL);
+    if (sim->dcache != NULL) {
+        cacheSave(sim->dcache, out);
+    }
+    ckpt_write_int(out, (sim->l2 != NULL) + (sim->l3 != NULL));
+    if (sim->l2 != NULL) {
+        cacheSave(sim->l2, out);
+    }
+    if (sim->l3 != NULL) {
+        cacheSave(sim->l3, out);
+    }
+    memory_save(&sim->dataMem, out);
+    ckpt_write_int(out, CKPT_SECTION_END);
+}
+
+static void simSave(const simulatorType *sim, const char *filename) {
+    FILE *out = fopen(filename, "wb");
+    if (out == NULL) {
+        printf("error: can't open file %s\n", filename);
+        exit(1);
+    }
+    simWrite(sim, out);
+    if (fclose(out) != 0) {
+        printf("error: can't write checkpoint %s\n", filename);
+        exit(1);
+    }
+}
+
+// Load the checkpoint named filename from in into sim, freshly set up
+static void simRead(simulatorType *sim, FILE *in, const char *filename) {
+    int header[4];
+    ckpt_read(in, header, sizeof(header));
+    if (header[0] != CKPT_MAGIC || header[1] != CKPT_VERSION) {
+        printf("error: %s is not a version %d checkpoint\n", filename, CKPT_VERSION);
+        exit(1);
+    }
+    if (header[2] != sim->program->numMemory || header[3] != (int)programHash(sim->program)) {
+        printf("error: %s was taken running a different program\n", filename);
+        exit(1);
+    }
+
+    stateType *state = sim->state;
+    ckpt_expect(in, CKPT_SECTION_PIPELINE, "section");
+    state->pc = ckpt_read_int(in);
+    state->cycles = ckpt_read_int(in);
+    ckpt_read(in, state->reg, sizeof(state->reg));
+    ckpt_read(in, &state->IFID, sizeof(state->IFID));
+    ckpt_read(in, &state->IDEX, sizeof(state->IDEX));
+    ckpt_read(in, &state->EXMEM, sizeof(state->EXMEM));
+    ckpt_read(in, &state->MEMWB, sizeof(state->MEMWB));
+    ckpt_read(in, &state->WBEND, sizeof(state->WBEND));
+    sim->fetchWait = ckpt_read_int(in);
+    sim->memWait = ckpt_read_int(in);
+    sim->memData = ckpt_read_int(in);
+    ckpt_read(in, &sim->fastForwarded, sizeof(sim->fastForwarded));
+
+    stats_restore(&sim->stats, NUMMEMORY, in);
+    bpred_restore(&sim->predictor, in);
+    ckpt_expect(in, sim->icache != NULL, "instruction cache flag");
+    if (sim->icache != NULL) {
+        cacheRestore(sim->icache, in);
+    }
+    ckpt_expect(in, sim->dcache != NULL, "data cache flag");
+    if (sim->dcache != NULL) {
+        cacheRestore(sim->dcache, in);
+    }
+    ckpt_expect(in, (sim->l2 != NULL) + (sim->l3 != NULL), "cache level count");
+    if (sim->l2 != NULL) {
+        cacheRestore(sim->l2, in);
+    }
+    if (sim->l3 != NULL) {
+        cacheRestore(sim->l3, in);
+    }
+    memory_restore(&sim->dataMem, in);
+    ckpt_expect(in, CKPT_SECTION_END, "section");
+}
 
-    if (argc != 2) {
-        printf("error: usage: %s <machine-code file>\n", argv[0]);
+static void simRestore(simulatorType *sim, const char *filename) {
+    FILE *in = fopen(filename, "rb");
+    if (in == NULL) {
+        printf("error: can't open file %s\n", filename);
         exit(1);
     }
+    simRead(sim, in, filename);
+    fclose(in);
+}
+
+/*
+ * Set up an instance to run program under cfg from the start: fresh data
+ * memory holding the program image, an empty pipeline, and the predictor
+ * and caches cfg asks for.
+ */
+static void simSetup(simulatorType *sim, const simConfigType *cfg, const programType *program) {
+    memset(sim, 0, sizeof(*sim));
+    sim->config = cfg;
+    sim->program = program;
+    sim->state = &sim->buffers[0];
+    sim->newState = &sim->buffers[1];
+    sim->fetchWait = -1;
+    sim->memWait = -1;
 
-    readMachineCode(&state, argv[1]);
+    bpred_init(&sim->predictor, cfg->predictorKind, cfg->predictorEntries, cfg->predictorHistory);
+
+    stateType *state = sim->state;
+    state->instrMem = program->instrMem;
+    state->decoded = program->decoded;
+    state->numMemory = program->numMemory;
+    state->dataMem = &sim->dataMem;
+    memory_init(state->dataMem, cfg->addrBits);
+    memory_load(state->dataMem, program->instrMem, program->numMemory);
+    memory_clean(state->dataMem);
+
+    if (cfg->icacheOn) {
+        sim->icache = newCache(cfg->icacheGeometry, cfg->cachePolicy, instrMemAccess, instrMemBlock, state->instrMem);
+        cacheSetPrefetcher(sim->icache, cfg->icachePrefetch[0], cfg->icachePrefetch[1],
+                cfg->icachePrefetch[2], cfg->icacheMissLatency, NUMMEMORY);
+        cacheSetLatency(sim->icache, cfg->icacheHitLatency, cfg->icacheMissLatency);
+        cacheSetMshrs(sim->icache, cfg->mshrs);
+        cacheSetVictimCache(sim->icache, cfg->victimCache);
+    }
+    if (cfg->dcacheOn) {
+        sim->dcache = newCache(cfg->dcacheGeometry, cfg->cachePolicy, dataMemAccess, dataMemBlock, state->dataMem);
+        cacheSetPrefetcher(sim->dcache, cfg->dcachePrefetch[0], cfg->dcachePrefetch[1],
+                cfg->dcachePrefetch[2], cfg->dcacheMissLatency, state->dataMem->addrMask + 1);
+        cacheSetLatency(sim->dcache, cfg->dcacheHitLatency, cfg->dcacheMissLatency);
+        cacheSetMshrs(sim->dcache, cfg->mshrs);
+        cacheSetWritePolicy(sim->dcache, cfg->writeThrough, !cfg->noWriteAllocate, cfg->writeBuffer);
+        cacheSetVictimCache(sim->dcache, cfg->victimCache);
+    }
+    if ((cfg->l2On && !cfg->dcacheOn) || (cfg->l3On && !cfg->l2On)) {
+        printf("error: --l2 needs --dcache, and --l3 needs --l2\n");
+        exit(1);
+    }
+    // a multicore run's levels are shared by the cores, see runMulticore
+    if (cfg->l2On && cfg->cores == 1) {
+        sim->l2 = newCache(cfg->l2Geometry, cfg->cachePolicy, dataMemAccess, dataMemBlock, state->dataMem);
+        cacheSetLatency(sim->l2, cfg->l2HitLatency, cfg->l2MissLatency);
+        cacheSetNext(sim->dcache, sim->l2, cfg->inclusion);
+    }
+    if (cfg->l3On && cfg->cores == 1) {
+        sim->l3 = newCache(cfg->l3Geometry, cfg->cachePolicy, dataMemAccess, dataMemBlock, state->dataMem);
+        cacheSetLatency(sim->l3, cfg->l3HitLatency, cfg->l3MissLatency);
+        cacheSetNext(sim->l2, sim->l3, cfg->inclusion);
+    }
 
     // initalize PC and all regs to zero, and all pipeline regs to noop
-    state.pc = 0;
-    state.cycles = 0;
-    state.IFID.instr = 0x1c00000;
-    state.IDEX.instr = 0x1c00000;
-    state.EXMEM.instr = 0x1c00000;
-    state.MEMWB.instr = 0x1c00000;
-    state.WBEND.instr = 0x1c00000;
-
-    while (opcode(state.MEMWB.instr) != HALT) {
-        printState(&state);
-
-        newState = state;
-        newState.cycles++;
-
-        /* ---------------------- IF stage --------------------- */
-        newState.IFID.instr = state.instrMem[state.pc];
-        newState.pc = state.pc + 1;
-        newState.IFID.pcPlus1 = state.pc + 1;
-
-        /* ---------------------- ID stage --------------------- */
-        newState.IDEX.instr = state.IFID.instr;
-        newState.IDEX.opcode = opcode(state.IFID.instr);
-        int IDA = field0(state.IFID.instr);
-        int IDB = field1(state.IFID.instr);
-        int IDC = field2(state.IFID.instr);
-        newState.IDEX.readRegA = state.reg[IDA];
-        newState.IDEX.readRegB = state.reg[IDB];
-        newState.IDEX.offset = convertNum(IDC);
-        newState.IDEX.pcPlus1 = state.IFID.pcPlus1;
-
-        // CHECK FOR STALLING HAZARDS:
-        if (state.IDEX.opcode == LW) {
-            if (newState.IDEX.opcode == ADD || newState.IDEX.opcode == NOR || newState.IDEX.opcode == BEQ || newState.IDEX.opcode == SW) {
-                if (state.IDEX.dest == IDA || state.IDEX.dest == IDB) {
-                    newState.IFID.instr = state.IFID.instr;
-                    newState.IDEX.instr = 0x1c00000;
-                    newState.pc--;
-                    newState.IFID.pcPlus1--;
-                    newState.IDEX.opcode = NOOP;
+    state->pc = 0;
+    state->cycles = 0;
+    resetPipeline(state);
+
+    if (cfg->profileFile != NULL) {
+        stats_enable_profile(&sim->stats, NUMMEMORY);
+    }
+}
+
+/*
+ * Set up an instance as simSetup does, then run the --fast-forward part on
+ * the functional interpreter, or pick up where a --restore checkpoint left
+ * off.
+ */
+static void simInit(simulatorType *sim, const simConfigType *cfg, const programType *program) {
+    if (cfg->restoreFile != NULL && cfg->fastForward > 0) {
+        printf("error: --restore and --fast-forward can't be combined\n");
+        exit(1);
+    }
+    simSetup(sim, cfg, program);
+    stateType *state = sim->state;
+    if (cfg->restoreFile != NULL) {
+        simRestore(sim, cfg->restoreFile);
+    }
+    // the pipeline then starts empty at the instruction after the last one
+    // run functionally
+    else if (cfg->fastForward > 0) {
+        sim->fastForwarded = runFunctional(state, cfg->fastForward);
+    }
+}
+
+static void simFree(simulatorType *sim) {
+    memory_free(&sim->dataMem);
+    bpred_free(&sim->predictor);
+    stats_free(&sim->stats);
+    cacheStruct *caches[4] = {sim->icache, sim->dcache, sim->l2, sim->l3};
+    for (int i = 0; i < 4; ++i) {
+        if (caches[i] != NULL) {
+            cacheFree(caches[i]);
+            free(caches[i]);
+        }
+    }
+}
+
+/* ------------------------- debugger ------------------------- */
+
+#define MAX_DEBUG_POINTS 64
+#define DEBUG_SNAPSHOT_EVERY 10000 // cycles between snapshots, to start with
+#define MAX_DEBUG_SNAPSHOTS 1024
+
+enum debugPointKind
+{
+    BREAK_PC, // stop when fetch moves to pc
+    BREAK_CYCLE, // stop before the cycle
+    WATCH_REG, // stop once a cycle changed the register
+    WATCH_MEM // stop once a cycle changed the data memory word
+};
+
+typedef struct debugPointStruct {
+    int kind;
+    int where;
+    int value; // watchpoints: the value last seen
+} debugPointType;
+
+// The simulator as it was before some cycle, saved in checkpoint format
+typedef struct snapshotStruct {
+    int cycles;
+    char *data;
+    size_t size;
+} snapshotType;
+
+typedef struct debuggerStruct {
+    debugPointType points[MAX_DEBUG_POINTS];
+    int numPoints;
+    int hit; // the point that stopped the run, or -1
+    int oldValue; // what a watchpoint that hit saw before
+    int lastPc; // fetch pc before the cycle last checked
+    int resuming; // the next check is for the cycle the run starts at
+    // Snapshots at every snapshotEvery cycles reached so far, oldest first.
+    // When there get to be too many, every other one goes and the spacing
+    // doubles, so memory stays bounded and seeking costs at most
+    // snapshotEvery cycles of re-simulation.
+    snapshotType snapshots[MAX_DEBUG_SNAPSHOTS];
+    int numSnapshots;
+    int snapshotEvery;
+} debuggerType;
+
+static int debugWatchedValue(const debugPointType *point, const stateType *state) {
+    if (point->kind == WATCH_REG) {
+        return state->reg[point->where];
+    }
+    return memory_read(state->dataMem, point->where);
+}
+
+/*
+ * Called before every cycle of a run under the debugger, except the one it
+ * resumes at. Returns whether a breakpoint or watchpoint says to stop
+ * there.
+ */
+static int debugStop(debuggerType *dbg, const stateType *state) {
+    int lastPc = dbg->lastPc;
+    dbg->lastPc = state->pc;
+    if (dbg->resuming) {
+        dbg->resuming = 0;
+        return 0;
+    }
+    for (int i = 0; i < dbg->numPoints; ++i) {
+        debugPointType *point = &dbg->points[i];
+        int stop = 0;
+        switch (point->kind) {
+            case BREAK_PC:
+                stop = state->pc == point->where && lastPc != point->where;
+                break;
+            case BREAK_CYCLE:
+                stop = state->cycles == point->where;
+                break;
+            default: {
+                int value = debugWatchedValue(point, state);
+                if (value != point->value) {
+                    dbg->oldValue = point->value;
+                    point->value = value;
+                    stop = 1;
                 }
+                break;
             }
-            else if (newState.IDEX.opcode == LW) {
-                if (state.IDEX.dest == IDA) {
-                    newState.IFID.instr = state.IFID.instr;
-                    newState.IDEX.instr = 0x1c00000;
-                    newState.pc--;
-                    newState.IFID.pcPlus1--;
-                    newState.IDEX.opcode = NOOP;
-                }
+        }
+        if (stop) {
+            dbg->hit = i;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Whether a cycle changed none of the pc, registers and latches
+static int sameLatches(const stateType *a, const stateType *b) {
+    return a->pc == b->pc && !memcmp(a->reg, b->reg, sizeof(a->reg))
+            && !memcmp(&a->IFID, &b->IFID, sizeof(a->IFID))
+            && !memcmp(&a->IDEX, &b->IDEX, sizeof(a->IDEX))
+            && !memcmp(&a->EXMEM, &b->EXMEM, sizeof(a->EXMEM))
+            && !memcmp(&a->MEMWB, &b->MEMWB, sizeof(a->MEMWB))
+            && !memcmp(&a->WBEND, &b->WBEND, sizeof(a->WBEND));
+}
+
+/*
+ * How many of the wait cycles still to come, from cycle on, can be skipped
+ * without stepping over the next cycle something happens in: the stop, a
+ * checkpoint or a --stats-interval record. Worked out in long long, as the
+ * interval is, and kept to 0..wait.
+ */
+static int stallSkip(const simulatorType *sim, int cycle, int wait, int stopCycle, int nextCheckpoint) {
+    long long next = (long long)cycle + wait;
+    if (stopCycle >= cycle && stopCycle < next) {
+        next = stopCycle;
+    }
+    if (nextCheckpoint >= cycle && nextCheckpoint < next) {
+        next = nextCheckpoint;
+    }
+    long long interval = sim->config->statsInterval;
+    if (sim->statsOut != NULL && interval > 0) {
+        long long record = (cycle + interval - 1) / interval * interval;
+        if (record < next) {
+            next = record;
+        }
+    }
+    if (next < cycle) {
+        return 0;
+    }
+    return next - cycle > wait ? wait : (int)(next - cycle);
+}
+
+/*
+ * Run the pipeline until the halt reaches the end of MEM/WB, or until the
+ * cycle count reaches stopCycle (-1 for no limit). On return sim->state is
+ * the state reached and sim->stats is up to date.
+ */
+static void simRun(simulatorType *sim, int stopCycle) {
+    const simConfigType *cfg = sim->config;
+    stateType *state = sim->state;
+    stateType *newState = sim->newState;
+    const decodeType *dec = sim->program->decoded;
+    statsType *stats = &sim->stats;
+    predictorType *predictor = &sim->predictor;
+    cacheStruct *icache = sim->icache;
+    cacheStruct *dcache = sim->dcache;
+    int icacheOn = cfg->icacheOn, dcacheOn = cfg->dcacheOn;
+    memWriteType memWrite = sim->memWrite;
+    int fetchWait = sim->fetchWait;
+    int memWait = sim->memWait;
+    int memData = sim->memData;
+
+    // Snapshot of the last traced state, for the diff trace, which starts
+    // with the whole state
+    traceStateType prevTrace, curTrace;
+    int lastStoreAddr = -1;
+    int lastStoreData = 0;
+    int firstCycle = 1;
+
+    // The cycle to checkpoint before, or -1
+    int nextCheckpoint = -1;
+    if (cfg->checkpointEvery > 0) {
+        nextCheckpoint = (state->cycles / cfg->checkpointEvery + 1) * cfg->checkpointEvery;
+    }
+    int checkpointPc = cfg->checkpointPc;
+    // Every cycle is traced, or stopped at, with these
+    int skipStalls = sim->debug == NULL && traceBinary == NULL
+            && traceLevel != TRACE_FULL && traceLevel != TRACE_DIFF;
+
+    while (dec->opcode[state->MEMWB.instrIdx] != HALT && state->cycles != stopCycle) {
+        if (sim->debug != NULL && debugStop(sim->debug, state)) {
+            break;
+        }
+        if (state->cycles == nextCheckpoint || state->pc == checkpointPc) {
+            char filename[MAXLINELENGTH];
+            snprintf(filename, sizeof(filename), "%s.%d.ckpt",
+                    cfg->checkpointOut != NULL ? cfg->checkpointOut : cfg->filename, state->cycles);
+            sim->state = state;
+            sim->newState = newState;
+            sim->fetchWait = fetchWait;
+            sim->memWait = memWait;
+            sim->memData = memData;
+            simSave(sim, filename);
+            if (state->cycles == nextCheckpoint) {
+                nextCheckpoint += cfg->checkpointEvery;
+            }
+            if (state->pc == checkpointPc) {
+                checkpointPc = -1;
+            }
+        }
+        if (traceLevel == TRACE_FULL || (traceLevel == TRACE_DIFF && firstCycle)) {
+            printState(state);
+        }
+        if (traceLevel == TRACE_DIFF || traceBinary != NULL) {
+            snapshotState(state, &curTrace);
+            if (traceLevel == TRACE_DIFF && !firstCycle) {
+                trace_print_state_diff(&prevTrace, &curTrace, lastStoreAddr, lastStoreData);
+            }
+            if (traceBinary != NULL) {
+                trace_write_state(&curTrace);
             }
+            prevTrace = curTrace;
+            lastStoreAddr = -1;
         }
+        firstCycle = 0;
+        if (sim->statsOut != NULL && cfg->statsInterval > 0 && state->cycles > 0
+                && state->cycles % cfg->statsInterval == 0) {
+            stats->cycles = state->cycles;
+            collectCacheStats(stats, icache, dcache, sim->l2, sim->l3);
+            stats_write(sim->statsOut, sim->statsFormat, stats, sim->statsRecords++ == 0);
+        }
+
+        *newState = *state;
+        newState->cycles++;
 
-        if (newState.IDEX.opcode == ADD || newState.IDEX.opcode == NOR) {
-            newState.IDEX.dest = (convertNum(IDC) & 0b111);
+        // A data cache miss holds every stage up to and including MEM, which
+        // repeats until the access completes
+        int memStalled = 0;
+        int MEMop = dec->opcode[state->EXMEM.instrIdx];
+        int memAddr = state->EXMEM.aluResult & state->dataMem->addrMask;
+        if (dcacheOn && (MEMop == LW || MEMop == SW)) {
+            if (memWait < 0) {
+                dcache->now = state->cycles;
+                dcache->pc = state->EXMEM.instrIdx;
+                memData = cacheAccess(dcache, memAddr, MEMop == SW, state->EXMEM.readRegB);
+                memWait = dcache->lastLatency - 1;
+            }
+            if (memWait > 0) {
+                memWait--;
+                memStalled = 1;
+                stats->memStallCycles++;
+            }
+            else {
+                memWait = -1;
+            }
         }
-        else if (newState.IDEX.opcode == LW) {
-            newState.IDEX.dest = (convertNum(IDB) & 0b111);
+
+        int fetchStalled = 0;
+        if (memStalled) {
+            newState->MEMWB.instrIdx = NOOPINDEX;
+            newState->MEMWB.opcode = NOOP;
+            newState->MEMWB.dest = -1;
         }
         else {
-            newState.IDEX.dest = -1;
-        }
+            /* ---------------------- IF stage --------------------- */
+            if (icacheOn) {
+                if (fetchWait < 0) {
+                    // recorded here, as a fetch abandoned by a flush still
+                    // went to the cache
+                    if (traceAddress != NULL) {
+                        trace_write_address(state->pc, TRACE_ACCESS_FETCH);
+                    }
+                    icache->now = state->cycles;
+                    icache->pc = state->pc;
+                    cacheAccess(icache, state->pc, 0, 0);
+                    fetchWait = icache->lastLatency - 1;
+                }
+                if (fetchWait > 0) {
+                    fetchWait--;
+                    fetchStalled = 1;
+                    stats->fetchStallCycles++;
+                }
+                else {
+                    fetchWait = -1;
+                }
+            }
+            if (fetchStalled) {
+                // nothing fetched yet, send a bubble down
+                newState->IFID.instrIdx = NOOPINDEX;
+                newState->IFID.predictedTaken = 0;
+                newState->pc = state->pc;
+            }
+            else {
+                if (traceAddress != NULL && !icacheOn) {
+                    trace_write_address(state->pc, TRACE_ACCESS_FETCH);
+                }
+                newState->IFID.instrIdx = state->pc;
+                newState->pc = state->pc + 1;
+                newState->IFID.pcPlus1 = state->pc + 1;
+                newState->IFID.predictedTaken = 0;
+                if (predictor->kind != PREDICT_NOT_TAKEN && dec->opcode[state->pc] == BEQ) {
+                    int target;
+                    if (bpred_predict(predictor, state->pc, state->pc + 1 + dec->offset[state->pc], &target)) {
+                        newState->pc = target;
+                        newState->IFID.predictedTaken = 1;
+                    }
+                }
+            }
+
+            /* ---------------------- ID stage --------------------- */
+            int ID = state->IFID.instrIdx;
+            newState->IDEX.instrIdx = ID;
+            newState->IDEX.opcode = dec->opcode[ID];
+            int IDA = dec->regA[ID];
+            int IDB = dec->regB[ID];
+            newState->IDEX.readRegA = state->reg[IDA];
+            newState->IDEX.readRegB = state->reg[IDB];
+            newState->IDEX.offset = dec->offset[ID];
+            newState->IDEX.pcPlus1 = state->IFID.pcPlus1;
+            newState->IDEX.dest = dec->dest[ID];
+            newState->IDEX.predictedTaken = state->IFID.predictedTaken;
+
+            // CHECK FOR STALLING HAZARDS:
+            if (state->IDEX.opcode == LW) {
+                int stall = 0;
+                if (newState->IDEX.opcode == ADD || newState->IDEX.opcode == NOR || newState->IDEX.opcode == BEQ || newState->IDEX.opcode == SW) {
+                    stall = (state->IDEX.dest == IDA || state->IDEX.dest == IDB);
+                }
+                else if (newState->IDEX.opcode == LW) {
+                    stall = (state->IDEX.dest == IDA);
+                }
+                if (stall) {
+                    stats->loadUseStalls++;
+                    if (stats->pcStalls != NULL) {
+                        stats->pcStalls[ID]++;
+                    }
+                    newState->IFID = state->IFID;
+                    newState->IDEX.instrIdx = NOOPINDEX;
+                    newState->pc = state->pc;
+                    newState->IDEX.opcode = NOOP;
+                    newState->IDEX.dest = -1;
+                }
+            }
+
+
+            /* ---------------------- EX stage --------------------- */
+            int EX = state->IDEX.instrIdx;
+            newState->EXMEM.instrIdx = EX;
+            newState->EXMEM.dest = state->IDEX.dest;
+            newState->EXMEM.predictedTaken = state->IDEX.predictedTaken;
+            // CHECK FOR HAZARDS THAT DO NOT INVOLVE STALLS:
+            int regA = state->IDEX.readRegA;
+            int regB = state->IDEX.readRegB;
+            int fieldA = dec->regA[EX];
+            int fieldB = dec->regB[EX];
+            int offset = dec->offset[EX];
+            int realInstr = (EX != NOOPINDEX); // bubbles don't count as forwarding hits
+
+            if (state->EXMEM.dest == fieldA) {
+                if (state->EXMEM.opcode == ADD || state->EXMEM.opcode == NOR || state->EXMEM.opcode == LW) {
+                    regA = state->EXMEM.aluResult;
+                    stats->forwardEXMEM += realInstr;
+                }
+            }
+            else if (state->MEMWB.dest == fieldA) {
+                if (state->MEMWB.opcode == ADD || state->MEMWB.opcode == NOR || state->MEMWB.opcode == LW) {
+                    regA = state->MEMWB.writeData;
+                    stats->forwardMEMWB += realInstr;
+                }
+            }
+            else if (state->WBEND.dest == fieldA) {
+                if (dec->writesReg[state->WBEND.instrIdx]) {
+                    regA = state->WBEND.writeData;
+                    stats->forwardWBEND += realInstr;
+                }
+            }
+
+            if (state->EXMEM.dest == fieldB) {
+                if (state->EXMEM.opcode == ADD || state->EXMEM.opcode == NOR || state->EXMEM.opcode == LW) {
+                    regB = state->EXMEM.aluResult;
+                    stats->forwardEXMEM += realInstr;
+                }
+            }
+            else if (state->MEMWB.dest == fieldB) {
+                if (state->MEMWB.opcode == ADD || state->MEMWB.opcode == NOR || state->MEMWB.opcode == LW) {
+                    regB = state->MEMWB.writeData;
+                    stats->forwardMEMWB += realInstr;
+                }
+            }
+            else if (state->WBEND.dest == fieldB) {
+                if (dec->writesReg[state->WBEND.instrIdx]) {
+                    regB = state->WBEND.writeData;
+                    stats->forwardWBEND += realInstr;
+                }
+            }
+        
+            newState->EXMEM.eq = (regA == regB) ? 1 : 0;
+            newState->EXMEM.opcode = dec->opcode[EX];
+            newState->EXMEM.readRegB = regB;
+            newState->EXMEM.branchTarget = state->IDEX.pcPlus1 + offset;
+            if (state->IDEX.opcode == ADD) {
+                newState->EXMEM.aluResult = regA + regB;
+            }
+            else if (state->IDEX.opcode == NOR) {
+                newState->EXMEM.aluResult = ~(regA | regB);
+            }
+            else if (state->IDEX.opcode == LW || state->IDEX.opcode == SW) {
+                newState->EXMEM.aluResult = regA + offset;
+            }
         
 
-        /* ---------------------- EX stage --------------------- */
-        newState.EXMEM.instr = state.IDEX.instr;
-        newState.EXMEM.dest = state.IDEX.dest;
-        // CHECK FOR HAZARDS THAT DO NOT INVOLVE STALLS:
-        int regA = state.IDEX.readRegA;
-        int regB = state.IDEX.readRegB;
-        int fieldA = convertNum(field0(state.IDEX.instr));
-        int fieldB = convertNum(field1(state.IDEX.instr));
-        int offset = convertNum(field2(state.IDEX.instr));
 
-        if (state.EXMEM.dest == fieldA) {
-            if (state.EXMEM.opcode == ADD || state.EXMEM.opcode == NOR || state.EXMEM.opcode == LW) {
-                regA = state.EXMEM.aluResult;
+            /* --------------------- MEM stage --------------------- */
+            newState->MEMWB.instrIdx = state->EXMEM.instrIdx;
+            newState->MEMWB.opcode = MEMop;
+            newState->MEMWB.dest = state->EXMEM.dest;
+            newState->MEMWB.writeData = state->EXMEM.aluResult;
+            if (traceAddress != NULL && (MEMop == LW || MEMop == SW)) {
+                trace_write_address(memAddr, MEMop == LW ? TRACE_ACCESS_READ : TRACE_ACCESS_WRITE);
             }
+            if (MEMop == LW) {
+                newState->MEMWB.writeData = dcacheOn ? memData : memory_read(state->dataMem, memAddr);
+            }
+            else if (MEMop == SW) {
+                memWrite.valid = 1;
+                memWrite.addr = memAddr;
+                memWrite.data = state->EXMEM.readRegB;
+            }
+            else if (MEMop == BEQ) {
+                int taken = (state->EXMEM.eq == 1);
+                stats->branches++;
+                // If mispredicted (taken, unless IF predicted it):
+                if (taken != state->EXMEM.predictedTaken) {
+                    stats->branchFlushes++;
+                    if (stats->pcFlushes != NULL) {
+                        stats->pcFlushes[state->EXMEM.instrIdx]++;
+                    }
+                    newState->IFID.instrIdx = NOOPINDEX;
+                    newState->IDEX.instrIdx = NOOPINDEX;
+                    newState->EXMEM.instrIdx = NOOPINDEX;
+                    newState->pc = taken ? state->EXMEM.branchTarget : state->EXMEM.instrIdx + 1;
+                    fetchWait = -1; // drop a fetch still waiting on the wrong path
+                }
+                bpred_update(predictor, state->EXMEM.instrIdx, taken, state->EXMEM.branchTarget);
+            }
+        }
+
+        /* ---------------------- WB stage --------------------- */
+        newState->WBEND.instrIdx = state->MEMWB.instrIdx;
+        if (state->MEMWB.instrIdx != NOOPINDEX) {
+            stats->retired++;
+        }
+        newState->WBEND.dest = state->MEMWB.dest;
+        newState->WBEND.writeData = state->MEMWB.writeData;
+        if (state->MEMWB.opcode == ADD || state->MEMWB.opcode == NOR || state->MEMWB.opcode == LW) {
+            newState->reg[state->MEMWB.dest] = state->MEMWB.writeData;
         }
-        else if (state.MEMWB.dest == fieldA) {
-            if (state.MEMWB.opcode == ADD || state.MEMWB.opcode == NOR || state.MEMWB.opcode == LW) {
-                regA = state.MEMWB.writeData;
+        // The instructions ID/EX would forward from drain out of the back of
+        // the pipeline while it is held, so have it pick up their results
+        // from the register file instead
+        if (memStalled) {
+            newState->IDEX.readRegA = newState->reg[dec->regA[state->IDEX.instrIdx]];
+            newState->IDEX.readRegB = newState->reg[dec->regB[state->IDEX.instrIdx]];
+        }
+
+
+        /* ------------------------ END ------------------------ */
+        if (memWrite.valid) {
+            memory_write(newState->dataMem, memWrite.addr, memWrite.data);
+            if (sim->coherence != NULL) {
+                coherence_store(sim->coherence, sim->coreId, state->cycles, memWrite.addr, memWrite.data);
+            }
+            memWrite.valid = 0;
+            lastStoreAddr = memWrite.addr;
+            lastStoreData = memWrite.data;
+            if (traceBinary != NULL) {
+                trace_write_memwrite(memWrite.addr, memWrite.data);
             }
         }
-        else if (state.WBEND.dest == fieldA) {
-            if (opcode(state.WBEND.instr) == ADD || opcode(state.WBEND.instr) == NOR || opcode(state.WBEND.instr) == LW) {
-                regA = state.WBEND.writeData;
+        // A stalled cycle that left the latches as they were repeats until
+        // the wait runs out, so jump to then, or to the next cycle the top
+        // of the loop has something to do in
+        if ((memStalled || fetchStalled) && skipStalls && sameLatches(state, newState)) {
+            int *wait = memStalled ? &memWait : &fetchWait;
+            int skip = stallSkip(sim, newState->cycles, *wait, stopCycle, nextCheckpoint);
+            newState->cycles += skip;
+            *wait -= skip;
+            if (memStalled) {
+                stats->memStallCycles += skip;
+            }
+            else {
+                stats->fetchStallCycles += skip;
             }
         }
 
-        if (state.EXMEM.dest == fieldB) {
-            if (state.EXMEM.opcode == ADD || state.EXMEM.opcode == NOR || state.EXMEM.opcode == LW) {
-                regB = state.EXMEM.aluResult;
+        /* swapping the buffers is the last statement before end of the loop. It marks the end
+        of the cycle and makes the values calculated in this cycle the current state */
+        stateType *tmp = state;
+        state = newState;
+        newState = tmp;
+    }
+    sim->state = state;
+    sim->newState = newState;
+    sim->memWrite = memWrite;
+    sim->fetchWait = fetchWait;
+    sim->memWait = memWait;
+    sim->memData = memData;
+    stats->cycles = state->cycles;
+    if (dec->opcode[state->MEMWB.instrIdx] == HALT) {
+        stats->retired++; // the halt itself
+    }
+    collectCacheStats(stats, icache, dcache, sim->l2, sim->l3);
+}
+
+static int simHalted(const simulatorType *sim) {
+    return sim->program->decoded->opcode[sim->state->MEMWB.instrIdx] == HALT;
+}
+
+// Snapshot sim, which is at a multiple of the snapshot spacing
+static void debugSnapshot(debuggerType *dbg, const simulatorType *sim) {
+    if (dbg->numSnapshots == MAX_DEBUG_SNAPSHOTS) {
+        // keep the first, where the session started, and every other one
+        dbg->snapshotEvery *= 2;
+        int kept = 1;
+        for (int i = 1; i < dbg->numSnapshots; ++i) {
+            if (dbg->snapshots[i].cycles % dbg->snapshotEvery == 0) {
+                dbg->snapshots[kept++] = dbg->snapshots[i];
             }
+            else {
+                free(dbg->snapshots[i].data);
+            }
+        }
+        dbg->numSnapshots = kept;
+        if (sim->state->cycles % dbg->snapshotEvery != 0) {
+            return;
+        }
+    }
+    snapshotType *snap = &dbg->snapshots[dbg->numSnapshots];
+    snap->cycles = sim->state->cycles;
+    FILE *out = open_memstream(&snap->data, &snap->size);
+    if (out == NULL) {
+        printf("error: out of memory\n");
+        exit(1);
+    }
+    simWrite(sim, out);
+    fclose(out);
+    dbg->numSnapshots++;
+}
+
+// Start watchpoints off from the current values
+static void debugResume(debuggerType *dbg, const simulatorType *sim) {
+    for (int i = 0; i < dbg->numPoints; ++i) {
+        if (dbg->points[i].kind == WATCH_REG || dbg->points[i].kind == WATCH_MEM) {
+            dbg->points[i].value = debugWatchedValue(&dbg->points[i], sim->state);
+        }
+    }
+    dbg->hit = -1;
+    dbg->resuming = 1;
+}
+
+/*
+ * Run forward until the cycle count reaches target (-1 for no limit), the
+ * machine halts or, with breaks set, a breakpoint or watchpoint hits.
+ * Snapshots are taken on the way through cycles not reached before.
+ */
+static void debugRunTo(debuggerType *dbg, simulatorType *sim, int target, int breaks) {
+    debugResume(dbg, sim);
+    sim->debug = breaks ? dbg : NULL;
+    while (!simHalted(sim) && sim->state->cycles != target && dbg->hit < 0) {
+        int next = (sim->state->cycles / dbg->snapshotEvery + 1) * dbg->snapshotEvery;
+        simRun(sim, target >= 0 && target < next ? target : next);
+        if (sim->state->cycles == next && next > dbg->snapshots[dbg->numSnapshots - 1].cycles) {
+            debugSnapshot(dbg, sim);
+        }
+    }
+    sim->debug = NULL;
+}
+
+// Put sim back the way it was at snap
+static void debugRewind(simulatorType *sim, const snapshotType *snap) {
+    const simConfigType *cfg = sim->config;
+    const programType *program = sim->program;
+    FILE *statsOut = sim->statsOut;
+    int statsFormat = sim->statsFormat;
+    int statsRecords = sim->statsRecords;
+    simFree(sim);
+    simSetup(sim, cfg, program);
+    sim->statsOut = statsOut;
+    sim->statsFormat = statsFormat;
+    sim->statsRecords = statsRecords;
+    FILE *in = fmemopen(snap->data, snap->size, "rb");
+    if (in == NULL) {
+        printf("error: out of memory\n");
+        exit(1);
+    }
+    simRead(sim, in, "snapshot");
+    fclose(in);
+}
+
+/*
+ * Go to the state before cycle target. Unless the machine is already at
+ * or after the last snapshot before it, rewind to that snapshot first,
+ * then simulate (quietly, if those cycles were run before) up to target.
+ */
+static void debugGoto(debuggerType *dbg, simulatorType *sim, int target) {
+    if (target < dbg->snapshots[0].cycles) {
+        printf("cycle %d is before the start of the session\n", target);
+        return;
+    }
+    int i = dbg->numSnapshots - 1;
+    while (dbg->snapshots[i].cycles > target) {
+        i--;
+    }
+    if (target >= sim->state->cycles && sim->state->cycles >= dbg->snapshots[i].cycles) {
+        debugRunTo(dbg, sim, target, 0);
+        return;
+    }
+    debugRewind(sim, &dbg->snapshots[i]);
+    int level = traceLevel;
+    traceLevel = TRACE_OFF;
+    debugRunTo(dbg, sim, target, 0);
+    traceLevel = level;
+}
+
+static void debugPrintPoint(const debuggerType *dbg, int i) {
+    const debugPointType *point = &dbg->points[i];
+    static const char *kinds[] = {"break pc", "break cycle", "watch reg", "watch mem"};
+    printf("%d: %s %d", i + 1, kinds[point->kind], point->where);
+}
+
+// Where the machine is, and why it stopped
+static void debugWhere(const debuggerType *dbg, const simulatorType *sim) {
+    const stateType *state = sim->state;
+    if (dbg->hit >= 0) {
+        debugPrintPoint(dbg, dbg->hit);
+        if (dbg->points[dbg->hit].kind >= WATCH_REG) {
+            printf(": %d -> %d", dbg->oldValue, dbg->points[dbg->hit].value);
         }
-        else if (state.MEMWB.dest == fieldB) {
-            if (state.MEMWB.opcode == ADD || state.MEMWB.opcode == NOR || state.MEMWB.opcode == LW) {
-                regB = state.MEMWB.writeData;
+        printf("\n");
+    }
+    if (simHalted(sim)) {
+        printf("machine halted after %d cycles\n", state->cycles);
+        return;
+    }
+    printf("before cycle %d, fetching pc %d", state->cycles, state->pc);
+    if (state->pc >= 0 && state->pc < NUMMEMORY) {
+        printf(": ");
+        trace_print_instruction(state->instrMem[state->pc]);
+    }
+    trace_puts("\n");
+}
+
+static void debugHelp() {
+    printf("step [n]           run n cycles (default 1), stopping at breakpoints\n");
+    printf("continue           run until a breakpoint, a watchpoint or the halt\n");
+    printf("reverse-step [n]   go back n cycles (default 1)\n");
+    printf("goto <cycle>       go to the state before that cycle\n");
+    printf("break pc <pc>      stop when fetch moves to pc\n");
+    printf("break cycle <n>    stop before cycle n\n");
+    printf("watch reg <r>      stop after a cycle that changes reg[r]\n");
+    printf("watch mem <addr>   stop after a cycle that changes dataMem[addr]\n");
+    printf("delete [n]         remove breakpoint or watchpoint n, or all of them\n");
+    printf("info               list breakpoints and watchpoints\n");
+    printf("print              print the whole machine state\n");
+    printf("regs               print the registers\n");
+    printf("mem <addr> [n]     print n words of data memory (default 1)\n");
+    printf("save <file>        write a checkpoint, for --restore\n");
+    printf("quit\n");
+}
+
+/*
+ * --debug: read commands from stdin and step the machine back and forth
+ * until quit or the end of input.
+ */
+static void debugSession(simulatorType *sim) {
+    debuggerType *dbg = calloc(1, sizeof(debuggerType));
+    if (dbg == NULL) {
+        printf("error: out of memory\n");
+        exit(1);
+    }
+    dbg->snapshotEvery = DEBUG_SNAPSHOT_EVERY;
+    dbg->hit = -1;
+    debugSnapshot(dbg, sim);
+    printf("debugging %s, type help for commands\n", sim->config->filename);
+    debugWhere(dbg, sim);
+
+    char line[MAXLINELENGTH];
+    for (;;) {
+        printf("(lc2k) ");
+        fflush(stdout);
+        if (fgets(line, MAXLINELENGTH, stdin) == NULL) {
+            break;
+        }
+        char cmd[MAXLINELENGTH], what[MAXLINELENGTH];
+        int n = 1, m = 1;
+        int numArgs = sscanf(line, "%s", cmd);
+        if (numArgs < 1) {
+            continue;
+        }
+        if (!strcmp(cmd, "step") || !strcmp(cmd, "s")) {
+            sscanf(line, "%*s %d", &n);
+            if (!simHalted(sim)) {
+                debugRunTo(dbg, sim, sim->state->cycles + (n > 0 ? n : 1), 1);
+            }
+            debugWhere(dbg, sim);
+        }
+        else if (!strcmp(cmd, "continue") || !strcmp(cmd, "c")) {
+            debugRunTo(dbg, sim, -1, 1);
+            debugWhere(dbg, sim);
+        }
+        else if (!strcmp(cmd, "reverse-step") || !strcmp(cmd, "rs")) {
+            sscanf(line, "%*s %d", &n);
+            debugGoto(dbg, sim, sim->state->cycles - (n > 0 ? n : 1));
+            debugWhere(dbg, sim);
+        }
+        else if (!strcmp(cmd, "goto") && sscanf(line, "%*s %d", &n) == 1) {
+            debugGoto(dbg, sim, n);
+            debugWhere(dbg, sim);
+        }
+        else if ((!strcmp(cmd, "break") || !strcmp(cmd, "b") || !strcmp(cmd, "watch") || !strcmp(cmd, "w"))
+                && sscanf(line, "%*s %s %d", what, &n) == 2) {
+            int kind = -1;
+            if (cmd[0] == 'b') {
+                kind = !strcmp(what, "pc") ? BREAK_PC : !strcmp(what, "cycle") ? BREAK_CYCLE : -1;
+            }
+            else if (!strcmp(what, "reg")) {
+                kind = n >= 0 && n < NUMREGS ? WATCH_REG : -1;
+            }
+            else if (!strcmp(what, "mem")) {
+                kind = WATCH_MEM;
+            }
+            if (kind < 0) {
+                printf("unknown %s %s %d\n", cmd, what, n);
+            }
+            else if (dbg->numPoints == MAX_DEBUG_POINTS) {
+                printf("too many breakpoints and watchpoints\n");
+            }
+            else {
+                debugPointType *point = &dbg->points[dbg->numPoints++];
+                point->kind = kind;
+                point->where = kind == WATCH_MEM ? n & sim->dataMem.addrMask : n;
+                debugPrintPoint(dbg, dbg->numPoints - 1);
+                printf("\n");
             }
         }
-        else if (state.WBEND.dest == fieldB) {
-            if (opcode(state.WBEND.instr) == ADD || opcode(state.WBEND.instr) == NOR || opcode(state.WBEND.instr) == LW) {
-                regB = state.WBEND.writeData;
+        else if (!strcmp(cmd, "delete") || !strcmp(cmd, "d")) {
+            if (sscanf(line, "%*s %d", &n) != 1) {
+                dbg->numPoints = 0;
+            }
+            else if (n >= 1 && n <= dbg->numPoints) {
+                memmove(&dbg->points[n - 1], &dbg->points[n], (dbg->numPoints - n) * sizeof(debugPointType));
+                dbg->numPoints--;
+            }
+            else {
+                printf("no breakpoint or watchpoint %d\n", n);
             }
         }
-        
-        newState.EXMEM.eq = (regA == regB) ? 1 : 0;
-        newState.EXMEM.opcode = opcode(state.IDEX.instr);
-        newState.EXMEM.readRegB = regB;
-        newState.EXMEM.branchTarget = state.IDEX.pcPlus1 + offset;
-        if (state.IDEX.opcode == ADD) {
-            newState.EXMEM.aluResult = regA + regB;
+        else if (!strcmp(cmd, "info")) {
+            for (int i = 0; i < dbg->numPoints; ++i) {
+                debugPrintPoint(dbg, i);
+                printf("\n");
+            }
+            printf("%d snapshots, every %d cycles\n", dbg->numSnapshots, dbg->snapshotEvery);
         }
-        else if (state.IDEX.opcode == NOR) {
-            newState.EXMEM.aluResult = ~(regA | regB);
+        else if (!strcmp(cmd, "print") || !strcmp(cmd, "p")) {
+            printState(sim->state);
         }
-        else if (state.IDEX.opcode == LW || state.IDEX.opcode == SW) {
-            newState.EXMEM.aluResult = regA + offset;
+        else if (!strcmp(cmd, "regs")) {
+            for (int i = 0; i < NUMREGS; ++i) {
+                printf("reg[ %d ] = %d\n", i, sim->state->reg[i]);
+            }
         }
-        
+        else if (!strcmp(cmd, "mem") && sscanf(line, "%*s %d %d", &n, &m) >= 1) {
+            for (int i = 0; i < m; ++i) {
+                int addr = (n + i) & sim->dataMem.addrMask;
+                printf("dataMem[ %d ] = %d\n", addr, memory_read(&sim->dataMem, addr));
+            }
+        }
+        else if (!strcmp(cmd, "save") && sscanf(line, "%*s %s", what) == 1) {
+            simSave(sim, what);
+        }
+        else if (!strcmp(cmd, "quit") || !strcmp(cmd, "q")) {
+            break;
+        }
+        else if (!strcmp(cmd, "help") || !strcmp(cmd, "h")) {
+            debugHelp();
+        }
+        else {
+            printf("unknown command, type help for the list\n");
+        }
+    }
+    for (int i = 0; i < dbg->numSnapshots; ++i) {
+        free(dbg->snapshots[i].data);
+    }
+    free(dbg);
+}
+
+/*
+ * A batch: one job per manifest line, each a set of simulator options and a
+ * machine-code file, run on a pool of threads.
+ */
+typedef struct batchStruct {
+    int numJobs;
+    char **lines; // the manifest line of each job, as written
+    simConfigType *configs;
+    programType **programs;
+    statsType *results;
+} batchType;
+
+// The cycle --run-cycles stops at, or -1
+static int runUntil(const simulatorType *sim) {
+    return sim->config->runCycles > 0 ? sim->state->cycles + sim->config->runCycles : -1;
+}
 
+static void runBatchJob(void *ctx, int job) {
+    batchType *batch = ctx;
+    simulatorType sim;
+    simInit(&sim, &batch->configs[job], batch->programs[job]);
+    simRun(&sim, runUntil(&sim));
+    batch->results[job] = sim.stats;
+    simFree(&sim);
+}
 
-        /* --------------------- MEM stage --------------------- */
-        newState.MEMWB.instr = state.EXMEM.instr;
-        newState.MEMWB.opcode = opcode(state.EXMEM.instr);
-        newState.MEMWB.dest = state.EXMEM.dest;
-        newState.MEMWB.writeData = state.EXMEM.aluResult;
-        if (opcode(state.EXMEM.instr) == LW) {
-            newState.MEMWB.writeData = state.dataMem[state.EXMEM.aluResult];
+// The already loaded program named filename, or a newly loaded one
+static programType *findProgram(programType ***loaded, int *numLoaded, char *filename) {
+    for (int i = 0; i < *numLoaded; ++i) {
+        if (!strcmp((*loaded)[i]->filename, filename)) {
+            return (*loaded)[i];
         }
-        else if (opcode(state.EXMEM.instr) == SW) {
-            newState.dataMem[state.EXMEM.aluResult] = state.EXMEM.readRegB;
+    }
+    programType *program = malloc(sizeof(programType));
+    *loaded = realloc(*loaded, (*numLoaded + 1) * sizeof(programType *));
+    if (program == NULL || *loaded == NULL) {
+        printf("error: out of memory\n");
+        exit(1);
+    }
+    readMachineCode(program, filename, 0);
+    (*loaded)[(*numLoaded)++] = program;
+    return program;
+}
+
+/*
+ * Run every job of the manifest and write one stats record per job, in
+ * manifest order, to outFile (stdout if NULL). Options given on the
+ * command line apply to every job; the job's own options come on top.
+ */
+static void runBatch(char *manifest, const simConfigType *base, int numThreads, char *outFile) {
+    FILE *in = fopen(manifest, "r");
+    if (in == NULL) {
+        printf("error: can't open file %s\n", manifest);
+        exit(1);
+    }
+    batchType batch;
+    memset(&batch, 0, sizeof(batch));
+    programType **loaded = NULL;
+    int numLoaded = 0;
+    int maxJobs = 0;
+    char line[MAXLINELENGTH];
+    for (int lineNum = 1; fgets(line, MAXLINELENGTH, in) != NULL; ++lineNum) {
+        line[strcspn(line, "\r\n")] = '\0';
+        char *text = line + strspn(line, " \t");
+        if (*text == '\0' || *text == '#') {
+            continue;
         }
-        else if (opcode(state.EXMEM.instr) == BEQ) {
-            // If Taken:
-            if (state.EXMEM.eq == 1) { 
-                newState.IFID.instr = 0x1c00000;
-                newState.IDEX.instr = 0x1c00000;
-                newState.EXMEM.instr = 0x1c00000;
-                newState.pc = state.EXMEM.branchTarget;
+        if (batch.numJobs == maxJobs) {
+            maxJobs = maxJobs ? 2 * maxJobs : 64;
+            batch.lines = realloc(batch.lines, maxJobs * sizeof(char *));
+            batch.configs = realloc(batch.configs, maxJobs * sizeof(simConfigType));
+            batch.programs = realloc(batch.programs, maxJobs * sizeof(programType *));
+            if (batch.lines == NULL || batch.configs == NULL || batch.programs == NULL) {
+                printf("error: out of memory\n");
+                exit(1);
             }
         }
-        
+        int job = batch.numJobs++;
+        batch.lines[job] = strdup(text);
 
-        /* ---------------------- WB stage --------------------- */
-        newState.WBEND.instr = state.MEMWB.instr;
-        newState.WBEND.dest = state.MEMWB.dest;
-        newState.WBEND.writeData = state.MEMWB.writeData;
-        if (state.MEMWB.opcode == ADD || state.MEMWB.opcode == NOR || state.MEMWB.opcode == LW) {
-            newState.reg[state.MEMWB.dest] = state.MEMWB.writeData;
+        // split a second copy into an argv for parseOptions to keep
+        char *words = strdup(text);
+        char *args[MAXLINELENGTH / 2 + 1];
+        int numArgs = 0;
+        for (char *word = strtok(words, " \t"); word != NULL; word = strtok(NULL, " \t")) {
+            args[numArgs++] = word;
+        }
+        simConfigType *cfg = &batch.configs[job];
+        *cfg = *base;
+        if (parseOptions(cfg, numArgs, args, 0) != numArgs || cfg->filename == NULL) {
+            printf("error: %s line %d: bad job %s\n", manifest, lineNum, text);
+            exit(1);
+        }
+        if (cfg->traceLevel > TRACE_OFF || cfg->binaryTrace != NULL || cfg->addressTrace != NULL
+                || cfg->statsFile != NULL || cfg->profileFile != NULL
+                || cfg->checkpointEvery > 0 || cfg->checkpointPc >= 0 || cfg->debug) {
+            printf("error: %s line %d: batch jobs can't write traces, stats, profiles or checkpoints of their own\n",
+                    manifest, lineNum);
+            exit(1);
+        }
+        if (cfg->cores > 1) {
+            printf("error: %s line %d: batch jobs run on one core\n", manifest, lineNum);
+            exit(1);
+        }
+        batch.programs[job] = findProgram(&loaded, &numLoaded, cfg->filename);
+    }
+    fclose(in);
+
+    batch.results = calloc(batch.numJobs > 0 ? batch.numJobs : 1, sizeof(statsType));
+    if (batch.results == NULL) {
+        printf("error: out of memory\n");
+        exit(1);
+    }
+    batch_run(batch.numJobs, numThreads, runBatchJob, &batch);
+
+    FILE *out = stdout;
+    int format = STATS_JSON;
+    if (outFile != NULL) {
+        out = fopen(outFile, "w");
+        if (out == NULL) {
+            printf("error: can't open file %s\n", outFile);
+            exit(1);
         }
+        format = stats_format_for(outFile);
+    }
+    for (int job = 0; job < batch.numJobs; ++job) {
+        stats_write_job(out, format, &batch.results[job], job == 0, batch.lines[job]);
+    }
+    if (out != stdout) {
+        fclose(out);
+    }
+}
 
+/* ------------------------- multicore ------------------------- */
 
+/*
+ * A --cores run: one simulator instance per core, all running the same
+ * program, each on a host thread of its own with its own data memory and
+ * caches, and between them the shared L2 and L3 and the coherence that
+ * keeps their memories and caches in step (see coherence.h). The threads
+ * meet at a barrier after every quantum, where the last to arrive syncs.
+ */
+typedef struct multicoreStruct {
+    const simConfigType *config;
+    int numCores;
+    simulatorType cores[MAX_CORES];
+    cacheStruct *l2; // shared under the data caches, or NULL
+    cacheStruct *l3;
+    coherenceType coherence;
+    barrierType barrier;
+    int stopCycle; // where the current quantum ends
+    int done; // no quantum to come
+} multicoreType;
 
-        /* ------------------------ END ------------------------ */
-        state = newState; /* this is the last statement before end of the loop. It marks the end 
-        of the cycle and updates the current state with the values calculated in this cycle */
+// Memory below the shared levels, which only time: the data is in the cores' memories
+static int sharedMemAccess(void *ctx, int addr, int write_flag, int write_data) {
+    (void)ctx;
+    (void)addr;
+    (void)write_flag;
+    (void)write_data;
+    return 0;
+}
+
+// What a multicore run can't be combined with; cfg as the command line left it
+static void checkMulticore(const simConfigType *cfg) {
+    if ((cfg->dcacheOn && !cfg->l2On) || cfg->inclusion != INCLUDE_INCLUSIVE) {
+        printf("error: --cores needs an inclusive --l2 under --dcache, for the directory\n");
+        exit(1);
+    }
+    if (cfg->victimCache > 0) {
+        printf("error: --cores can't be combined with --victim-cache\n");
+        exit(1);
+    }
+    if (cfg->debug || cfg->fastForward > 0 || cfg->restoreFile != NULL || cfg->checkpointEvery > 0
+            || cfg->checkpointPc >= 0) {
+        printf("error: --cores can't be combined with --debug, --fast-forward or checkpoints\n");
+        exit(1);
+    }
+    if (traceLevel >= TRACE_DIFF || cfg->binaryTrace != NULL || cfg->addressTrace != NULL
+            || cfg->statsInterval > 0 || cfg->profileFile != NULL) {
+        printf("error: --cores only traces the final state, and writes stats only at the end\n");
+        exit(1);
     }
-    printf("machine halted\n");
-    printf("total of %d cycles executed\n", state.cycles);
-    printf("final state of machine:\n");
-    printState(&state);
 }
 
-void printInstruction(int instr) {
-    switch (opcode(instr)) {
-        case ADD:
-            printf("add");
-            break;
-        case NOR:
-            printf("nor");
-            break;
-        case LW:
-            printf("lw");
-            break;
-        case SW:
-            printf("sw");
-            break;
-        case BEQ:
-            printf("beq");
-            break;
-        case JALR:
-            printf("jalr");
-            break;
-        case HALT:
-            printf("halt");
-            break;
-        case NOOP:
-            printf("noop");
+// Between quanta, on the last core's thread to get there: sync and set up the next one
+static void multicoreSync(void *ctx) {
+    multicoreType *mc = ctx;
+    coherence_sync(&mc->coherence);
+    int running = 0;
+    for (int i = 0; i < mc->numCores; ++i) {
+        running |= !simHalted(&mc->cores[i]);
+    }
+    long long limit = mc->config->runCycles;
+    if (!running || mc->stopCycle == limit) {
+        mc->done = 1;
+        return;
+    }
+    mc->stopCycle += mc->config->quantum;
+    if (limit > 0 && mc->stopCycle > limit) {
+        mc->stopCycle = (int)limit;
+    }
+}
+
+static void runCore(void *ctx, int job) {
+    multicoreType *mc = ctx;
+    simulatorType *sim = &mc->cores[job];
+    int sense = 0;
+    while (!mc->done) {
+        if (!simHalted(sim)) {
+            simRun(sim, mc->stopCycle);
+        }
+        batch_barrier_wait(&mc->barrier, &sense, multicoreSync, mc);
+    }
+}
+
+// The summaries main prints for a single core, once per core, then the shared levels'
+static void printMulticore(multicoreType *mc) {
+    int halted = 1;
+    int cycles = 0;
+    for (int i = 0; i < mc->numCores; ++i) {
+        halted &= simHalted(&mc->cores[i]);
+        if (mc->cores[i].state->cycles > cycles) {
+            cycles = mc->cores[i].state->cycles;
+        }
+    }
+    trace_puts(halted ? "machine halted\n" : "cycle limit reached\n");
+    trace_puts("total of ");
+    trace_putint(cycles);
+    trace_puts(" cycles executed\n");
+
+    char name[32];
+    char line[256];
+    for (int i = 0; i < mc->numCores; ++i) {
+        simulatorType *sim = &mc->cores[i];
+        const statsType *stats = &sim->stats;
+        snprintf(line, sizeof(line), "core%d: %s after %d cycles, %lld instructions retired\n", i,
+                simHalted(sim) ? "halted" : "stopped", sim->state->cycles, stats->retired);
+        trace_puts(line);
+        if (sim->predictor.kind != PREDICT_NOT_TAKEN) {
+            snprintf(line, sizeof(line), "core%d %s predictor: %lld branches, %lld mispredicted\n", i,
+                    bpred_name(sim->predictor.kind), stats->branches, stats->branchFlushes);
+            trace_puts(line);
+        }
+        if (sim->icache != NULL) {
+            snprintf(name, sizeof(name), "core%d icache", i);
+            printCacheSummary(name, sim->icache, stats->fetchStallCycles);
+        }
+        if (sim->dcache != NULL) {
+            snprintf(name, sizeof(name), "core%d dcache", i);
+            printCacheSummary(name, sim->dcache, stats->memStallCycles);
+            const coreCoherenceType *core = &mc->coherence.cores[i];
+            snprintf(line, sizeof(line), "core%d coherence (%s): %lld reads, %lld read-exclusives, %lld upgrades, %lld writebacks, %lld invalidations, %lld interventions\n",
+                    i, coherence_protocol_name(mc->coherence.protocol), core->reads,
+                    core->readExclusives, core->upgrades, core->writebacks, core->invalidations,
+                    core->interventions);
+            trace_puts(line);
+        }
+    }
+    if (mc->l2 != NULL) {
+        printLevelSummary("l2", mc->l2);
+    }
+    if (mc->l3 != NULL) {
+        printLevelSummary("l3", mc->l3);
+    }
+    if (traceLevel >= TRACE_FINAL) {
+        for (int i = 0; i < mc->numCores; ++i) {
+            snprintf(line, sizeof(line), "final state of core%d:\n", i);
+            trace_puts(line);
+            printState(mc->cores[i].state);
+        }
+    }
+}
+
+/*
+ * Run program on cfg->cores cores to the end (or --run-cycles), print the
+ * summaries and write one stats record per core, tagged core0, core1 and
+ * so on, with the coherence counters and the shared levels' in each.
+ */
+static void runMulticore(const simConfigType *cfg, const programType *program) {
+    multicoreType *mc = calloc(1, sizeof(multicoreType));
+    if (mc == NULL) {
+        printf("error: out of memory\n");
+        exit(1);
+    }
+    mc->config = cfg;
+    mc->numCores = cfg->cores;
+    if (cfg->l2On) {
+        mc->l2 = newCache(cfg->l2Geometry, cfg->cachePolicy, sharedMemAccess, NULL, NULL);
+        cacheSetLatency(mc->l2, cfg->l2HitLatency, cfg->l2MissLatency);
+    }
+    if (cfg->l3On) {
+        mc->l3 = newCache(cfg->l3Geometry, cfg->cachePolicy, sharedMemAccess, NULL, NULL);
+        cacheSetLatency(mc->l3, cfg->l3HitLatency, cfg->l3MissLatency);
+        cacheSetNext(mc->l2, mc->l3, INCLUDE_INCLUSIVE);
+    }
+    coherence_init(&mc->coherence, cfg->coherence, cfg->cores, mc->l2);
+    for (int i = 0; i < cfg->cores; ++i) {
+        simulatorType *sim = &mc->cores[i];
+        simSetup(sim, cfg, program);
+        sim->state->reg[7] = i; // so the program can tell the cores apart
+        sim->coherence = &mc->coherence;
+        sim->coreId = i;
+        coherence_attach(&mc->coherence, i, sim->dcache, &sim->dataMem);
+    }
+
+    mc->stopCycle = cfg->quantum;
+    if (cfg->runCycles > 0 && cfg->runCycles < cfg->quantum) {
+        mc->stopCycle = (int)cfg->runCycles;
+    }
+    batch_barrier_init(&mc->barrier, cfg->cores);
+    batch_run(cfg->cores, cfg->cores, runCore, mc);
+
+    printMulticore(mc);
+    if (cfg->statsFile != NULL) {
+        FILE *out = fopen(cfg->statsFile, "w");
+        if (out == NULL) {
+            printf("error: can't open file %s\n", cfg->statsFile);
+            exit(1);
+        }
+        for (int i = 0; i < cfg->cores; ++i) {
+            statsType *stats = &mc->cores[i].stats;
+            const coreCoherenceType *core = &mc->coherence.cores[i];
+            collectCacheStats(stats, NULL, NULL, mc->l2, mc->l3);
+            stats->coherenceReads = core->reads;
+            stats->coherenceReadExclusives = core->readExclusives;
+            stats->coherenceUpgrades = core->upgrades;
+            stats->coherenceWritebacks = core->writebacks;
+            stats->coherenceInvalidations = core->invalidations;
+            stats->coherenceInterventions = core->interventions;
+            char job[16];
+            snprintf(job, sizeof(job), "core%d", i);
+            stats_write_job(out, stats_format_for(cfg->statsFile), stats, i == 0, job);
+        }
+        fclose(out);
+    }
+
+    for (int i = 0; i < cfg->cores; ++i) {
+        simFree(&mc->cores[i]);
+    }
+    coherence_free(&mc->coherence);
+    cacheStruct *levels[2] = {mc->l2, mc->l3};
+    for (int i = 0; i < 2; ++i) {
+        if (levels[i] != NULL) {
+            cacheFree(levels[i]);
+            free(levels[i]);
+        }
+    }
+    free(mc);
+}
+
+int main(int argc, char *argv[]) {
+    simConfigType cfg;
+    defaultConfig(&cfg);
+    char *manifest = NULL;
+    char *batchOut = NULL;
+    int numThreads = 0;
+
+    trace_init_from_env(TRACE_KIND_PIPELINE);
+    for (int i = 1; i < argc; ++i) {
+        i = parseOptions(&cfg, argc, argv, i);
+        if (i == argc) {
             break;
-        default:
-            printf(".fill %d", instr);
-            return;
+        }
+        if (!strcmp(argv[i], "--batch") && i + 1 < argc) {
+            manifest = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--jobs") && i + 1 < argc) {
+            numThreads = atoi(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "--batch-out") && i + 1 < argc) {
+            batchOut = argv[++i];
+        }
+        else {
+            usage(argv[0]);
+        }
+    }
+
+    if (manifest != NULL) {
+        if (cfg.filename != NULL) {
+            usage(argv[0]);
+        }
+        // the jobs share the trace stream, so keep them all quiet
+        traceLevel = TRACE_OFF;
+        runBatch(manifest, &cfg, numThreads > 0 ? numThreads : batch_default_threads(), batchOut);
+        trace_close();
+        return 0;
+    }
+    if (cfg.filename == NULL) {
+        usage(argv[0]);
+    }
+    if (cfg.debug) {
+        // going back re-simulates cycles, which would repeat these records
+        if (cfg.binaryTrace != NULL || cfg.addressTrace != NULL || cfg.statsInterval > 0) {
+            printf("error: --debug can't be combined with --trace-binary, --addr-trace or --stats-interval\n");
+            exit(1);
+        }
+        if (cfg.traceLevel < 0) {
+            cfg.traceLevel = TRACE_OFF;
+        }
+    }
+    if (cfg.cores > 1 && cfg.traceLevel < 0) {
+        // the cores would only take turns at writing a per-cycle trace
+        cfg.traceLevel = TRACE_FINAL;
+    }
+    if (cfg.traceLevel >= 0) {
+        traceLevel = cfg.traceLevel;
+    }
+    if (cfg.cores > 1) {
+        checkMulticore(&cfg);
+    }
+
+    programType program;
+    readMachineCode(&program, cfg.filename, traceLevel >= TRACE_DIFF && !cfg.quietLoad);
+    if (cfg.cores > 1) {
+        runMulticore(&cfg, &program);
+        trace_close();
+        free(program.instrMem);
+        free(program.decoded);
+        return 0;
+    }
+
+    simulatorType sim;
+    simInit(&sim, &cfg, &program);
+    if (cfg.restoreFile != NULL) {
+        trace_puts("restored ");
+        trace_puts(cfg.restoreFile);
+        trace_puts(" at cycle ");
+        trace_putint(sim.state->cycles);
+        trace_puts("\n");
+    }
+    else if (cfg.fastForward > 0) {
+        trace_puts("fast-forwarded ");
+        trace_putlong(sim.fastForwarded);
+        trace_puts(" instructions\n");
+    }
+
+    if (cfg.addressTrace != NULL) {
+        trace_open_address(cfg.addressTrace);
+    }
+    if (cfg.binaryTrace != NULL) {
+        trace_open_binary(cfg.binaryTrace, TRACE_KIND_PIPELINE);
+    }
+    if (traceBinary != NULL) {
+        trace_write_program(program.instrMem, program.numMemory);
     }
-    printf(" %d %d %d", field0(instr), field1(instr), field2(instr));
+
+    sim.statsFormat = STATS_JSON;
+    if (cfg.statsFile != NULL) {
+        sim.statsOut = fopen(cfg.statsFile, "w");
+        if (sim.statsOut == NULL) {
+            printf("error: can't open file %s\n", cfg.statsFile);
+            exit(1);
+        }
+        sim.statsFormat = stats_format_for(cfg.statsFile);
+    }
+
+    if (cfg.debug) {
+        debugSession(&sim);
+    }
+    else {
+        simRun(&sim, runUntil(&sim));
+    }
+
+    stateType *state = sim.state;
+    statsType *stats = &sim.stats;
+    if (program.decoded->opcode[state->MEMWB.instrIdx] == HALT) {
+        trace_puts("machine halted\n");
+    }
+    else {
+        trace_puts("cycle limit reached\n");
+    }
+    trace_puts("total of ");
+    trace_putint(state->cycles);
+    trace_puts(" cycles executed\n");
+    if (sim.predictor.kind != PREDICT_NOT_TAKEN) {
+        trace_puts(bpred_name(sim.predictor.kind));
+        trace_puts(" predictor: ");
+        trace_putlong(stats->branches);
+        trace_puts(" branches, ");
+        trace_putlong(stats->branchFlushes);
+        trace_puts(" mispredicted\n");
+    }
+    if (sim.icache != NULL) {
+        printCacheSummary("icache", sim.icache, stats->fetchStallCycles);
+    }
+    if (sim.dcache != NULL) {
+        printCacheSummary("dcache", sim.dcache, stats->memStallCycles);
+    }
+    if (sim.l2 != NULL) {
+        printLevelSummary("l2", sim.l2);
+    }
+    if (sim.l3 != NULL) {
+        printLevelSummary("l3", sim.l3);
+    }
+    if (traceLevel >= TRACE_FINAL) {
+        trace_puts("final state of machine:\n");
+        printState(state);
+    }
+    if (sim.statsOut != NULL) {
+        stats_write(sim.statsOut, sim.statsFormat, stats, sim.statsRecords == 0);
+        fclose(sim.statsOut);
+    }
+    if (cfg.profileFile != NULL) {
+        FILE *profileOut = fopen(cfg.profileFile, "w");
+        if (profileOut == NULL) {
+            printf("error: can't open file %s\n", cfg.profileFile);
+            exit(1);
+        }
+        stats_write_profile(profileOut, stats_format_for(cfg.profileFile), stats, state->instrMem, NUMMEMORY);
+        fclose(profileOut);
+    }
+    if (traceBinary != NULL) {
+        traceStateType finalTrace;
+        trace_write_halt(state->cycles);
+        snapshotState(state, &finalTrace);
+        trace_write_state(&finalTrace);
+    }
+    trace_close();
+    simFree(&sim);
+    free(program.instrMem);
+    free(program.decoded);
+}
+
+// Copy out everything printState shows, with raw instruction words
+void snapshotState(stateType *statePtr, traceStateType *st) {
+    decodeType *dec = statePtr->decoded;
+    st->cycles = statePtr->cycles;
+    st->pc = statePtr->pc;
+    memcpy(st->reg, statePtr->reg, sizeof(st->reg));
+    st->ifidInstr = dec->word[statePtr->IFID.instrIdx];
+    st->ifidPcPlus1 = statePtr->IFID.pcPlus1;
+    st->idexInstr = dec->word[statePtr->IDEX.instrIdx];
+    st->idexPcPlus1 = statePtr->IDEX.pcPlus1;
+    st->idexReadRegA = statePtr->IDEX.readRegA;
+    st->idexReadRegB = statePtr->IDEX.readRegB;
+    st->idexOffset = statePtr->IDEX.offset;
+    st->exmemInstr = dec->word[statePtr->EXMEM.instrIdx];
+    st->exmemBranchTarget = statePtr->EXMEM.branchTarget;
+    st->exmemEq = statePtr->EXMEM.eq;
+    st->exmemAluResult = statePtr->EXMEM.aluResult;
+    st->exmemReadRegB = statePtr->EXMEM.readRegB;
+    st->memwbInstr = dec->word[statePtr->MEMWB.instrIdx];
+    st->memwbWriteData = statePtr->MEMWB.writeData;
+    st->wbendInstr = dec->word[statePtr->WBEND.instrIdx];
+    st->wbendWriteData = statePtr->WBEND.writeData;
 }
 
 void printState(stateType *statePtr) {
-    printf("\n@@@\n");
-    printf("state before cycle %d starts:\n", statePtr->cycles);
-    printf("\tpc = %d\n", statePtr->pc);
-
-    printf("\tdata memory:\n");
-    for (int i=0; i<statePtr->numMemory; ++i) {
-        printf("\t\tdataMem[ %d ] = %d\n", i, statePtr->dataMem[i]);
-    }
-    printf("\tregisters:\n");
-    for (int i=0; i<NUMREGS; ++i) {
-        printf("\t\treg[ %d ] = %d\n", i, statePtr->reg[i]);
-    }
-
-    // IF/ID
-    printf("\tIF/ID pipeline register:\n");
-    printf("\t\tinstruction = %d ( ", statePtr->IFID.instr);
-    printInstruction(statePtr->IFID.instr);
-    printf(" )\n");
-    printf("\t\tpcPlus1 = %d", statePtr->IFID.pcPlus1);
-    if(opcode(statePtr->IFID.instr) == NOOP){
-        printf(" (Don't Care)");
-    }
-    
-    printf("\n");
-    
-    // ID/EX
-    int idexOp = opcode(statePtr->IDEX.instr);
-    printf("\tID/EX pipeline register:\n");
-    printf("\t\tinstruction = %d ( ", statePtr->IDEX.instr);
-    printInstruction(statePtr->IDEX.instr);
-    printf(" )\n");
-    printf("\t\tpcPlus1 = %d", statePtr->IDEX.pcPlus1);
-    if(idexOp == NOOP){
-        printf(" (Don't Care)");
-    }
-    printf("\n");
-    printf("\t\treadRegA = %d", statePtr->IDEX.readRegA);
-    if (idexOp >= HALT || idexOp < 0) {
-        printf(" (Don't Care)");
-    }
-    printf("\n");
-    printf("\t\treadRegB = %d", statePtr->IDEX.readRegB);
-    if(idexOp == LW || idexOp > BEQ || idexOp < 0) {
-        printf(" (Don't Care)");
-    }
-    printf("\n");
-    printf("\t\toffset = %d", statePtr->IDEX.offset);
-    if (idexOp != LW && idexOp != SW && idexOp != BEQ) {
-        printf(" (Don't Care)");
-    }
-    printf("\n");
-
-    // EX/MEM
-    int exmemOp = opcode(statePtr->EXMEM.instr);
-    printf("\tEX/MEM pipeline register:\n");
-    printf("\t\tinstruction = %d ( ", statePtr->EXMEM.instr);
-    printInstruction(statePtr->EXMEM.instr);
-    printf(" )\n");
-    printf("\t\tbranchTarget %d", statePtr->EXMEM.branchTarget);
-    if (exmemOp != BEQ) {
-        printf(" (Don't Care)");
-    }
-    printf("\n");
-    printf("\t\teq ? %s", (statePtr->EXMEM.eq ? "True" : "False"));
-    if (exmemOp != BEQ) {
-        printf(" (Don't Care)");
-    }
-    printf("\n");
-    printf("\t\taluResult = %d", statePtr->EXMEM.aluResult);
-    if (exmemOp > SW || exmemOp < 0) {
-        printf(" (Don't Care)");
-    }
-    printf("\n");
-    printf("\t\treadRegB = %d", statePtr->EXMEM.readRegB);
-    if (exmemOp != SW) {
-        printf(" (Don't Care)");
-    }
-    printf("\n");
-
-    // MEM/WB
-	int memwbOp = opcode(statePtr->MEMWB.instr);
-    printf("\tMEM/WB pipeline register:\n");
-    printf("\t\tinstruction = %d ( ", statePtr->MEMWB.instr);
-    printInstruction(statePtr->MEMWB.instr);
-    printf(" )\n");
-    printf("\t\twriteData = %d", statePtr->MEMWB.writeData);
-    if (memwbOp >= SW || memwbOp < 0) {
-        printf(" (Don't Care)");
-    }
-    printf("\n");     
-
-    // WB/END
-	int wbendOp = opcode(statePtr->WBEND.instr);
-    printf("\tWB/END pipeline register:\n");
-    printf("\t\tinstruction = %d ( ", statePtr->WBEND.instr);
-    printInstruction(statePtr->WBEND.instr);
-    printf(" )\n");
-    printf("\t\twriteData = %d", statePtr->WBEND.writeData);
-    if (wbendOp >= SW || wbendOp < 0) {
-        printf(" (Don't Care)");
-    }
-    printf("\n");
-
-    printf("end state\n");
-}
-
-// File
-#define MAXLINELENGTH 1000 // MAXLINELENGTH is the max number of characters we read
+    traceStateType st;
+    snapshotState(statePtr, &st);
+    // the dump covers the words the program was loaded into
+    int *words = trace_state_words(statePtr->numMemory + 1);
+    memory_read_range(statePtr->dataMem, 0, words, statePtr->numMemory);
+    trace_print_state(&st, words, statePtr->numMemory);
+}
 
-void readMachineCode(stateType *state, char* filename) {
-    char line[MAXLINELENGTH];
-    FILE *filePtr = fopen(filename, "r");
-    if (filePtr == NULL) {
-        printf("error: can't open file %s", filename);
+/*
+ * Load the program in filename, in either format, and decode it. With
+ * listing, print the instruction memory as the trace has always shown it.
+ */
+void readMachineCode(programType *program, char* filename, int listing) {
+    program->filename = filename;
+    program->instrMem = calloc(NUMMEMORY, sizeof(int));
+    program->decoded = malloc(sizeof(decodeType));
+    if (program->instrMem == NULL || program->decoded == NULL) {
+        printf("error: out of memory\n");
         exit(1);
     }
+    program->numMemory = image_load(filename, program->instrMem, NUMMEMORY);
 
-    printf("instruction memory:\n");
-    for (state->numMemory = 0; fgets(line, MAXLINELENGTH, filePtr) != NULL; ++state->numMemory) {
-        if (sscanf(line, "%d", state->instrMem+state->numMemory) != 1) {
-            printf("error in reading address %d\n", state->numMemory);
-            exit(1);
+    // the rest of memory holds 0, which decodes as add 0 0 0
+    memset(program->decoded, 0, sizeof(decodeType));
+    memset(program->decoded->writesReg, 1, NUMMEMORY);
+    for (int i = 0; i < program->numMemory; ++i) {
+        decodeInstruction(program->decoded, i, program->instrMem[i]);
+    }
+    decodeInstruction(program->decoded, NOOPINDEX, NOOPINSTRUCTION);
+
+    if (listing) {
+        trace_puts("instruction memory:\n");
+        for (int i = 0; i < program->numMemory; ++i) {
+            trace_puts("\tinstrMem[ ");
+            trace_putint(i);
+            trace_puts(" ] = ");
+            trace_print_instruction(program->instrMem[i]);
+            trace_puts("\n");
         }
-        printf("\tinstrMem[ %d ] = ", state->numMemory);
-        printInstruction(state->dataMem[state->numMemory] = state->instrMem[state->numMemory]);
-        printf("\n");
     }
-}
\ No newline at end of file
+}
@@ -0,0 +1,346 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "trace.h"
+
+/*
+ * Stack distance (Mattson) analysis of an address trace written with the
+ * simulator's --addr-trace. One pass gives the LRU miss count of every
+ * cache with the given block size: for one set, every power-of-two
+ * capacity, and for each set count up to --max-sets, every power-of-two
+ * associativity up to --max-ways.
+ *
+ * build: gcc -O2 -o stackdist stackdist.c trace.c
+ * usage: stackdist [--only instr|data] [--max-sets <n>] [--max-ways <n>]
+ *                  <blockSize> <trace file>
+ *
+ * The result is a CSV miss ratio curve table with one row per geometry,
+ * matching what the LRU cache in cache.c (or cachesim) reports for it.
+ *
+ * An access hits in an LRU cache of A ways exactly when fewer than A
+ * distinct blocks of its set were touched since the last access to its
+ * block. For one set that count comes from a Fenwick tree over access
+ * times holding a 1 at each block's latest access. With more sets, each
+ * set keeps a move-to-front stack only --max-ways deep.
+ */
+
+#define DEFAULT_MAX_SETS 1024
+#define DEFAULT_MAX_WAYS 16
+
+typedef struct lastUseStruct {
+    unsigned int block;
+    int time; // index of its latest access within the current window
+} lastUseType;
+
+typedef struct fullyAssocStruct {
+    // open addressing hash of blocks seen so far, at most half full
+    lastUseType *slots;
+    int *slotUsed;
+    unsigned int slotMask;
+    int numBlocks;
+
+    int *tree; // Fenwick tree over the window of access times
+    int window; // times available before the window has to be compacted
+    int now;
+
+    long long *hist; // hist[d]: accesses at stack distance d
+    int histSize;
+    long long cold; // first touches, a miss at every size
+} fullyAssocType;
+
+// One set count: numSets move-to-front stacks of up to maxWays blocks
+typedef struct setStacksStruct {
+    int numSets;
+    unsigned int *blocks;
+    int *used;
+    long long *hist; // hist[d] for d < maxWays
+} setStacksType;
+
+static void *allocOrDie(size_t size) {
+    void *p = calloc(1, size);
+    if (p == NULL) {
+        printf("error: out of memory\n");
+        exit(1);
+    }
+    return p;
+}
+
+static inline unsigned int hashBlock(unsigned int block) {
+    return block * 0x9e3779b1u;
+}
+
+static void fenwickAdd(fullyAssocType *fa, int i, int delta) {
+    for (++i; i <= fa->window; i += i & -i) {
+        fa->tree[i] += delta;
+    }
+}
+
+// Sum of the markers at times 0..i
+static int fenwickSum(fullyAssocType *fa, int i) {
+    int sum = 0;
+    for (++i; i > 0; i -= i & -i) {
+        sum += fa->tree[i];
+    }
+    return sum;
+}
+
+static void fullyAssocInit(fullyAssocType *fa) {
+    memset(fa, 0, sizeof(*fa));
+    fa->slotMask = 1023;
+    fa->slots = allocOrDie((fa->slotMask + 1) * sizeof(lastUseType));
+    fa->slotUsed = allocOrDie((fa->slotMask + 1) * sizeof(int));
+    fa->window = 1 << 20;
+    fa->tree = allocOrDie((fa->window + 1) * sizeof(int));
+    fa->histSize = 1024;
+    fa->hist = allocOrDie(fa->histSize * sizeof(long long));
+}
+
+// The slot of block, claimed for it if it is new; *isNew says which
+static lastUseType *findSlot(fullyAssocType *fa, unsigned int block, int *isNew) {
+    unsigned int slot = hashBlock(block) & fa->slotMask;
+    while (fa->slotUsed[slot] && fa->slots[slot].block != block) {
+        slot = (slot + 1) & fa->slotMask;
+    }
+    *isNew = !fa->slotUsed[slot];
+    fa->slotUsed[slot] = 1;
+    fa->slots[slot].block = block;
+    return &fa->slots[slot];
+}
+
+static void growSlots(fullyAssocType *fa) {
+    lastUseType *oldSlots = fa->slots;
+    int *oldUsed = fa->slotUsed;
+    unsigned int oldSize = fa->slotMask + 1;
+    fa->slotMask = 2 * oldSize - 1;
+    fa->slots = allocOrDie((fa->slotMask + 1) * sizeof(lastUseType));
+    fa->slotUsed = allocOrDie((fa->slotMask + 1) * sizeof(int));
+    int isNew;
+    for (unsigned int i = 0; i < oldSize; ++i) {
+        if (oldUsed[i]) {
+            findSlot(fa, oldSlots[i].block, &isNew)->time = oldSlots[i].time;
+        }
+    }
+    free(oldSlots);
+    free(oldUsed);
+}
+
+static int compareTime(const void *a, const void *b) {
+    return (*(lastUseType *const *)a)->time - (*(lastUseType *const *)b)->time;
+}
+
+/*
+ * The window of access times is full. Renumber the blocks' latest
+ * accesses 0..numBlocks-1, keeping their order, and rebuild the tree in a
+ * window at least four times that size.
+ */
+static void compactWindow(fullyAssocType *fa) {
+    lastUseType **order = allocOrDie(fa->numBlocks * sizeof(lastUseType *));
+    int n = 0;
+    for (unsigned int i = 0; i <= fa->slotMask; ++i) {
+        if (fa->slotUsed[i]) {
+            order[n++] = &fa->slots[i];
+        }
+    }
+    qsort(order, n, sizeof(lastUseType *), compareTime);
+    for (int i = 0; i < n; ++i) {
+        order[i]->time = i;
+    }
+    free(order);
+
+    if (fa->window < 4 * n) {
+        fa->window = 4 * n;
+    }
+    free(fa->tree);
+    fa->tree = allocOrDie((fa->window + 1) * sizeof(int));
+    for (int i = 1; i <= fa->window; ++i) {
+        fa->tree[i] += (i <= n);
+        int parent = i + (i & -i);
+        if (parent <= fa->window) {
+            fa->tree[parent] += fa->tree[i];
+        }
+    }
+    fa->now = n;
+}
+
+static void fullyAssocAccess(fullyAssocType *fa, unsigned int block) {
+    if (fa->now == fa->window) {
+        compactWindow(fa);
+    }
+    if (2 * (fa->numBlocks + 1) > (int)(fa->slotMask + 1)) {
+        growSlots(fa);
+    }
+    int isNew;
+    lastUseType *last = findSlot(fa, block, &isNew);
+    if (isNew) {
+        fa->numBlocks++;
+        fa->cold++;
+    }
+    else {
+        int distance = fenwickSum(fa, fa->now - 1) - fenwickSum(fa, last->time);
+        fenwickAdd(fa, last->time, -1);
+        if (distance >= fa->histSize) {
+            int newSize = fa->histSize;
+            while (newSize <= distance) {
+                newSize *= 2;
+            }
+            fa->hist = realloc(fa->hist, newSize * sizeof(long long));
+            if (fa->hist == NULL) {
+                printf("error: out of memory\n");
+                exit(1);
+            }
+            memset(fa->hist + fa->histSize, 0, (newSize - fa->histSize) * sizeof(long long));
+            fa->histSize = newSize;
+        }
+        fa->hist[distance]++;
+    }
+    last->time = fa->now;
+    fenwickAdd(fa, fa->now, 1);
+    fa->now++;
+}
+
+static inline void setStacksAccess(setStacksType *ss, int maxWays, unsigned int block) {
+    int set = block & (ss->numSets - 1);
+    unsigned int *stack = ss->blocks + (size_t)set * maxWays;
+    int used = ss->used[set];
+    int pos;
+    for (pos = 0; pos < used; ++pos) {
+        if (stack[pos] == block) {
+            break;
+        }
+    }
+    if (pos < used) {
+        ss->hist[pos]++;
+    }
+    else if (used < maxWays) {
+        ss->used[set] = ++used;
+    }
+    else {
+        pos = maxWays - 1; // falls off the bottom
+    }
+    memmove(stack + 1, stack, pos * sizeof(unsigned int));
+    stack[0] = block;
+}
+
+static void printRow(int blockSize, int sets, int ways, long long accesses, long long hits) {
+    long long misses = accesses - hits;
+    printf("%d,%d,%d,%lld,%lld,%lld,%.6f\n", blockSize, sets, ways, (long long)sets * ways,
+            accesses, misses, accesses ? (double)misses / accesses : 0.0);
+}
+
+static int isPowerOfTwo(int n) {
+    return n > 0 && (n & (n - 1)) == 0;
+}
+
+static void usage(char *name) {
+    printf("error: usage: %s [--only instr|data] [--max-sets <n>] [--max-ways <n>] <blockSize> <trace file>\n", name);
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    int only = -1; // -1 all accesses, 0 data only, 1 fetches only
+    int maxSets = DEFAULT_MAX_SETS;
+    int maxWays = DEFAULT_MAX_WAYS;
+    char *blockArg = NULL;
+    char *filename = NULL;
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--only") && i + 1 < argc) {
+            ++i;
+            if (!strcmp(argv[i], "instr")) {
+                only = 1;
+            }
+            else if (!strcmp(argv[i], "data")) {
+                only = 0;
+            }
+            else {
+                usage(argv[0]);
+            }
+        }
+        else if (!strcmp(argv[i], "--max-sets") && i + 1 < argc) {
+            maxSets = atoi(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "--max-ways") && i + 1 < argc) {
+            maxWays = atoi(argv[++i]);
+        }
+        else if (blockArg == NULL && argv[i][0] != '-') {
+            blockArg = argv[i];
+        }
+        else if (filename == NULL && argv[i][0] != '-') {
+            filename = argv[i];
+        }
+        else {
+            usage(argv[0]);
+        }
+    }
+    if (filename == NULL) {
+        usage(argv[0]);
+    }
+    int blockSize = atoi(blockArg);
+    if (!isPowerOfTwo(blockSize) || !isPowerOfTwo(maxSets) || !isPowerOfTwo(maxWays)) {
+        printf("error: block size, --max-sets and --max-ways must be powers of two\n");
+        exit(1);
+    }
+    int offsetBits = 0;
+    while ((1 << offsetBits) != blockSize) {
+        offsetBits++;
+    }
+
+    size_t numRecords;
+    const unsigned int *records = trace_map_address(filename, &numRecords);
+
+    fullyAssocType fa;
+    fullyAssocInit(&fa);
+    // levels[k] has 2^(k+1) sets; one set is handled by fa
+    int numLevels = 0;
+    while ((2 << numLevels) <= maxSets) {
+        numLevels++;
+    }
+    setStacksType *levels = allocOrDie((numLevels + 1) * sizeof(setStacksType));
+    for (int k = 0; k < numLevels; ++k) {
+        levels[k].numSets = 2 << k;
+        levels[k].blocks = allocOrDie((size_t)levels[k].numSets * maxWays * sizeof(unsigned int));
+        levels[k].used = allocOrDie(levels[k].numSets * sizeof(int));
+        levels[k].hist = allocOrDie(maxWays * sizeof(long long));
+    }
+
+    long long accesses = 0;
+    int shift = TRACE_ACCESS_BITS + offsetBits;
+    for (size_t i = 0; i < numRecords; ++i) {
+        unsigned int record = records[i];
+        int type = record & TRACE_ACCESS_MASK;
+        if (only >= 0 && (type == TRACE_ACCESS_FETCH) != only) {
+            continue;
+        }
+        accesses++;
+        unsigned int block = record >> shift;
+        fullyAssocAccess(&fa, block);
+        for (int k = 0; k < numLevels; ++k) {
+            setStacksAccess(&levels[k], maxWays, block);
+        }
+    }
+
+    printf("blockSize,sets,ways,blocks,accesses,misses,missRatio\n");
+    // one set: every power-of-two capacity until everything fits
+    long long hits = 0;
+    int distance = 0;
+    for (int ways = 1; ; ways *= 2) {
+        for (; distance < ways && distance < fa.histSize; ++distance) {
+            hits += fa.hist[distance];
+        }
+        printRow(blockSize, 1, ways, accesses, hits);
+        if (ways >= fa.numBlocks) {
+            break;
+        }
+    }
+    for (int k = 0; k < numLevels; ++k) {
+        hits = 0;
+        distance = 0;
+        for (int ways = 1; ways <= maxWays; ways *= 2) {
+            for (; distance < ways; ++distance) {
+                hits += levels[k].hist[distance];
+            }
+            printRow(blockSize, levels[k].numSets, ways, accesses, hits);
+        }
+    }
+    return 0;
+}
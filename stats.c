@@ -0,0 +1,230 @@
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "checkpoint.h"
+#include "stats.h"
+
+// A file name ending in .csv selects CSV, anything else gets JSON
+int stats_format_for(const char *filename) {
+    size_t len = strlen(filename);
+    if (len >= 4 && !strcmp(filename + len - 4, ".csv")) {
+        return STATS_CSV;
+    }
+    return STATS_JSON;
+}
+
+void stats_enable_profile(statsType *stats, int numEntries) {
+    stats->pcStalls = calloc(numEntries, sizeof(unsigned int));
+    stats->pcFlushes = calloc(numEntries, sizeof(unsigned int));
+    if (stats->pcStalls == NULL || stats->pcFlushes == NULL) {
+        printf("error: out of memory\n");
+        exit(1);
+    }
+}
+
+void stats_free(statsType *stats) {
+    free(stats->pcStalls);
+    free(stats->pcFlushes);
+    stats->pcStalls = NULL;
+    stats->pcFlushes = NULL;
+}
+
+// The counters are the long longs in front of the profile pointers
+#define NUM_COUNTERS ((int)(offsetof(statsType, pcStalls) / sizeof(long long)))
+
+/*
+ * Write the counters and, if it is being kept, the nonzero entries of the
+ * profile of numEntries addresses.
+ */
+void stats_save(const statsType *stats, int numEntries, FILE *out) {
+    ckpt_write_int(out, CKPT_SECTION_STATS);
+    ckpt_write_int(out, NUM_COUNTERS);
+    ckpt_write(out, stats, NUM_COUNTERS * sizeof(long long));
+    int used = 0;
+    for (int pc = 0; stats->pcStalls != NULL && pc < numEntries; ++pc) {
+        used += stats->pcStalls[pc] != 0 || stats->pcFlushes[pc] != 0;
+    }
+    ckpt_write_int(out, stats->pcStalls != NULL ? used : -1);
+    for (int pc = 0; stats->pcStalls != NULL && pc < numEntries; ++pc) {
+        if (stats->pcStalls[pc] != 0 || stats->pcFlushes[pc] != 0) {
+            unsigned int entry[3] = {pc, stats->pcStalls[pc], stats->pcFlushes[pc]};
+            ckpt_write(out, entry, sizeof(entry));
+        }
+    }
+}
+
+// Read back what stats_save wrote; a profile needs one in the checkpoint
+void stats_restore(statsType *stats, int numEntries, FILE *in) {
+    ckpt_expect(in, CKPT_SECTION_STATS, "section");
+    ckpt_expect(in, NUM_COUNTERS, "counter count");
+    ckpt_read(in, stats, NUM_COUNTERS * sizeof(long long));
+    int used = ckpt_read_int(in);
+    if (used < 0 && stats->pcStalls != NULL) {
+        printf("error: checkpoint was taken without a profile\n");
+        exit(1);
+    }
+    for (int i = 0; i < used; ++i) {
+        unsigned int entry[3];
+        ckpt_read(in, entry, sizeof(entry));
+        if (entry[0] >= (unsigned int)numEntries) {
+            printf("error: checkpoint profile address %u out of range\n", entry[0]);
+            exit(1);
+        }
+        if (stats->pcStalls != NULL) {
+            stats->pcStalls[entry[0]] = entry[1];
+            stats->pcFlushes[entry[0]] = entry[2];
+        }
+    }
+}
+
+void stats_write(FILE *out, int format, const statsType *stats, int header) {
+    stats_write_job(out, format, stats, header, NULL);
+}
+
+// Write s as a quoted JSON or CSV string
+static void writeQuoted(FILE *out, int format, const char *s) {
+    fputc('"', out);
+    for (; *s; ++s) {
+        if (*s == '"') {
+            fputs(format == STATS_CSV ? "\"\"" : "\\\"", out);
+        }
+        else if (*s == '\\' && format != STATS_CSV) {
+            fputs("\\\\", out);
+        }
+        else {
+            fputc(*s, out);
+        }
+    }
+    fputc('"', out);
+}
+
+/*
+ * Write one record of the counters: a JSON object on a line of its own, or
+ * a CSV row (preceded by the column names when header is set). A job name,
+ * if given, comes first as a "job" field.
+ */
+void stats_write_job(FILE *out, int format, const statsType *stats, int header,
+        const char *job) {
+    double cpi = stats->retired ? (double)stats->cycles / stats->retired : 0.0;
+    double mispredictRate = stats->branches ? (double)stats->branchFlushes / stats->branches : 0.0;
+    long long icacheAccesses = stats->icacheHits + stats->icacheMisses;
+    long long dcacheAccesses = stats->dcacheHits + stats->dcacheMisses;
+    double icacheHitRate = icacheAccesses ? (double)stats->icacheHits / icacheAccesses : 0.0;
+    double dcacheHitRate = dcacheAccesses ? (double)stats->dcacheHits / dcacheAccesses : 0.0;
+    if (format == STATS_CSV) {
+        if (header) {
+            fprintf(out, "%scycles,retired,cpi,loadUseStalls,branches,branchFlushes,"
+                    "mispredictRate,forwardEXMEM,forwardMEMWB,forwardWBEND,"
+                    "icacheHits,icacheMisses,icacheHitRate,dcacheHits,dcacheMisses,"
+                    "dcacheHitRate,fetchStallCycles,memStallCycles,"
+                    "icachePrefetches,icachePrefetchUseful,icachePrefetchLate,icachePrefetchPolluting,"
+                    "dcachePrefetches,dcachePrefetchUseful,dcachePrefetchLate,dcachePrefetchPolluting,"
+                    "dcacheMemReads,dcacheMemWrites,"
+                    "icacheVictimHits,icacheVictimEvictions,dcacheVictimHits,dcacheVictimEvictions,"
+                    "l2Hits,l2Misses,l2Writebacks,l3Hits,l3Misses,l3Writebacks,"
+                    "coherenceReads,coherenceReadExclusives,coherenceUpgrades,coherenceWritebacks,"
+                    "coherenceInvalidations,coherenceInterventions\n",
+                    job != NULL ? "job," : "");
+        }
+        if (job != NULL) {
+            writeQuoted(out, format, job);
+            fputc(',', out);
+        }
+        fprintf(out, "%lld,%lld,%.4f,%lld,%lld,%lld,%.4f,%lld,%lld,%lld,"
+                "%lld,%lld,%.4f,%lld,%lld,%.4f,%lld,%lld,"
+                "%lld,%lld,%lld,%lld,%lld,%lld,%lld,%lld,%lld,%lld,"
+                "%lld,%lld,%lld,%lld,"
+                "%lld,%lld,%lld,%lld,%lld,%lld,"
+                "%lld,%lld,%lld,%lld,%lld,%lld\n",
+                stats->cycles, stats->retired, cpi, stats->loadUseStalls,
+                stats->branches, stats->branchFlushes, mispredictRate,
+                stats->forwardEXMEM, stats->forwardMEMWB, stats->forwardWBEND,
+                stats->icacheHits, stats->icacheMisses, icacheHitRate,
+                stats->dcacheHits, stats->dcacheMisses, dcacheHitRate,
+                stats->fetchStallCycles, stats->memStallCycles,
+                stats->icachePrefetches, stats->icachePrefetchUseful,
+                stats->icachePrefetchLate, stats->icachePrefetchPolluting,
+                stats->dcachePrefetches, stats->dcachePrefetchUseful,
+                stats->dcachePrefetchLate, stats->dcachePrefetchPolluting,
+                stats->dcacheMemReads, stats->dcacheMemWrites,
+                stats->icacheVictimHits, stats->icacheVictimEvictions,
+                stats->dcacheVictimHits, stats->dcacheVictimEvictions,
+                stats->l2Hits, stats->l2Misses, stats->l2Writebacks,
+                stats->l3Hits, stats->l3Misses, stats->l3Writebacks,
+                stats->coherenceReads, stats->coherenceReadExclusives, stats->coherenceUpgrades,
+                stats->coherenceWritebacks, stats->coherenceInvalidations,
+                stats->coherenceInterventions);
+    }
+    else {
+        fputc('{', out);
+        if (job != NULL) {
+            fputs("\"job\": ", out);
+            writeQuoted(out, format, job);
+            fputs(", ", out);
+        }
+        fprintf(out, "\"cycles\": %lld, \"retired\": %lld, \"cpi\": %.4f, "
+                "\"loadUseStalls\": %lld, \"branches\": %lld, \"branchFlushes\": %lld, "
+                "\"mispredictRate\": %.4f, "
+                "\"forwarding\": {\"EXMEM\": %lld, \"MEMWB\": %lld, \"WBEND\": %lld}, "
+                "\"icache\": {\"hits\": %lld, \"misses\": %lld, \"hitRate\": %.4f, \"stallCycles\": %lld, "
+                "\"prefetch\": {\"issued\": %lld, \"useful\": %lld, \"late\": %lld, \"polluting\": %lld}, "
+                "\"victim\": {\"hits\": %lld, \"evictions\": %lld}}, "
+                "\"dcache\": {\"hits\": %lld, \"misses\": %lld, \"hitRate\": %.4f, \"stallCycles\": %lld, "
+                "\"prefetch\": {\"issued\": %lld, \"useful\": %lld, \"late\": %lld, \"polluting\": %lld}, "
+                "\"victim\": {\"hits\": %lld, \"evictions\": %lld}, "
+                "\"memReads\": %lld, \"memWrites\": %lld}, "
+                "\"l2\": {\"hits\": %lld, \"misses\": %lld, \"writebacks\": %lld}, "
+                "\"l3\": {\"hits\": %lld, \"misses\": %lld, \"writebacks\": %lld}, "
+                "\"coherence\": {\"reads\": %lld, \"readExclusives\": %lld, \"upgrades\": %lld, "
+                "\"writebacks\": %lld, \"invalidations\": %lld, \"interventions\": %lld}}\n",
+                stats->cycles, stats->retired, cpi, stats->loadUseStalls,
+                stats->branches, stats->branchFlushes, mispredictRate,
+                stats->forwardEXMEM, stats->forwardMEMWB, stats->forwardWBEND,
+                stats->icacheHits, stats->icacheMisses, icacheHitRate, stats->fetchStallCycles,
+                stats->icachePrefetches, stats->icachePrefetchUseful,
+                stats->icachePrefetchLate, stats->icachePrefetchPolluting,
+                stats->icacheVictimHits, stats->icacheVictimEvictions,
+                stats->dcacheHits, stats->dcacheMisses, dcacheHitRate, stats->memStallCycles,
+                stats->dcachePrefetches, stats->dcachePrefetchUseful,
+                stats->dcachePrefetchLate, stats->dcachePrefetchPolluting,
+                stats->dcacheVictimHits, stats->dcacheVictimEvictions,
+                stats->dcacheMemReads, stats->dcacheMemWrites,
+                stats->l2Hits, stats->l2Misses, stats->l2Writebacks,
+                stats->l3Hits, stats->l3Misses, stats->l3Writebacks,
+                stats->coherenceReads, stats->coherenceReadExclusives, stats->coherenceUpgrades,
+                stats->coherenceWritebacks, stats->coherenceInvalidations,
+                stats->coherenceInterventions);
+    }
+}
+
+// Per-PC stall and flush counts, for every address that has either
+void stats_write_profile(FILE *out, int format, const statsType *stats,
+        const int *instrMem, int numEntries) {
+    int first = 1;
+    if (format == STATS_CSV) {
+        fprintf(out, "pc,instruction,stalls,flushes\n");
+    }
+    else {
+        fprintf(out, "[");
+    }
+    for (int pc = 0; pc < numEntries; ++pc) {
+        if (!stats->pcStalls[pc] && !stats->pcFlushes[pc]) {
+            continue;
+        }
+        if (format == STATS_CSV) {
+            fprintf(out, "%d,%d,%u,%u\n", pc, instrMem[pc], stats->pcStalls[pc],
+                    stats->pcFlushes[pc]);
+        }
+        else {
+            fprintf(out, "%s\n  {\"pc\": %d, \"instruction\": %d, \"stalls\": %u, \"flushes\": %u}",
+                    first ? "" : ",", pc, instrMem[pc], stats->pcStalls[pc],
+                    stats->pcFlushes[pc]);
+        }
+        first = 0;
+    }
+    if (format != STATS_CSV) {
+        fprintf(out, "\n]\n");
+    }
+}
@@ -0,0 +1,74 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+
+/*
+ * Pipeline performance counters, bumped from the hazard paths in
+ * simulator.c. The per-PC histograms are indexed by instruction address
+ * and are only allocated when a profile was asked for. Checkpoints save the
+ * counters as one block, so they must all be long longs ahead of those.
+ */
+typedef struct statsStruct {
+    long long cycles;
+    long long retired; // instructions that left WB, plus the halt
+    long long loadUseStalls; // bubbles inserted by the lw stall in ID
+    long long branches; // beqs resolved in MEM
+    long long branchFlushes; // mispredicted beqs squashing IF/ID, ID/EX, EX/MEM
+    long long forwardEXMEM; // operands forwarded into EX, by source
+    long long forwardMEMWB;
+    long long forwardWBEND;
+    long long icacheHits; // copied from the caches, when attached
+    long long icacheMisses;
+    long long dcacheHits;
+    long long dcacheMisses;
+    long long fetchStallCycles; // IF waiting on the instruction cache
+    long long memStallCycles; // IF through MEM waiting on the data cache
+    long long icachePrefetches; // the caches' prefetcher counters (see cache.h)
+    long long icachePrefetchUseful;
+    long long icachePrefetchLate;
+    long long icachePrefetchPolluting;
+    long long dcachePrefetches;
+    long long dcachePrefetchUseful;
+    long long dcachePrefetchLate;
+    long long dcachePrefetchPolluting;
+    long long dcacheMemReads; // words the data cache read from memory
+    long long dcacheMemWrites; // ... and wrote to it
+    long long icacheVictimHits; // the caches' victim cache counters (see cache.h)
+    long long icacheVictimEvictions;
+    long long dcacheVictimHits;
+    long long dcacheVictimEvictions;
+    long long l2Hits; // the cache levels under the data cache, when attached
+    long long l2Misses;
+    long long l2Writebacks;
+    long long l3Hits;
+    long long l3Misses;
+    long long l3Writebacks;
+    long long coherenceReads; // a core's bus requests in a multicore run (see coherence.h)
+    long long coherenceReadExclusives;
+    long long coherenceUpgrades;
+    long long coherenceWritebacks;
+    long long coherenceInvalidations;
+    long long coherenceInterventions;
+    unsigned int *pcStalls; // stalls charged to the stalled instruction
+    unsigned int *pcFlushes; // flushes charged to the taken beq
+} statsType;
+
+enum statsFormat
+{
+    STATS_JSON,
+    STATS_CSV
+};
+
+int stats_format_for(const char *filename);
+void stats_enable_profile(statsType *stats, int numEntries);
+void stats_free(statsType *stats);
+void stats_save(const statsType *stats, int numEntries, FILE *out);
+void stats_restore(statsType *stats, int numEntries, FILE *in);
+void stats_write(FILE *out, int format, const statsType *stats, int header);
+void stats_write_job(FILE *out, int format, const statsType *stats, int header,
+        const char *job);
+void stats_write_profile(FILE *out, int format, const statsType *stats,
+        const int *instrMem, int numEntries);
+
+#endif
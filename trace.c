@@ -0,0 +1,403 @@
+#define _GNU_SOURCE // fputs_unlocked, fwrite_unlocked
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+#define TRACE_BUFSIZE (1 << 20) // stdio buffer given to traceOut
+
+// Only one thread ever traces: batch jobs and the cores of a multicore run
+// refuse trace output of their own (see simulator.c), so stdio's per-call
+// locking can be skipped. Tracing from those threads would need it back.
+#ifdef __GLIBC__
+#define traceWrite fputs_unlocked
+#define traceWriteWords fwrite_unlocked
+#else
+#define traceWrite fputs
+#define traceWriteWords fwrite
+#endif
+
+int traceLevel = TRACE_FULL;
+FILE *traceOut = NULL;
+FILE *traceBinary = NULL;
+FILE *traceAddress = NULL;
+
+static int traceReady = 0;
+static int *stateWords = NULL; // see trace_state_words
+static int stateWordsSize = 0;
+
+// Give the text stream its large buffer the first time anything is traced
+static void traceSetup() {
+    if (traceReady) {
+        return;
+    }
+    traceReady = 1;
+    if (traceOut == NULL) {
+        traceOut = stdout;
+    }
+    fflush(traceOut);
+    setvbuf(traceOut, NULL, _IOFBF, TRACE_BUFSIZE);
+}
+
+int trace_parse_level(const char *name) {
+    if (!strcmp(name, "off")) {
+        return TRACE_OFF;
+    }
+    else if (!strcmp(name, "final")) {
+        return TRACE_FINAL;
+    }
+    else if (!strcmp(name, "diff")) {
+        return TRACE_DIFF;
+    }
+    else if (!strcmp(name, "full")) {
+        return TRACE_FULL;
+    }
+    return -1;
+}
+
+void trace_open_binary(const char *filename, enum traceKind kind) {
+    traceBinary = fopen(filename, "wb");
+    if (traceBinary == NULL) {
+        printf("error: can't open trace file %s\n", filename);
+        exit(1);
+    }
+    setvbuf(traceBinary, NULL, _IOFBF, TRACE_BUFSIZE);
+    int header[2] = {TRACE_MAGIC, kind};
+    fwrite(header, sizeof(int), 2, traceBinary);
+}
+
+/*
+ * Pick up TRACE_LEVEL (off, final, diff or full) and TRACE_BINARY (a file
+ * name) from the environment. This is how the cache, which has no command
+ * line of its own, is configured.
+ */
+void trace_init_from_env(enum traceKind kind) {
+    traceSetup();
+    char *level = getenv("TRACE_LEVEL");
+    if (level != NULL && trace_parse_level(level) >= 0) {
+        traceLevel = trace_parse_level(level);
+    }
+    char *binary = getenv("TRACE_BINARY");
+    if (binary != NULL && *binary && traceBinary == NULL) {
+        trace_open_binary(binary, kind);
+    }
+}
+
+void trace_close() {
+    if (traceOut != NULL) {
+        fflush(traceOut);
+    }
+    if (traceBinary != NULL) {
+        fclose(traceBinary);
+        traceBinary = NULL;
+    }
+    if (traceAddress != NULL) {
+        fclose(traceAddress);
+        traceAddress = NULL;
+    }
+    free(stateWords);
+    stateWords = NULL;
+    stateWordsSize = 0;
+}
+
+/* ------------------------- text output ------------------------- */
+
+void trace_puts(const char *s) {
+    traceSetup();
+    traceWrite(s, traceOut);
+}
+
+// printf("%d") without the format string parsing
+void trace_putint(int value) {
+    trace_putlong(value);
+}
+
+void trace_putlong(long long value) {
+    char buf[24];
+    char *p = buf + sizeof(buf);
+    unsigned long long u = (value < 0) ? -(unsigned long long)value : (unsigned long long)value;
+    *--p = '\0';
+    do {
+        *--p = '0' + u % 10;
+        u /= 10;
+    } while (u);
+    if (value < 0) {
+        *--p = '-';
+    }
+    trace_puts(p);
+}
+
+// Print "<text><value>\n"
+static void putField(const char *text, int value) {
+    trace_puts(text);
+    trace_putint(value);
+    trace_puts("\n");
+}
+
+// Print "<text><value>" and the Don't Care marker if asked
+static void putFieldCare(const char *text, int value, int dontCare) {
+    trace_puts(text);
+    trace_putint(value);
+    trace_puts(dontCare ? " (Don't Care)\n" : "\n");
+}
+
+void trace_print_instruction(int instr) {
+    static const char *names[] = {"add", "nor", "lw", "sw", "beq", "jalr", "halt", "noop"};
+    int op = opcode(instr);
+    if (op < ADD || op > NOOP) {
+        trace_puts(".fill ");
+        trace_putint(instr);
+        return;
+    }
+    trace_puts(names[op]);
+    trace_puts(" ");
+    trace_putint(field0(instr));
+    trace_puts(" ");
+    trace_putint(field1(instr));
+    trace_puts(" ");
+    trace_putint(field2(instr));
+}
+
+static void putInstruction(const char *text, int instr) {
+    trace_puts(text);
+    trace_putint(instr);
+    trace_puts(" ( ");
+    trace_print_instruction(instr);
+    trace_puts(" )\n");
+}
+
+// The legacy printState text
+/*
+ * Room for numWords words of data memory to pass to trace_print_state,
+ * kept from one state to the next (until trace_close) rather than
+ * allocated for every traced cycle.
+ */
+int *trace_state_words(int numWords) {
+    if (numWords > stateWordsSize) {
+        free(stateWords);
+        stateWords = malloc(numWords * sizeof(int));
+        if (stateWords == NULL) {
+            printf("error: out of memory\n");
+            exit(1);
+        }
+        stateWordsSize = numWords;
+    }
+    return stateWords;
+}
+
+void trace_print_state(const traceStateType *st, const int *dataMem, int numMemory) {
+    trace_puts("\n@@@\n");
+    trace_puts("state before cycle ");
+    trace_putint(st->cycles);
+    trace_puts(" starts:\n");
+    putField("\tpc = ", st->pc);
+
+    trace_puts("\tdata memory:\n");
+    for (int i=0; i<numMemory; ++i) {
+        trace_puts("\t\tdataMem[ ");
+        trace_putint(i);
+        putField(" ] = ", dataMem[i]);
+    }
+    trace_puts("\tregisters:\n");
+    for (int i=0; i<NUMREGS; ++i) {
+        trace_puts("\t\treg[ ");
+        trace_putint(i);
+        putField(" ] = ", st->reg[i]);
+    }
+
+    // IF/ID
+    trace_puts("\tIF/ID pipeline register:\n");
+    putInstruction("\t\tinstruction = ", st->ifidInstr);
+    putFieldCare("\t\tpcPlus1 = ", st->ifidPcPlus1, opcode(st->ifidInstr) == NOOP);
+
+    // ID/EX
+    int idexOp = opcode(st->idexInstr);
+    trace_puts("\tID/EX pipeline register:\n");
+    putInstruction("\t\tinstruction = ", st->idexInstr);
+    putFieldCare("\t\tpcPlus1 = ", st->idexPcPlus1, idexOp == NOOP);
+    putFieldCare("\t\treadRegA = ", st->idexReadRegA, idexOp >= HALT || idexOp < 0);
+    putFieldCare("\t\treadRegB = ", st->idexReadRegB, idexOp == LW || idexOp > BEQ || idexOp < 0);
+    putFieldCare("\t\toffset = ", st->idexOffset, idexOp != LW && idexOp != SW && idexOp != BEQ);
+
+    // EX/MEM
+    int exmemOp = opcode(st->exmemInstr);
+    trace_puts("\tEX/MEM pipeline register:\n");
+    putInstruction("\t\tinstruction = ", st->exmemInstr);
+    putFieldCare("\t\tbranchTarget ", st->exmemBranchTarget, exmemOp != BEQ);
+    trace_puts(st->exmemEq ? "\t\teq ? True" : "\t\teq ? False");
+    trace_puts(exmemOp != BEQ ? " (Don't Care)\n" : "\n");
+    putFieldCare("\t\taluResult = ", st->exmemAluResult, exmemOp > SW || exmemOp < 0);
+    putFieldCare("\t\treadRegB = ", st->exmemReadRegB, exmemOp != SW);
+
+    // MEM/WB
+    int memwbOp = opcode(st->memwbInstr);
+    trace_puts("\tMEM/WB pipeline register:\n");
+    putInstruction("\t\tinstruction = ", st->memwbInstr);
+    putFieldCare("\t\twriteData = ", st->memwbWriteData, memwbOp >= SW || memwbOp < 0);
+
+    // WB/END
+    int wbendOp = opcode(st->wbendInstr);
+    trace_puts("\tWB/END pipeline register:\n");
+    putInstruction("\t\tinstruction = ", st->wbendInstr);
+    putFieldCare("\t\twriteData = ", st->wbendWriteData, wbendOp >= SW || wbendOp < 0);
+
+    trace_puts("end state\n");
+}
+
+#define DIFF_FIELD(name, field) \
+    if (prev->field != st->field) { \
+        putField("\t" name " = ", st->field); \
+    }
+#define DIFF_INSTR(name, field) \
+    if (prev->field != st->field) { \
+        putInstruction("\t" name " = ", st->field); \
+    }
+
+/*
+ * One "@@@ cycle N" block listing only the fields that differ from the
+ * previous state. memAddr is the store committed since then, or -1.
+ */
+void trace_print_state_diff(const traceStateType *prev, const traceStateType *st,
+        int memAddr, int memData) {
+    trace_puts("@@@ cycle ");
+    trace_putint(st->cycles);
+    trace_puts("\n");
+    DIFF_FIELD("pc", pc);
+    if (memAddr >= 0) {
+        trace_puts("\tdataMem[ ");
+        trace_putint(memAddr);
+        putField(" ] = ", memData);
+    }
+    for (int i=0; i<NUMREGS; ++i) {
+        if (prev->reg[i] != st->reg[i]) {
+            trace_puts("\treg[ ");
+            trace_putint(i);
+            putField(" ] = ", st->reg[i]);
+        }
+    }
+    DIFF_INSTR("IF/ID.instruction", ifidInstr);
+    DIFF_FIELD("IF/ID.pcPlus1", ifidPcPlus1);
+    DIFF_INSTR("ID/EX.instruction", idexInstr);
+    DIFF_FIELD("ID/EX.pcPlus1", idexPcPlus1);
+    DIFF_FIELD("ID/EX.readRegA", idexReadRegA);
+    DIFF_FIELD("ID/EX.readRegB", idexReadRegB);
+    DIFF_FIELD("ID/EX.offset", idexOffset);
+    DIFF_INSTR("EX/MEM.instruction", exmemInstr);
+    DIFF_FIELD("EX/MEM.branchTarget", exmemBranchTarget);
+    DIFF_FIELD("EX/MEM.eq", exmemEq);
+    DIFF_FIELD("EX/MEM.aluResult", exmemAluResult);
+    DIFF_FIELD("EX/MEM.readRegB", exmemReadRegB);
+    DIFF_INSTR("MEM/WB.instruction", memwbInstr);
+    DIFF_FIELD("MEM/WB.writeData", memwbWriteData);
+    DIFF_INSTR("WB/END.instruction", wbendInstr);
+    DIFF_FIELD("WB/END.writeData", wbendWriteData);
+}
+
+/*
+ * The legacy printAction text. type is cache.c's enum actionType:
+ * cacheToProcessor, processorToCache, memoryToCache, cacheToMemory,
+ * cacheToNowhere, in that order.
+ */
+void trace_print_action(int address, int size, int type) {
+    static const char *directions[] = {
+        "from the cache to the processor\n",
+        "from the processor to the cache\n",
+        "from the memory to the cache\n",
+        "from the cache to the memory\n",
+        "from the cache to nowhere\n",
+        "from the processor to the memory\n"
+    };
+    trace_puts("$$$ transferring word [");
+    trace_putint(address);
+    trace_puts("-");
+    trace_putint(address + size - 1);
+    trace_puts("] ");
+    if (type >= 0 && type < 6) {
+        trace_puts(directions[type]);
+    }
+}
+
+/* ------------------------ binary records ----------------------- */
+
+static void writeRecord(int type, const int *payload, int count) {
+    unsigned char tag = type;
+    fwrite(&tag, 1, 1, traceBinary);
+    fwrite(payload, sizeof(int), count, traceBinary);
+}
+
+void trace_write_program(const int *words, int numWords) {
+    fwrite(&numWords, sizeof(int), 1, traceBinary);
+    fwrite(words, sizeof(int), numWords, traceBinary);
+}
+
+void trace_write_state(const traceStateType *st) {
+    writeRecord(TRACE_REC_STATE, (const int *)st, sizeof(traceStateType) / sizeof(int));
+}
+
+void trace_write_memwrite(int addr, int data) {
+    int payload[2] = {addr, data};
+    writeRecord(TRACE_REC_MEMWRITE, payload, 2);
+}
+
+void trace_write_halt(int cycles) {
+    writeRecord(TRACE_REC_HALT, &cycles, 1);
+}
+
+void trace_write_action(int address, int size, int type) {
+    int payload[3] = {address, size, type};
+    writeRecord(TRACE_REC_ACTION, payload, 3);
+}
+
+/* ------------------------ address traces ----------------------- */
+
+void trace_open_address(const char *filename) {
+    traceAddress = fopen(filename, "wb");
+    if (traceAddress == NULL) {
+        printf("error: can't open trace file %s\n", filename);
+        exit(1);
+    }
+    setvbuf(traceAddress, NULL, _IOFBF, TRACE_BUFSIZE);
+    int header[2] = {TRACE_MAGIC, TRACE_KIND_ADDRESS};
+    fwrite(header, sizeof(int), 2, traceAddress);
+}
+
+void trace_write_address(int addr, int type) {
+    unsigned int word = ((unsigned int)addr << TRACE_ACCESS_BITS) | type;
+    traceWriteWords(&word, sizeof(word), 1, traceAddress);
+}
+
+/*
+ * Map an address trace read-only into memory and return its records,
+ * setting *count. The mapping lives until the process exits.
+ */
+const unsigned int *trace_map_address(const char *filename, size_t *count) {
+    int fd = open(filename, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        printf("error: can't open file %s\n", filename);
+        exit(1);
+    }
+    size_t size = st.st_size;
+    if (size < 2 * sizeof(int) || (size - 2 * sizeof(int)) % sizeof(unsigned int) != 0) {
+        printf("error: %s is not an address trace\n", filename);
+        exit(1);
+    }
+    const int *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        printf("error: can't map file %s\n", filename);
+        exit(1);
+    }
+    close(fd);
+    if (map[0] != TRACE_MAGIC || map[1] != TRACE_KIND_ADDRESS) {
+        printf("error: %s is not an address trace\n", filename);
+        exit(1);
+    }
+    madvise((void *)map, size, MADV_SEQUENTIAL);
+    *count = (size - 2 * sizeof(int)) / sizeof(unsigned int);
+    return (const unsigned int *)(map + 2);
+}
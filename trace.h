@@ -0,0 +1,125 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdio.h>
+
+#include "lc2k.h"
+
+/*
+ * Trace output shared by the pipeline simulator and the cache.
+ *
+ * Text goes to traceOut (stdout unless redirected), which is given a large
+ * stdio buffer so other writers to the same stream stay in order. How much
+ * is printed depends on traceLevel:
+ *  -    TRACE_OFF: nothing but the halt summary
+ *  -    TRACE_FINAL: only the final machine state
+ *  -    TRACE_DIFF: the fields that changed each cycle
+ *  -    TRACE_FULL: the legacy per-cycle printState / printAction output
+ *
+ * Independently of the level, every record can also be written to a compact
+ * binary file, which tracedecode turns back into the TRACE_FULL text.
+ */
+enum traceLevel
+{
+    TRACE_OFF,
+    TRACE_FINAL,
+    TRACE_DIFF,
+    TRACE_FULL
+};
+
+extern int traceLevel;
+extern FILE *traceOut;
+extern FILE *traceBinary; // NULL unless binary records were requested
+extern FILE *traceAddress; // NULL unless an address trace was requested
+
+// Everything printState shows, with raw instruction words in the latches
+typedef struct traceStateStruct {
+    int cycles;
+    int pc;
+    int reg[NUMREGS];
+    int ifidInstr;
+    int ifidPcPlus1;
+    int idexInstr;
+    int idexPcPlus1;
+    int idexReadRegA;
+    int idexReadRegB;
+    int idexOffset;
+    int exmemInstr;
+    int exmemBranchTarget;
+    int exmemEq;
+    int exmemAluResult;
+    int exmemReadRegB;
+    int memwbInstr;
+    int memwbWriteData;
+    int wbendInstr;
+    int wbendWriteData;
+} traceStateType;
+
+/*
+ * Binary format: a header of TRACE_MAGIC, the stream kind and, for pipeline
+ * traces, the loaded program (word count then words). It is followed by
+ * records, each a one byte type and a fixed payload of ints:
+ *  -    TRACE_REC_STATE: a traceStateType, the state before a cycle
+ *  -    TRACE_REC_MEMWRITE: address, data of a committed store
+ *  -    TRACE_REC_HALT: cycles executed, followed by the final state
+ *  -    TRACE_REC_ACTION: address, size, type of a cache transfer
+ *
+ * Address traces (TRACE_KIND_ADDRESS) are for the cachesim tool. After the
+ * two header ints they are a bare array of unsigned ints, one per memory
+ * access: the word address shifted left by two, or'ed with the
+ * traceAccessType. The array runs to the end of the file.
+ */
+#define TRACE_MAGIC 0x3154434c // "LCT1"
+
+enum traceKind
+{
+    TRACE_KIND_PIPELINE = 1,
+    TRACE_KIND_CACHE = 2,
+    TRACE_KIND_ADDRESS = 3
+};
+
+enum traceRecordType
+{
+    TRACE_REC_STATE = 1,
+    TRACE_REC_MEMWRITE,
+    TRACE_REC_HALT,
+    TRACE_REC_ACTION
+};
+
+enum traceAccessType
+{
+    TRACE_ACCESS_READ, // lw
+    TRACE_ACCESS_WRITE, // sw
+    TRACE_ACCESS_FETCH // instruction fetch
+};
+
+#define TRACE_ACCESS_BITS 2
+#define TRACE_ACCESS_MASK 3
+
+int trace_parse_level(const char *name);
+void trace_open_binary(const char *filename, enum traceKind kind);
+void trace_init_from_env(enum traceKind kind);
+void trace_close();
+
+void trace_puts(const char *s);
+void trace_putint(int value);
+void trace_putlong(long long value);
+
+void trace_print_instruction(int instr);
+void trace_print_state(const traceStateType *st, const int *dataMem, int numMemory);
+int *trace_state_words(int numWords);
+void trace_print_state_diff(const traceStateType *prev, const traceStateType *st,
+        int memAddr, int memData);
+void trace_print_action(int address, int size, int type);
+
+void trace_write_program(const int *words, int numWords);
+void trace_write_state(const traceStateType *st);
+void trace_write_memwrite(int addr, int data);
+void trace_write_halt(int cycles);
+void trace_write_action(int address, int size, int type);
+
+void trace_open_address(const char *filename);
+void trace_write_address(int addr, int type);
+const unsigned int *trace_map_address(const char *filename, size_t *count);
+
+#endif
@@ -0,0 +1,108 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "lc2k.h"
+#include "trace.h"
+
+/*
+ * Rebuild the legacy text output from a binary trace written with
+ * --trace-binary (simulator) or TRACE_BINARY (cache).
+ *
+ * usage: tracedecode <trace file>
+ */
+
+static FILE *in;
+
+static int readInts(int *dst, int count) {
+    return fread(dst, sizeof(int), count, in) == (size_t)count;
+}
+
+static void truncated() {
+    printf("error: trace file is truncated\n");
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        printf("error: usage: %s <trace file>\n", argv[0]);
+        exit(1);
+    }
+    in = fopen(argv[1], "rb");
+    if (in == NULL) {
+        printf("error: can't open file %s\n", argv[1]);
+        exit(1);
+    }
+
+    int header[2];
+    if (!readInts(header, 2) || header[0] != TRACE_MAGIC) {
+        printf("error: %s is not a trace file\n", argv[1]);
+        exit(1);
+    }
+
+    if (header[1] == TRACE_KIND_ADDRESS) {
+        printf("error: %s is an address trace, run it through cachesim\n", argv[1]);
+        exit(1);
+    }
+
+    int *dataMem = calloc(NUMMEMORY, sizeof(int));
+    int numMemory = 0;
+    if (header[1] == TRACE_KIND_PIPELINE) {
+        if (!readInts(&numMemory, 1) || numMemory < 0 || numMemory > NUMMEMORY
+                || !readInts(dataMem, numMemory)) {
+            truncated();
+        }
+        trace_puts("instruction memory:\n");
+        for (int i = 0; i < numMemory; ++i) {
+            trace_puts("\tinstrMem[ ");
+            trace_putint(i);
+            trace_puts(" ] = ");
+            trace_print_instruction(dataMem[i]);
+            trace_puts("\n");
+        }
+    }
+
+    int type;
+    while ((type = fgetc(in)) != EOF) {
+        traceStateType st;
+        int payload[3];
+        switch (type) {
+            case TRACE_REC_STATE:
+                if (!readInts((int *)&st, sizeof(st) / sizeof(int))) {
+                    truncated();
+                }
+                trace_print_state(&st, dataMem, numMemory);
+                break;
+            case TRACE_REC_MEMWRITE:
+                if (!readInts(payload, 2)) {
+                    truncated();
+                }
+                if (payload[0] >= 0 && payload[0] < NUMMEMORY) {
+                    dataMem[payload[0]] = payload[1];
+                }
+                break;
+            case TRACE_REC_HALT:
+                if (!readInts(payload, 1)) {
+                    truncated();
+                }
+                trace_puts("machine halted\n");
+                trace_puts("total of ");
+                trace_putint(payload[0]);
+                trace_puts(" cycles executed\n");
+                trace_puts("final state of machine:\n");
+                break;
+            case TRACE_REC_ACTION:
+                if (!readInts(payload, 3)) {
+                    truncated();
+                }
+                trace_print_action(payload[0], payload[1], payload[2]);
+                break;
+            default:
+                printf("error: unknown record type %d\n", type);
+                exit(1);
+        }
+    }
+    trace_close();
+    fclose(in);
+    free(dataMem);
+    return 0;
+}
@@ -0,0 +1,237 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lc2k.h"
+#include "workload.h"
+
+static const char *kindNames[] = {"loaduse", "branch", "forward", "stride", "random"};
+
+// Constant pool slots, at words 1..NUM_CONSTANTS
+enum workloadConstant
+{
+    CONST_ITERATIONS = 1,
+    CONST_MINUS_ONE,
+    CONST_ONE,
+    CONST_STEP, // words between stream accesses
+    CONST_INNER, // inner loop count of the streams
+    CONST_BASE, // stride: the array, random: the offset table
+    NUM_CONSTANTS = CONST_BASE
+};
+
+/*
+ * Registers: 0 is zero, 1 the outer loop count, 2 holds -1, 3 the stream
+ * pointer, 4 to 7 scratch (and 5 the stream step, 6 the inner count).
+ */
+
+typedef struct emitStruct {
+    int *words;
+    int numWords;
+    int maxWords;
+} emitType;
+
+static void emit(emitType *e, int word) {
+    if (e->numWords == e->maxWords) {
+        printf("error: workload has more than %d words\n", e->maxWords);
+        exit(1);
+    }
+    e->words[e->numWords++] = word;
+}
+
+static void emitR(emitType *e, int op, int regA, int regB, int dest) {
+    emit(e, (op << 22) | (regA << 19) | (regB << 16) | dest);
+}
+
+static void emitI(emitType *e, int op, int regA, int regB, int offset) {
+    emit(e, (op << 22) | (regA << 19) | (regB << 16) | (offset & 0xFFFF));
+}
+
+// beq back to target, which has already been emitted
+static void emitBranchTo(emitType *e, int regA, int regB, int target) {
+    emitI(e, BEQ, regA, regB, target - e->numWords - 1);
+}
+
+// Point the beq at word at (a forward branch) to the next word emitted
+static void patchBranch(emitType *e, int at) {
+    e->words[at] = (e->words[at] & ~0xFFFF) | ((e->numWords - at - 1) & 0xFFFF);
+}
+
+static int parsePositive(const char *key, const char *value, int *out) {
+    char *end;
+    long n = strtol(value, &end, 10);
+    if (*value == '\0' || *end != '\0' || n <= 0 || n > 0x7fffffff) {
+        printf("error: workload %s must be a positive number\n", key);
+        return -1;
+    }
+    *out = (int)n;
+    return 0;
+}
+
+int workload_parse(const char *spec, workloadType *w) {
+    char buf[256];
+    if (strlen(spec) >= sizeof(buf)) {
+        printf("error: workload %s is too long\n", spec);
+        return -1;
+    }
+    strcpy(buf, spec);
+
+    char *save;
+    char *name = strtok_r(buf, ",", &save);
+    w->kind = -1;
+    for (int i = 0; name != NULL && i < (int)(sizeof(kindNames) / sizeof(kindNames[0])); ++i) {
+        if (!strcmp(name, kindNames[i])) {
+            w->kind = i;
+        }
+    }
+    if (w->kind < 0) {
+        printf("error: unknown workload %s\n", name != NULL ? name : spec);
+        return -1;
+    }
+    w->iterations = 10000;
+    w->length = 16;
+    w->distance = 1;
+    w->stride = 1;
+    w->footprint = 4096;
+    w->seed = 1;
+
+    for (char *field = strtok_r(NULL, ",", &save); field != NULL; field = strtok_r(NULL, ",", &save)) {
+        char *value = strchr(field, '=');
+        if (value == NULL) {
+            printf("error: workload parameter %s must be key=value\n", field);
+            return -1;
+        }
+        *value++ = '\0';
+        int n;
+        if (parsePositive(field, value, &n) < 0) {
+            return -1;
+        }
+        if (!strcmp(field, "iterations")) {
+            w->iterations = n;
+        }
+        else if (!strcmp(field, "length")) {
+            w->length = n;
+        }
+        else if (!strcmp(field, "distance")) {
+            w->distance = n;
+        }
+        else if (!strcmp(field, "stride")) {
+            w->stride = n;
+        }
+        else if (!strcmp(field, "footprint")) {
+            w->footprint = n;
+        }
+        else if (!strcmp(field, "seed")) {
+            w->seed = n;
+        }
+        else {
+            printf("error: unknown workload parameter %s\n", field);
+            return -1;
+        }
+    }
+    if (w->distance > 3) {
+        printf("error: workload distance must be 1 to 3\n");
+        return -1;
+    }
+    return 0;
+}
+
+const char *workload_name(int kind) {
+    return kindNames[kind];
+}
+
+// The body of loaduse, branch and forward: length steps, no loop of its own
+static void emitBody(emitType *e, const workloadType *w) {
+    for (int i = 0; i < w->length; ++i) {
+        if (w->kind == WORK_LOADUSE) {
+            emitI(e, LW, 0, 4, CONST_ONE);
+            emitR(e, ADD, 4, 4, 5);
+        }
+        else if (w->kind == WORK_BRANCH) {
+            emitI(e, BEQ, 0, 0, 0);
+        }
+        else {
+            // Chain i % distance reads what it wrote distance instructions ago
+            int reg = 4 + i % w->distance;
+            emitR(e, NOR, reg, reg, reg);
+        }
+    }
+}
+
+// One step of a stream: the address is in reg 3 (stride) or at reg 3 (random)
+static void emitStreamStep(emitType *e, const workloadType *w, int step) {
+    int addrReg = 3;
+    if (w->kind == WORK_RANDOM) {
+        emitI(e, LW, 3, 4, 0);
+        addrReg = 4;
+    }
+    emitI(e, step % 2 ? SW : LW, addrReg, 7, 0);
+    emitR(e, ADD, 3, 5, 3);
+}
+
+int workload_generate(const workloadType *w, int *words, int maxWords) {
+    emitType e = {words, 0, maxWords};
+    int stream = w->kind == WORK_STRIDE || w->kind == WORK_RANDOM;
+    int perIteration = stream ? w->footprint / (w->kind == WORK_STRIDE ? w->stride : 1) : w->length;
+    if (perIteration < w->length) {
+        printf("error: workload footprint is less than one unrolled pass\n");
+        exit(1);
+    }
+
+    emitI(&e, BEQ, 0, 0, NUM_CONSTANTS);
+    for (int i = 0; i < NUM_CONSTANTS; ++i) {
+        emit(&e, 0);
+    }
+    words[CONST_ITERATIONS] = w->iterations;
+    words[CONST_MINUS_ONE] = -1;
+    words[CONST_ONE] = 1;
+    words[CONST_STEP] = w->kind == WORK_STRIDE ? w->stride : 1;
+    words[CONST_INNER] = perIteration / w->length;
+
+    emitI(&e, LW, 0, 1, CONST_ITERATIONS);
+    emitI(&e, LW, 0, 2, CONST_MINUS_ONE);
+    if (stream) {
+        emitI(&e, LW, 0, 5, CONST_STEP);
+    }
+    int outer = e.numWords;
+    if (stream) {
+        emitI(&e, LW, 0, 3, CONST_BASE);
+        emitI(&e, LW, 0, 6, CONST_INNER);
+        int inner = e.numWords;
+        for (int i = 0; i < w->length; ++i) {
+            emitStreamStep(&e, w, i);
+        }
+        emitR(&e, ADD, 6, 2, 6);
+        int innerDone = e.numWords;
+        emitI(&e, BEQ, 6, 0, 0);
+        emitBranchTo(&e, 0, 0, inner);
+        patchBranch(&e, innerDone);
+    }
+    else {
+        emitBody(&e, w);
+    }
+    emitR(&e, ADD, 1, 2, 1);
+    int done = e.numWords;
+    emitI(&e, BEQ, 1, 0, 0);
+    emitBranchTo(&e, 0, 0, outer);
+    patchBranch(&e, done);
+    emit(&e, HALT << 22);
+
+    // Stride walks an array past the end of the program; random reads its
+    // addresses from a table there and scatters them over the array after it
+    int base = e.numWords;
+    int dataEnd = base + w->footprint;
+    if (w->kind == WORK_RANDOM) {
+        unsigned int rng = w->seed;
+        for (int i = 0; i < w->footprint; ++i) {
+            rng = rng * 1103515245 + 12345;
+            emit(&e, base + w->footprint + (int)((rng >> 8) % w->footprint));
+        }
+        dataEnd += w->footprint;
+    }
+    if (stream && dataEnd > NUMMEMORY) {
+        printf("error: workload data ends past address %d\n", NUMMEMORY);
+        exit(1);
+    }
+    words[CONST_BASE] = base;
+    return e.numWords;
+}
@@ -0,0 +1,56 @@
+#ifndef WORKLOAD_H
+#define WORKLOAD_H
+
+/*
+ * Synthetic LC-2K programs that stress one part of the pipeline or the
+ * caches at a time, generated straight as machine code. Every workload is
+ * an outer loop run `iterations` times around a body of `length` steps:
+ *
+ *   loaduse  lw followed by an add that uses the loaded register, so every
+ *            step takes the load-use stall
+ *   branch   beq 0 0 0: always taken, always to the next instruction, so
+ *            every step is a flush unless the predictor learns it
+ *   forward  `distance` (1 to 3) interleaved nor chains, so every operand
+ *            comes from EXMEM, MEMWB or WBEND respectively
+ *   stride   lw and sw, alternating, walking `footprint` words of data
+ *            `stride` words apart; `length` is the unrolling of the walk
+ *   random   the same, but to addresses read from a table of `footprint`
+ *            random offsets (seeded by `seed`) into a `footprint` word array
+ *
+ * Constants live in a small pool at the start of the program, jumped over
+ * by the first instruction; the data the streams walk comes after the code.
+ */
+enum workloadKind
+{
+    WORK_LOADUSE,
+    WORK_BRANCH,
+    WORK_FORWARD,
+    WORK_STRIDE,
+    WORK_RANDOM
+};
+
+typedef struct workloadStruct {
+    int kind; // enum workloadKind
+    int iterations;
+    int length;
+    int distance; // forward only
+    int stride; // stride only, in words
+    int footprint; // stride and random, in words
+    unsigned int seed; // random only
+} workloadType;
+
+/*
+ * Parse "kind[,key=value...]", e.g. "stride,stride=4,footprint=8192",
+ * leaving the keys not given at their defaults. Returns 0 on success, -1
+ * with a message printed otherwise.
+ */
+int workload_parse(const char *spec, workloadType *w);
+const char *workload_name(int kind);
+
+/*
+ * Generate w into words[0..maxWords-1] and return the number of words,
+ * code and data. A workload that does not fit is an error.
+ */
+int workload_generate(const workloadType *w, int *words, int maxWords);
+
+#endif